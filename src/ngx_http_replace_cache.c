@@ -0,0 +1,606 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef DDEBUG
+#define DDEBUG 0
+#endif
+#include "ddebug.h"
+
+
+#include "ngx_http_replace_cache.h"
+
+
+typedef struct {
+    ngx_rbtree_t                rbtree;
+    ngx_rbtree_node_t           sentinel;
+    ngx_queue_t                 queue;  /* the least recently used last */
+} ngx_http_replace_cache_sh_t;
+
+
+typedef struct {
+    ngx_http_replace_cache_sh_t    *sh;
+    ngx_slab_pool_t                *shpool;
+} ngx_http_replace_cache_t;
+
+
+typedef struct {
+    ngx_rbtree_node_t           node;
+    ngx_queue_t                 queue;
+    size_t                      key_len;
+    size_t                      len;
+    u_char                      data[1];  /* the key, then the output */
+} ngx_http_replace_cache_node_t;
+
+
+static ngx_int_t ngx_http_replace_cache_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static void ngx_http_replace_cache_rbtree_insert_value(
+    ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel);
+static ngx_http_replace_cache_node_t *ngx_http_replace_cache_find(
+    ngx_http_replace_cache_t *cache, ngx_http_replace_cache_ctx_t *cc);
+static ngx_int_t ngx_http_replace_cache_store(ngx_http_request_t *r,
+    ngx_http_replace_cache_t *cache, ngx_http_replace_cache_ctx_t *cc);
+
+
+char *
+ngx_http_replace_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_replace_loc_conf_t  *rlcf = conf;
+
+    u_char                            *p;
+    ssize_t                            size, max_size;
+    ngx_str_t                         *value, name, s;
+    ngx_uint_t                         i;
+    ngx_http_replace_cache_t          *cache;
+    ngx_http_complex_value_t          *key;
+    ngx_http_compile_complex_value_t   ccv;
+
+    if (rlcf->cache_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts != 2) {
+            return "takes no other parameters with \"off\"";
+        }
+
+        rlcf->cache_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    size = 0;
+    max_size = NGX_HTTP_REPLACE_CACHE_MAX_SIZE;
+    name.len = 0;
+    key = NULL;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            name.data = value[i].data + 5;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+
+            if (p) {
+                name.len = p - name.data;
+
+                s.data = p + 1;
+                s.len = value[i].data + value[i].len - s.data;
+
+                size = ngx_parse_size(&s);
+
+                if (size == NGX_ERROR) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "invalid zone size \"%V\"", &value[i]);
+                    return NGX_CONF_ERROR;
+                }
+
+                if (size < (ssize_t) (8 * ngx_pagesize)) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "zone \"%V\" is too small", &value[i]);
+                    return NGX_CONF_ERROR;
+                }
+
+            } else {
+                name.len = value[i].len - 5;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "key=", 4) == 0) {
+
+            s.data = value[i].data + 4;
+            s.len = value[i].len - 4;
+
+            key = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+            if (key == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+            ccv.cf = cf;
+            ccv.value = &s;
+            ccv.complex_value = key;
+
+            if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "max_size=", 9) == 0) {
+
+            s.data = value[i].data + 9;
+            s.len = value[i].len - 9;
+
+            max_size = ngx_parse_size(&s);
+
+            if (max_size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid max_size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (key == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"key\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    rlcf->cache_zone = ngx_shared_memory_add(cf, &name, size,
+                                             &ngx_http_replace_filter_module);
+    if (rlcf->cache_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (rlcf->cache_zone->data == NULL) {
+        cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_replace_cache_t));
+        if (cache == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        rlcf->cache_zone->init = ngx_http_replace_cache_init_zone;
+        rlcf->cache_zone->data = cache;
+    }
+
+    rlcf->cache_key = key;
+    rlcf->cache_max_size = (size_t) max_size;
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * Hashes everything that defines the output of the rules into the 64 bits
+ * of rlcf->rules_hash, so that the cached outputs of different rule sets
+ * are practically never mixed up. Returns NGX_DECLINED when a replacement
+ * uses nginx variables, since the output may then differ for the same key.
+ */
+
+ngx_int_t
+ngx_http_replace_cache_init_rules(ngx_http_replace_loc_conf_t *rlcf)
+{
+    int                                 *flags;
+    u_char                             **re;
+    u_char                               digest[16];
+    ngx_md5_t                            md5;
+    ngx_uint_t                           i, *limit;
+    ngx_http_replace_complex_value_t    *cv;
+
+    re = rlcf->regexes.elts;
+    flags = rlcf->multi_flags.elts;
+    limit = rlcf->multi_limit.elts;
+    cv = rlcf->multi_replace.elts;
+
+    ngx_md5_init(&md5);
+
+    for (i = 0; i < rlcf->regexes.nelts; i++) {
+
+        if (cv[i].nginx_variables) {
+            return NGX_DECLINED;
+        }
+
+        ngx_md5_update(&md5, re[i], ngx_strlen(re[i]) + 1);
+        ngx_md5_update(&md5, &flags[i], sizeof(int));
+        ngx_md5_update(&md5, &limit[i], sizeof(ngx_uint_t));
+        ngx_md5_update(&md5, cv[i].value.data, cv[i].value.len);
+        ngx_md5_update(&md5, "", 1);
+    }
+
+    /* the overflows and the engine decide which matches are replaced */
+
+    ngx_md5_update(&md5, &rlcf->max_buffered_size, sizeof(size_t));
+    ngx_md5_update(&md5, &rlcf->overflow, sizeof(ngx_uint_t));
+    ngx_md5_update(&md5, &rlcf->engine, sizeof(ngx_uint_t));
+    ngx_md5_update(&md5, &rlcf->max_replacements, sizeof(ngx_uint_t));
+    ngx_md5_update(&md5, &rlcf->scan_limit, sizeof(size_t));
+    ngx_md5_update(&md5, rlcf->stop_at.data, rlcf->stop_at.len);
+
+    ngx_md5_final(digest, &md5);
+
+    ngx_memcpy(&rlcf->rules_hash, digest, sizeof(uint64_t));
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_replace_cache_lookup(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx)
+{
+    u_char                           *p;
+    ngx_str_t                         key;
+    ngx_http_replace_cache_t         *cache;
+    ngx_http_replace_cache_ctx_t     *cc;
+    ngx_http_replace_cache_node_t    *cn;
+    ngx_http_replace_loc_conf_t      *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_replace_filter_module);
+
+    if (r->headers_out.status != NGX_HTTP_OK) {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_http_complex_value(r, rlcf->cache_key, &key) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (key.len == 0) {
+        return NGX_DECLINED;
+    }
+
+    cc = ngx_pcalloc(r->pool, sizeof(ngx_http_replace_cache_ctx_t));
+    if (cc == NULL) {
+        return NGX_ERROR;
+    }
+
+    cc->key.len = sizeof(uint64_t) + key.len;
+
+    cc->key.data = ngx_pnalloc(r->pool, cc->key.len);
+    if (cc->key.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(cc->key.data, &rlcf->rules_hash, sizeof(uint64_t));
+    ngx_memcpy(p, key.data, key.len);
+
+    cc->hash = ngx_crc32_short(cc->key.data, cc->key.len);
+
+    cache = rlcf->cache_zone->data;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    cn = ngx_http_replace_cache_find(cache, cc);
+
+    if (cn) {
+        ngx_queue_remove(&cn->queue);
+        ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+        cc->data = ngx_pnalloc(r->pool, cn->len);
+        if (cc->data == NULL) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(cc->data, cn->data + cn->key_len, cn->len);
+
+        cc->len = cn->len;
+        cc->size = cn->len;
+        cc->hit = 1;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "replace filter cache %s: \"%V\"",
+                   cc->hit ? "hit" : "miss", &key);
+
+    ctx->cache = cc;
+
+    return cc->hit ? NGX_OK : NGX_DECLINED;
+}
+
+
+/*
+ * Appends the data of the output chain to the entry to store, and stores
+ * it at the end of the response. Gives up on the responses too large, or
+ * with data in files.
+ */
+
+ngx_int_t
+ngx_http_replace_cache_collect(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, ngx_chain_t *in)
+{
+    u_char                         *p;
+    size_t                          size, n;
+    ngx_int_t                       rc;
+    ngx_buf_t                      *b;
+    ngx_chain_t                    *cl;
+    ngx_http_replace_cache_ctx_t   *cc;
+    ngx_http_replace_loc_conf_t    *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_replace_filter_module);
+
+    cc = ctx->cache;
+
+    for (cl = in; cl; cl = cl->next) {
+        b = cl->buf;
+
+        if (!ngx_buf_in_memory(b)) {
+            if (ngx_buf_size(b)) {
+                dd("not caching data in files");
+                ctx->cache = NULL;
+                return NGX_OK;
+            }
+
+            size = 0;
+
+        } else {
+            size = b->last - b->pos;
+        }
+
+        if (size) {
+
+            if (cc->len + size > rlcf->cache_max_size) {
+                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                               "replace filter cache: output exceeds %uz",
+                               rlcf->cache_max_size);
+
+                ctx->cache = NULL;
+                return NGX_OK;
+            }
+
+            if (cc->len + size > cc->size) {
+                n = ngx_max(cc->len + size, 2 * cc->size);
+                n = ngx_min(n, rlcf->cache_max_size);
+
+                p = ngx_pnalloc(r->pool, n);
+                if (p == NULL) {
+                    return NGX_ERROR;
+                }
+
+                if (cc->len) {
+                    ngx_memcpy(p, cc->data, cc->len);
+                }
+
+                cc->data = p;
+                cc->size = n;
+            }
+
+            ngx_memcpy(cc->data + cc->len, b->pos, size);
+            cc->len += size;
+        }
+
+        if (b->last_buf || b->last_in_chain) {
+            rc = ngx_http_replace_cache_store(r, rlcf->cache_zone->data, cc);
+            ctx->cache = NULL;
+            return rc;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_replace_cache_store(ngx_http_request_t *r,
+    ngx_http_replace_cache_t *cache, ngx_http_replace_cache_ctx_t *cc)
+{
+    size_t                            size;
+    ngx_queue_t                      *q;
+    ngx_http_replace_cache_node_t    *cn, *old;
+
+    size = offsetof(ngx_http_replace_cache_node_t, data)
+           + cc->key.len + cc->len;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if (ngx_http_replace_cache_find(cache, cc)) {
+        /* stored by another request in the meantime */
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_OK;
+    }
+
+    for ( ;; ) {
+        cn = ngx_slab_alloc_locked(cache->shpool, size);
+        if (cn) {
+            break;
+        }
+
+        if (ngx_queue_empty(&cache->sh->queue)) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+
+            ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                          "replace filter cache: could not allocate %uz "
+                          "bytes in zone", size);
+            return NGX_OK;
+        }
+
+        /* evict the least recently used entry */
+
+        q = ngx_queue_last(&cache->sh->queue);
+        old = ngx_queue_data(q, ngx_http_replace_cache_node_t, queue);
+
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&cache->sh->rbtree, &old->node);
+        ngx_slab_free_locked(cache->shpool, old);
+    }
+
+    cn->node.key = cc->hash;
+    cn->key_len = cc->key.len;
+    cn->len = cc->len;
+
+    ngx_memcpy(cn->data, cc->key.data, cc->key.len);
+
+    if (cc->len) {
+        ngx_memcpy(cn->data + cc->key.len, cc->data, cc->len);
+    }
+
+    ngx_rbtree_insert(&cache->sh->rbtree, &cn->node);
+    ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "replace filter cache: stored %uz bytes", cc->len);
+
+    return NGX_OK;
+}
+
+
+static ngx_http_replace_cache_node_t *
+ngx_http_replace_cache_find(ngx_http_replace_cache_t *cache,
+    ngx_http_replace_cache_ctx_t *cc)
+{
+    ngx_int_t                         rc;
+    ngx_rbtree_node_t                *node, *sentinel;
+    ngx_http_replace_cache_node_t    *cn;
+
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (cc->hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (cc->hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* cc->hash == node->key */
+
+        cn = (ngx_http_replace_cache_node_t *) node;
+
+        rc = ngx_memn2cmp(cc->key.data, cn->data, cc->key.len, cn->key_len);
+
+        if (rc == 0) {
+            return cn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_replace_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t               **p;
+    ngx_http_replace_cache_node_t    *cn, *cnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            cn = (ngx_http_replace_cache_node_t *) node;
+            cnt = (ngx_http_replace_cache_node_t *) temp;
+
+            p = (ngx_memn2cmp(cn->data, cnt->data, cn->key_len, cnt->key_len)
+                 < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_int_t
+ngx_http_replace_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_replace_cache_t  *ocache = data;
+
+    size_t                     len;
+    ngx_http_replace_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(cache->shpool,
+                               sizeof(ngx_http_replace_cache_sh_t));
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_http_replace_cache_rbtree_insert_value);
+
+    ngx_queue_init(&cache->sh->queue);
+
+    len = sizeof(" in replace filter cache zone \"\"") + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->shpool->log_ctx,
+                " in replace filter cache zone \"%V\"%Z", &shm_zone->shm.name);
+
+    /* the least recently used entries are evicted on failures */
+    cache->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
@@ -0,0 +1,44 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef _NGX_HTTP_REPLACE_CACHE_H_INCLUDED_
+#define _NGX_HTTP_REPLACE_CACHE_H_INCLUDED_
+
+
+#include "ngx_http_replace_filter_module.h"
+
+
+#define NGX_HTTP_REPLACE_CACHE_MAX_SIZE  (256 * 1024)
+
+
+/*
+ * The filtered output of a response for replace_filter_cache: the output
+ * stored under the key when ctx->cache->hit is set, or the output collected
+ * so far otherwise.
+ */
+
+struct ngx_http_replace_cache_ctx_s {
+    ngx_str_t                   key;  /* the rules hash and the key */
+    uint32_t                    hash;
+
+    u_char                     *data;
+    size_t                      len;
+    size_t                      size;  /* allocated */
+
+    unsigned                    hit:1;
+    unsigned                    sent:1;
+};
+
+
+char *ngx_http_replace_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_http_replace_cache_init_rules(ngx_http_replace_loc_conf_t *rlcf);
+ngx_int_t ngx_http_replace_cache_lookup(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx);
+ngx_int_t ngx_http_replace_cache_collect(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, ngx_chain_t *in);
+
+
+#endif /* _NGX_HTTP_REPLACE_CACHE_H_INCLUDED_ */
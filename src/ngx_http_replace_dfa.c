@@ -0,0 +1,615 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef DDEBUG
+#define DDEBUG 0
+#endif
+#include "ddebug.h"
+
+
+#include "ngx_http_replace_dfa.h"
+
+
+/*
+ * A lazily built DFA that recognizes where a match of any of the rules may
+ * end. It never reports matches itself: it only tells the Pike VM where it
+ * can safely (re)start, that is the last offset before which no thread can
+ * lead to a match. sregex's program is opaque to us, so the underlying NFA
+ * is compiled from the module's own regex parse tree instead.
+ */
+
+
+#define NGX_HTTP_REPLACE_NFA_BYTES  0
+#define NGX_HTTP_REPLACE_NFA_SPLIT  1
+#define NGX_HTTP_REPLACE_NFA_JMP    2
+#define NGX_HTTP_REPLACE_NFA_MATCH  3
+
+
+#define NGX_HTTP_REPLACE_NFA_MAX_INSTS    16384
+#define NGX_HTTP_REPLACE_DFA_BUCKETS      1024
+
+
+static ngx_int_t ngx_http_replace_nfa_emit(ngx_array_t *a,
+    ngx_http_replace_re_t *re);
+static ngx_http_replace_nfa_inst_t *ngx_http_replace_nfa_push(ngx_array_t *a,
+    ngx_uint_t op);
+static void ngx_http_replace_dfa_classes(ngx_http_replace_dfa_t *dfa);
+static void ngx_http_replace_dfa_add(ngx_http_replace_dfa_t *dfa,
+    ngx_uint_t *n, uint32_t pc);
+static ngx_http_replace_dfa_state_t *ngx_http_replace_dfa_step(
+    ngx_http_replace_dfa_t *dfa, ngx_http_replace_dfa_state_t *s,
+    ngx_uint_t c, ngx_log_t *log);
+static ngx_http_replace_dfa_state_t *ngx_http_replace_dfa_state(
+    ngx_http_replace_dfa_t *dfa, ngx_uint_t n, ngx_log_t *log);
+static int ngx_libc_cdecl ngx_http_replace_dfa_cmp(const void *one,
+    const void *two);
+
+
+ngx_int_t
+ngx_http_replace_dfa_create(ngx_pool_t *pool, ngx_http_replace_re_t **res,
+    ngx_uint_t n, size_t max_size, ngx_http_replace_dfa_t **out)
+{
+    uint32_t                        *starts;
+    ngx_int_t                        rc;
+    ngx_uint_t                       i, m;
+    ngx_array_t                     *a;
+    ngx_http_replace_dfa_t          *dfa;
+
+    dfa = ngx_pcalloc(pool, sizeof(ngx_http_replace_dfa_t));
+    if (dfa == NULL) {
+        return NGX_ERROR;
+    }
+
+    starts = ngx_palloc(pool, n * sizeof(uint32_t));
+    if (starts == NULL) {
+        return NGX_ERROR;
+    }
+
+    a = ngx_array_create(pool, 64, sizeof(ngx_http_replace_nfa_inst_t));
+    if (a == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (res[i] == NULL) {
+            return NGX_DECLINED;
+        }
+
+        starts[i] = (uint32_t) a->nelts;
+
+        rc = ngx_http_replace_nfa_emit(a, res[i]);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        if (ngx_http_replace_nfa_push(a, NGX_HTTP_REPLACE_NFA_MATCH) == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (a->nelts > NGX_HTTP_REPLACE_NFA_MAX_INSTS) {
+        return NGX_DECLINED;
+    }
+
+    dfa->insts = a->elts;
+    dfa->ninsts = a->nelts;
+
+    dfa->pool = pool;
+    dfa->max_size = max_size;
+
+    ngx_http_replace_dfa_classes(dfa);
+
+    /* the closure stack may hold up to two entries per instruction */
+
+    dfa->sparse = ngx_pcalloc(pool, (4 * dfa->ninsts + 1) * sizeof(uint32_t));
+    if (dfa->sparse == NULL) {
+        return NGX_ERROR;
+    }
+
+    dfa->dense = dfa->sparse + dfa->ninsts;
+    dfa->stack = dfa->dense + dfa->ninsts;
+
+    dfa->buckets = ngx_pcalloc(pool, NGX_HTTP_REPLACE_DFA_BUCKETS
+                                     * sizeof(ngx_http_replace_dfa_state_t *));
+    if (dfa->buckets == NULL) {
+        return NGX_ERROR;
+    }
+
+    /*
+     * the threads that may start at any offset are kept apart from the
+     * states, so that the empty start state means no thread in progress
+     */
+
+    m = 0;
+
+    for (i = 0; i < n; i++) {
+        ngx_http_replace_dfa_add(dfa, &m, starts[i]);
+    }
+
+    dfa->first = ngx_palloc(pool, m * sizeof(uint32_t));
+    if (dfa->first == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < m; i++) {
+        switch (dfa->insts[dfa->dense[i]].op) {
+
+        case NGX_HTTP_REPLACE_NFA_BYTES:
+            dfa->first[dfa->nfirst++] = dfa->dense[i];
+            break;
+
+        case NGX_HTTP_REPLACE_NFA_MATCH:
+            /* a nullable rule */
+            return NGX_DECLINED;
+
+        default:
+            break;
+        }
+    }
+
+    dfa->start = ngx_http_replace_dfa_state(dfa, 0, pool->log);
+    if (dfa->start == NULL) {
+        return NGX_ERROR;
+    }
+
+    dd("dfa: %d nfa insts, %d byte classes", (int) dfa->ninsts,
+       (int) dfa->nclasses);
+
+    *out = dfa;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Runs the DFA from its start state over [p, last) and stops as soon as a
+ * match may end. *idle is set to the last offset at which the DFA was back
+ * in its start state: no match can start before it.
+ */
+
+ngx_int_t
+ngx_http_replace_dfa_exec(ngx_http_replace_dfa_t *dfa,
+    ngx_http_replace_scan_t *scan, u_char *p, u_char *last, u_char **idle,
+    ngx_log_t *log)
+{
+    u_char                          *q;
+    ngx_uint_t                       c;
+    ngx_http_replace_dfa_state_t    *s, *t;
+
+    s = dfa->start;
+    q = p;
+
+    while (p < last) {
+
+        if (s == dfa->start) {
+            if (scan) {
+                p = ngx_http_replace_scan(scan, p, last);
+            }
+
+            q = p;
+
+            if (p == last) {
+                break;
+            }
+        }
+
+        c = dfa->classes[*p];
+        t = s->next[c];
+
+        if (t == NULL) {
+            t = ngx_http_replace_dfa_step(dfa, s, c, log);
+
+            if (t == NULL) {
+                if (dfa->full) {
+                    /* let the Pike VM take it from here */
+                    break;
+                }
+
+                return NGX_ERROR;
+            }
+        }
+
+        s = t;
+        p++;
+
+        if (s->accept) {
+            break;
+        }
+    }
+
+    *idle = (p == last && s == dfa->start) ? last : q;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_replace_nfa_emit(ngx_array_t *a, ngx_http_replace_re_t *re)
+{
+    ngx_int_t                        rc, k;
+    ngx_uint_t                       split, jmp;
+    ngx_http_replace_nfa_inst_t     *inst;
+
+    if (a->nelts > NGX_HTTP_REPLACE_NFA_MAX_INSTS) {
+        return NGX_DECLINED;
+    }
+
+    switch (re->type) {
+
+    case NGX_HTTP_REPLACE_RE_EMPTY:
+        return NGX_OK;
+
+    case NGX_HTTP_REPLACE_RE_BYTES:
+        inst = ngx_http_replace_nfa_push(a, NGX_HTTP_REPLACE_NFA_BYTES);
+        if (inst == NULL) {
+            return NGX_ERROR;
+        }
+
+        inst->set = re->set;
+        inst->x = (uint32_t) a->nelts;
+        return NGX_OK;
+
+    case NGX_HTTP_REPLACE_RE_GROUP:
+        return ngx_http_replace_nfa_emit(a, re->x);
+
+    case NGX_HTTP_REPLACE_RE_CAT:
+        rc = ngx_http_replace_nfa_emit(a, re->x);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        return ngx_http_replace_nfa_emit(a, re->y);
+
+    case NGX_HTTP_REPLACE_RE_ALT:
+        split = a->nelts;
+
+        if (ngx_http_replace_nfa_push(a, NGX_HTTP_REPLACE_NFA_SPLIT) == NULL) {
+            return NGX_ERROR;
+        }
+
+        rc = ngx_http_replace_nfa_emit(a, re->x);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        jmp = a->nelts;
+
+        if (ngx_http_replace_nfa_push(a, NGX_HTTP_REPLACE_NFA_JMP) == NULL) {
+            return NGX_ERROR;
+        }
+
+        inst = a->elts;
+        inst[split].x = (uint32_t) split + 1;
+        inst[split].y = (uint32_t) a->nelts;
+
+        rc = ngx_http_replace_nfa_emit(a, re->y);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        inst = a->elts;
+        inst[jmp].x = (uint32_t) a->nelts;
+        return NGX_OK;
+
+    case NGX_HTTP_REPLACE_RE_REPEAT:
+
+        /* x{m,n} is compiled as m copies of x followed by n - m x? */
+
+        for (k = 0; k < re->min; k++) {
+            rc = ngx_http_replace_nfa_emit(a, re->x);
+            if (rc != NGX_OK) {
+                return rc;
+            }
+        }
+
+        if (re->max == NGX_HTTP_REPLACE_UNBOUNDED) {
+            split = a->nelts;
+
+            if (ngx_http_replace_nfa_push(a, NGX_HTTP_REPLACE_NFA_SPLIT)
+                == NULL)
+            {
+                return NGX_ERROR;
+            }
+
+            rc = ngx_http_replace_nfa_emit(a, re->x);
+            if (rc != NGX_OK) {
+                return rc;
+            }
+
+            inst = ngx_http_replace_nfa_push(a, NGX_HTTP_REPLACE_NFA_JMP);
+            if (inst == NULL) {
+                return NGX_ERROR;
+            }
+
+            inst->x = (uint32_t) split;
+
+            inst = a->elts;
+            inst[split].x = (uint32_t) split + 1;
+            inst[split].y = (uint32_t) a->nelts;
+            return NGX_OK;
+        }
+
+        for (k = re->min; k < re->max; k++) {
+            split = a->nelts;
+
+            if (ngx_http_replace_nfa_push(a, NGX_HTTP_REPLACE_NFA_SPLIT)
+                == NULL)
+            {
+                return NGX_ERROR;
+            }
+
+            rc = ngx_http_replace_nfa_emit(a, re->x);
+            if (rc != NGX_OK) {
+                return rc;
+            }
+
+            inst = a->elts;
+            inst[split].x = (uint32_t) split + 1;
+            inst[split].y = (uint32_t) a->nelts;
+        }
+
+        return NGX_OK;
+
+    default: /* NGX_HTTP_REPLACE_RE_ASSERT */
+        return NGX_DECLINED;
+    }
+}
+
+
+static ngx_http_replace_nfa_inst_t *
+ngx_http_replace_nfa_push(ngx_array_t *a, ngx_uint_t op)
+{
+    ngx_http_replace_nfa_inst_t     *inst;
+
+    inst = ngx_array_push(a);
+    if (inst == NULL) {
+        return NULL;
+    }
+
+    inst->op = op;
+    inst->set = NULL;
+    inst->x = 0;
+    inst->y = 0;
+
+    return inst;
+}
+
+
+/* splits the bytes into the classes that no rule can tell apart */
+
+static void
+ngx_http_replace_dfa_classes(ngx_http_replace_dfa_t *dfa)
+{
+    ngx_uint_t                       i, b, c, nclasses;
+    ngx_uint_t                       in[256], total[256], split[256];
+    ngx_http_replace_nfa_inst_t     *inst;
+
+    ngx_memzero(dfa->classes, sizeof(dfa->classes));
+    nclasses = 1;
+
+    for (i = 0; i < dfa->ninsts; i++) {
+        inst = &dfa->insts[i];
+
+        if (inst->op != NGX_HTTP_REPLACE_NFA_BYTES) {
+            continue;
+        }
+
+        ngx_memzero(in, nclasses * sizeof(ngx_uint_t));
+        ngx_memzero(total, nclasses * sizeof(ngx_uint_t));
+
+        for (b = 0; b < 256; b++) {
+            c = dfa->classes[b];
+
+            total[c]++;
+
+            if (ngx_http_replace_bitmap_test(inst->set, b)) {
+                in[c]++;
+            }
+        }
+
+        for (c = 0; c < nclasses; c++) {
+            split[c] = (in[c] && in[c] != total[c]) ? nclasses++ : c;
+        }
+
+        for (b = 0; b < 256; b++) {
+            if (ngx_http_replace_bitmap_test(inst->set, b)) {
+                dfa->classes[b] = (u_char) split[dfa->classes[b]];
+            }
+        }
+    }
+
+    for (b = 256; b > 0; b--) {
+        dfa->reps[dfa->classes[b - 1]] = (u_char) (b - 1);
+    }
+
+    dfa->nclasses = nclasses;
+}
+
+
+/* adds the epsilon closure of "pc" to the sparse set */
+
+static void
+ngx_http_replace_dfa_add(ngx_http_replace_dfa_t *dfa, ngx_uint_t *n,
+    uint32_t pc)
+{
+    ngx_uint_t                       top;
+    ngx_http_replace_nfa_inst_t     *inst;
+
+    top = 0;
+    dfa->stack[top++] = pc;
+
+    while (top) {
+        pc = dfa->stack[--top];
+
+        if (dfa->sparse[pc] < *n && dfa->dense[dfa->sparse[pc]] == pc) {
+            continue;
+        }
+
+        dfa->sparse[pc] = (uint32_t) *n;
+        dfa->dense[(*n)++] = pc;
+
+        inst = &dfa->insts[pc];
+
+        switch (inst->op) {
+
+        case NGX_HTTP_REPLACE_NFA_SPLIT:
+            dfa->stack[top++] = inst->y;
+            dfa->stack[top++] = inst->x;
+            break;
+
+        case NGX_HTTP_REPLACE_NFA_JMP:
+            dfa->stack[top++] = inst->x;
+            break;
+
+        default:
+            break;
+        }
+    }
+}
+
+
+static ngx_http_replace_dfa_state_t *
+ngx_http_replace_dfa_step(ngx_http_replace_dfa_t *dfa,
+    ngx_http_replace_dfa_state_t *s, ngx_uint_t c, ngx_log_t *log)
+{
+    u_char                           b;
+    uint32_t                         pc;
+    ngx_uint_t                       i, n;
+    ngx_http_replace_dfa_state_t    *t;
+    ngx_http_replace_nfa_inst_t     *inst;
+
+    b = dfa->reps[c];
+    n = 0;
+
+    /* a new match may start at every offset */
+
+    for (i = 0; i < dfa->nfirst; i++) {
+        inst = &dfa->insts[dfa->first[i]];
+
+        if (ngx_http_replace_bitmap_test(inst->set, b)) {
+            ngx_http_replace_dfa_add(dfa, &n, inst->x);
+        }
+    }
+
+    for (i = 0; i < s->ninsts; i++) {
+        pc = s->insts[i];
+        inst = &dfa->insts[pc];
+
+        if (inst->op == NGX_HTTP_REPLACE_NFA_BYTES
+            && ngx_http_replace_bitmap_test(inst->set, b))
+        {
+            ngx_http_replace_dfa_add(dfa, &n, inst->x);
+        }
+    }
+
+    t = ngx_http_replace_dfa_state(dfa, n, log);
+    if (t == NULL) {
+        return NULL;
+    }
+
+    s->next[c] = t;
+
+    return t;
+}
+
+
+/*
+ * Looks up or creates the state made of the BYTES and MATCH instructions
+ * in the sparse set.
+ */
+
+static ngx_http_replace_dfa_state_t *
+ngx_http_replace_dfa_state(ngx_http_replace_dfa_t *dfa, ngx_uint_t n,
+    ngx_log_t *log)
+{
+    size_t                           size;
+    uint32_t                         hash, pc, *insts;
+    ngx_uint_t                       i, m, accept;
+    ngx_http_replace_dfa_state_t    *s;
+
+    insts = dfa->stack;
+    accept = 0;
+    m = 0;
+
+    for (i = 0; i < n; i++) {
+        pc = dfa->dense[i];
+
+        switch (dfa->insts[pc].op) {
+
+        case NGX_HTTP_REPLACE_NFA_BYTES:
+            insts[m++] = pc;
+            break;
+
+        case NGX_HTTP_REPLACE_NFA_MATCH:
+            accept = 1;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    ngx_qsort(insts, m, sizeof(uint32_t), ngx_http_replace_dfa_cmp);
+
+    hash = ngx_crc32_short((u_char *) insts, m * sizeof(uint32_t));
+    hash = hash * 2 + accept;
+
+    for (s = dfa->buckets[hash % NGX_HTTP_REPLACE_DFA_BUCKETS];
+         s;
+         s = s->hnext)
+    {
+        if (s->hash == hash
+            && s->ninsts == m
+            && s->accept == accept
+            && ngx_memcmp(s->insts, insts, m * sizeof(uint32_t)) == 0)
+        {
+            return s;
+        }
+    }
+
+    size = sizeof(ngx_http_replace_dfa_state_t)
+           + dfa->nclasses * sizeof(ngx_http_replace_dfa_state_t *)
+           + m * sizeof(uint32_t);
+
+    if (dfa->size + size > dfa->max_size) {
+        ngx_log_error(NGX_LOG_INFO, log, 0,
+                      "replace filter: dfa state cache is full (%uz bytes), "
+                      "falling back to the pike vm", dfa->size);
+
+        dfa->full = 1;
+        return NULL;
+    }
+
+    s = ngx_pcalloc(dfa->pool, size);
+    if (s == NULL) {
+        return NULL;
+    }
+
+    dfa->size += size;
+
+    s->next = (ngx_http_replace_dfa_state_t **) &s[1];
+    s->insts = (uint32_t *) &s->next[dfa->nclasses];
+    s->ninsts = m;
+    s->hash = hash;
+    s->accept = accept;
+
+    ngx_memcpy(s->insts, insts, m * sizeof(uint32_t));
+
+    s->hnext = dfa->buckets[hash % NGX_HTTP_REPLACE_DFA_BUCKETS];
+    dfa->buckets[hash % NGX_HTTP_REPLACE_DFA_BUCKETS] = s;
+
+    return s;
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_replace_dfa_cmp(const void *one, const void *two)
+{
+    uint32_t    a = *(uint32_t *) one;
+    uint32_t    b = *(uint32_t *) two;
+
+    return (a > b) - (a < b);
+}
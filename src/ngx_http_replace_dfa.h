@@ -0,0 +1,78 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef _NGX_HTTP_REPLACE_DFA_H_INCLUDED_
+#define _NGX_HTTP_REPLACE_DFA_H_INCLUDED_
+
+
+#include <nginx.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+#include "ngx_http_replace_regex.h"
+#include "ngx_http_replace_scan.h"
+
+
+typedef struct {
+    ngx_uint_t                      op;
+    uint8_t                        *set;
+    uint32_t                        x;
+    uint32_t                        y;
+} ngx_http_replace_nfa_inst_t;
+
+
+typedef struct ngx_http_replace_dfa_state_s  ngx_http_replace_dfa_state_t;
+
+struct ngx_http_replace_dfa_state_s {
+    ngx_http_replace_dfa_state_t   *hnext;
+    ngx_http_replace_dfa_state_t  **next;  /* per byte class, NULL when
+                                              not computed yet */
+    uint32_t                       *insts;
+    ngx_uint_t                      ninsts;
+    uint32_t                        hash;
+
+    unsigned                        accept:1;
+};
+
+
+typedef struct {
+    ngx_http_replace_nfa_inst_t    *insts;
+    ngx_uint_t                      ninsts;
+
+    uint32_t                       *first;  /* the BYTES instructions a
+                                               match can start with */
+    ngx_uint_t                      nfirst;
+
+    u_char                          classes[256];
+    u_char                          reps[256];  /* a byte of each class */
+    ngx_uint_t                      nclasses;
+
+    ngx_http_replace_dfa_state_t   *start;  /* no thread in progress */
+    ngx_http_replace_dfa_state_t  **buckets;
+
+    /* scratch space for the subset construction */
+    uint32_t                       *sparse;
+    uint32_t                       *dense;
+    uint32_t                       *stack;
+
+    ngx_pool_t                     *pool;
+    size_t                          size;
+    size_t                          max_size;
+
+    unsigned                        full:1;
+} ngx_http_replace_dfa_t;
+
+
+ngx_int_t ngx_http_replace_dfa_create(ngx_pool_t *pool,
+    ngx_http_replace_re_t **res, ngx_uint_t n, size_t max_size,
+    ngx_http_replace_dfa_t **out);
+ngx_int_t ngx_http_replace_dfa_exec(ngx_http_replace_dfa_t *dfa,
+    ngx_http_replace_scan_t *scan, u_char *p, u_char *last, u_char **idle,
+    ngx_log_t *log);
+
+
+#endif /* _NGX_HTTP_REPLACE_DFA_H_INCLUDED_ */
@@ -0,0 +1,881 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef DDEBUG
+#define DDEBUG 0
+#endif
+#include "ddebug.h"
+
+
+#include "ngx_http_replace_engine.h"
+#include "ngx_http_replace_scan.h"
+#include "ngx_http_replace_dfa.h"
+#include "ngx_http_replace_thread.h"
+#include "ngx_http_replace_util.h"
+
+
+enum {
+    /* do not bother resetting the VM for shorter runs of dead bytes */
+    NGX_HTTP_REPLACE_MIN_SKIP = 32,
+
+    /* how much data the VM sees before we check whether it is idle again */
+    NGX_HTTP_REPLACE_VM_CHUNK = 128,
+
+    /* how far the JIT gate looks ahead, on top of the longest match */
+    NGX_HTTP_REPLACE_JIT_WINDOW = 4096
+};
+
+
+static sre_regex_t *ngx_http_replace_sregex_parse(ngx_conf_t *cf,
+    ngx_http_replace_loc_conf_t *rlcf, sre_pool_t *ppool);
+static ngx_int_t ngx_http_replace_sregex_compile(ngx_conf_t *cf,
+    ngx_http_replace_loc_conf_t *rlcf);
+static ngx_int_t ngx_http_replace_sregex_create_ctx(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx);
+static sre_int_t ngx_http_replace_sregex_exec(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, u_char *input, size_t size, unsigned eof,
+    sre_int_t **pending_matched);
+static ngx_int_t ngx_http_replace_sregex_restart(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, sre_int_t offset);
+static void ngx_http_replace_sregex_reset(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx);
+static void ngx_http_replace_find_stop_at(ngx_http_replace_ctx_t *ctx,
+    ngx_http_replace_loc_conf_t *rlcf, u_char *input, size_t size,
+    sre_int_t offset);
+static ngx_int_t ngx_http_replace_jit_gate(ngx_http_replace_ctx_t *ctx,
+    ngx_http_replace_loc_conf_t *rlcf, u_char *p, u_char *last,
+    unsigned eof);
+static sre_int_t ngx_http_replace_vm_exec(ngx_http_replace_ctx_t *ctx,
+    ngx_http_replace_loc_conf_t *rlcf, u_char *input, size_t size,
+    unsigned eof, sre_int_t **pending_matched);
+
+
+ngx_http_replace_backend_t  ngx_http_replace_sregex_backend = {
+    ngx_string("sregex"),
+    ngx_http_replace_sregex_compile,
+    ngx_http_replace_sregex_create_ctx,
+    ngx_http_replace_sregex_exec,
+    ngx_http_replace_sregex_restart,
+    ngx_http_replace_sregex_reset
+};
+
+
+/*
+ * With "replace_filter_scan_limit" or "replace_filter_stop_at", the regexes
+ * only see the stream up to the limit, which is fed to them as the end of
+ * the stream: they then return SRE_DECLINED and the rest of the response
+ * passes through, see ngx_http_replace_process().
+ */
+
+sre_int_t
+ngx_http_replace_exec(ngx_http_request_t *r, ngx_http_replace_ctx_t *ctx,
+    u_char *input, size_t size, unsigned eof, sre_int_t **pending_matched)
+{
+    sre_int_t                      rc, offset, end;
+    ngx_http_replace_loc_conf_t   *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_replace_filter_module);
+
+    if (rlcf->scan_limit || rlcf->stop_at.len) {
+        offset = ctx->stream_pos + (input - ctx->buf->pos);
+
+        if (rlcf->stop_at.len && ctx->scan_end == 0) {
+            ngx_http_replace_find_stop_at(ctx, rlcf, input, size, offset);
+        }
+
+        end = ctx->scan_end;
+
+        if (rlcf->scan_limit
+            && (end == 0 || (sre_int_t) rlcf->scan_limit < end))
+        {
+            end = rlcf->scan_limit;
+        }
+
+        if (end && offset + (sre_int_t) size >= end) {
+            dd("scan window ends at %ld", (long) end);
+
+            size = (end > offset) ? (size_t) (end - offset) : 0;
+            eof = 1;
+        }
+    }
+
+    rc = ngx_http_replace_thread_exec(r, ctx, input, size, eof,
+                                      pending_matched);
+
+    if (rc != NGX_HTTP_REPLACE_EXEC_INLINE) {
+        return rc;
+    }
+
+    return rlcf->backend->exec(r, ctx, input, size, eof, pending_matched);
+}
+
+
+/*
+ * Looks for the "replace_filter_stop_at" string in the part of the stream
+ * not seen yet, with the Knuth-Morris-Pratt automaton built by
+ * ngx_http_replace_stop_at_init(), and sets ctx->scan_end right after its
+ * first occurrence.
+ */
+
+static void
+ngx_http_replace_find_stop_at(ngx_http_replace_ctx_t *ctx,
+    ngx_http_replace_loc_conf_t *rlcf, u_char *input, size_t size,
+    sre_int_t offset)
+{
+    u_char        *p, *last, *s;
+    ngx_uint_t     state, *next;
+
+    if (offset + (sre_int_t) size <= ctx->stop_scanned) {
+        /* pending data fed again */
+        return;
+    }
+
+    p = input;
+    last = input + size;
+
+    if (offset < ctx->stop_scanned) {
+        p += ctx->stop_scanned - offset;
+    }
+
+    s = rlcf->stop_at.data;
+    next = rlcf->stop_at_next;
+    state = ctx->stop_state;
+
+    for ( /* void */ ; p < last; p++) {
+
+        while (state && s[state] != *p) {
+            state = next[state - 1];
+        }
+
+        if (s[state] == *p) {
+            state++;
+        }
+
+        if (state == rlcf->stop_at.len) {
+            ctx->scan_end = offset + (p + 1 - input);
+
+            dd("stop at string found, ends at %ld", (long) ctx->scan_end);
+
+            break;
+        }
+    }
+
+    ctx->stop_state = state;
+    ctx->stop_scanned = offset + (p - input);
+}
+
+
+/*
+ * next[i] is the length of the longest proper prefix of the string that is
+ * also a suffix of its first i + 1 bytes.
+ */
+
+ngx_int_t
+ngx_http_replace_stop_at_init(ngx_conf_t *cf,
+    ngx_http_replace_loc_conf_t *rlcf)
+{
+    u_char        *s;
+    ngx_uint_t     i, k, *next;
+
+    next = ngx_palloc(cf->pool, rlcf->stop_at.len * sizeof(ngx_uint_t));
+    if (next == NULL) {
+        return NGX_ERROR;
+    }
+
+    s = rlcf->stop_at.data;
+
+    next[0] = 0;
+    k = 0;
+
+    for (i = 1; i < rlcf->stop_at.len; i++) {
+
+        while (k && s[k] != s[i]) {
+            k = next[k - 1];
+        }
+
+        if (s[k] == s[i]) {
+            k++;
+        }
+
+        next[i] = k;
+    }
+
+    rlcf->stop_at_next = next;
+
+    return NGX_OK;
+}
+
+
+/* only checks the syntax of the regexes, for "replace_filter_lazy_compile" */
+
+ngx_int_t
+ngx_http_replace_sregex_check(ngx_conf_t *cf,
+    ngx_http_replace_loc_conf_t *rlcf)
+{
+    sre_pool_t      *ppool;
+    sre_regex_t     *re;
+
+    ppool = sre_create_pool(1024);
+    if (ppool == NULL) {
+        return NGX_ERROR;
+    }
+
+    re = ngx_http_replace_sregex_parse(cf, rlcf, ppool);
+
+    sre_destroy_pool(ppool);
+
+    return re ? NGX_OK : NGX_ERROR;
+}
+
+
+static sre_regex_t *
+ngx_http_replace_sregex_parse(ngx_conf_t *cf,
+    ngx_http_replace_loc_conf_t *rlcf, sre_pool_t *ppool)
+{
+    u_char          **value;
+    sre_int_t         err_offset, err_regex_id;
+    ngx_str_t         prefix, suffix;
+    sre_regex_t      *re;
+
+    value = rlcf->regexes.elts;
+
+    re = sre_regex_parse_multi(ppool, value, rlcf->regexes.nelts,
+                               &rlcf->ncaps, rlcf->multi_flags.elts,
+                               &err_offset, &err_regex_id);
+
+    if (re == NULL) {
+
+        if (err_offset >= 0) {
+            prefix.data = value[err_regex_id];
+            prefix.len = err_offset;
+
+            suffix.data = value[err_regex_id] + err_offset;
+            suffix.len = ngx_strlen(value[err_regex_id]) - err_offset;
+
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "failed to parse regex at offset %i: "
+                               "syntax error; marked by <-- HERE in "
+                               "\"%V <-- HERE %V\"",
+                               (ngx_int_t) err_offset, &prefix, &suffix);
+
+        } else {
+
+            if (err_regex_id >= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "failed to parse regex \"%s\"",
+                                   value[err_regex_id]);
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "failed to parse regex \"%s\" "
+                                   "and its siblings",
+                                   value[0]);
+            }
+        }
+    }
+
+    return re;
+}
+
+
+static ngx_int_t
+ngx_http_replace_sregex_compile(ngx_conf_t *cf,
+    ngx_http_replace_loc_conf_t *rlcf)
+{
+    u_char                         **value;
+    sre_pool_t                      *ppool; /* parser pool */
+    sre_regex_t                     *re;
+    sre_program_t                   *prog;
+    ngx_http_replace_main_conf_t    *rmcf;
+
+    dd("parsing and compiling %d regexes", (int) rlcf->regexes.nelts);
+
+    ppool = sre_create_pool(1024);
+    if (ppool == NULL) {
+        return NGX_ERROR;
+    }
+
+    value = rlcf->regexes.elts;
+
+    re = ngx_http_replace_sregex_parse(cf, rlcf, ppool);
+    if (re == NULL) {
+        sre_destroy_pool(ppool);
+        return NGX_ERROR;
+    }
+
+    rmcf = ngx_http_conf_get_module_main_conf(cf,
+                                              ngx_http_replace_filter_module);
+
+    prog = sre_regex_compile(rmcf->compiler_pool, re);
+
+    sre_destroy_pool(ppool);
+
+    if (prog == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "failed to compile regex \"%s\" and its "
+                           "siblings", value[0]);
+
+        return NGX_ERROR;
+    }
+
+    rlcf->program = prog;
+    rlcf->ovecsize = 2 * (rlcf->ncaps + 1) * sizeof(sre_int_t);
+    rlcf->vm_ovecsize = rlcf->ovecsize;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Compiles rlcf->program again into "pool". sre_vm_pike_exec() tags the
+ * instructions of the program it runs, so the runs in the thread pools
+ * cannot share the program of the location with the event loop.
+ */
+
+sre_program_t *
+ngx_http_replace_sregex_copy(ngx_http_request_t *r,
+    ngx_http_replace_loc_conf_t *rlcf, sre_pool_t *pool)
+{
+    u_char          **value, **regexes;
+    sre_int_t         err_offset, err_regex_id;
+    sre_uint_t        ncaps;
+    ngx_uint_t        i, n;
+    sre_pool_t       *ppool;
+    sre_regex_t      *re;
+    sre_program_t    *prog;
+
+    n = rlcf->regexes.nelts;
+    value = rlcf->regexes.elts;
+
+    regexes = value;
+
+    if (rlcf->capture_program) {
+        /* rlcf->program is the scanner without captures */
+
+        regexes = ngx_palloc(r->pool, n * sizeof(u_char *));
+        if (regexes == NULL) {
+            return NULL;
+        }
+
+        for (i = 0; i < n; i++) {
+            regexes[i] = ngx_http_replace_regex_strip_captures(r->pool,
+                                                               value[i]);
+            if (regexes[i] == NULL) {
+                return NULL;
+            }
+        }
+    }
+
+    ppool = sre_create_pool(1024);
+    if (ppool == NULL) {
+        return NULL;
+    }
+
+    re = sre_regex_parse_multi(ppool, regexes, n, &ncaps,
+                               rlcf->multi_flags.elts, &err_offset,
+                               &err_regex_id);
+
+    prog = (re == NULL) ? NULL : sre_regex_compile(pool, re);
+
+    sre_destroy_pool(ppool);
+
+    if (prog == NULL) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      "replace filter: failed to compile regex \"%s\" "
+                      "and its siblings again", value[0]);
+    }
+
+    return prog;
+}
+
+
+static ngx_int_t
+ngx_http_replace_sregex_create_ctx(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx)
+{
+    ngx_http_replace_loc_conf_t   *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_replace_filter_module);
+
+    /* the pools come from ngx_http_replace_vm_get() */
+
+    ctx->program = NULL;
+    ctx->ids = NULL;
+
+    ctx->vm_ctx = sre_vm_pike_create_ctx(ctx->vm_pool,
+                                         ctx->vm_program ? ctx->vm_program
+                                                         : rlcf->program,
+                                         ctx->ovector, rlcf->vm_ovecsize);
+    if (ctx->vm_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->vm_idle = 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_replace_sregex_restart(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, sre_int_t offset)
+{
+    ngx_http_replace_loc_conf_t   *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_replace_filter_module);
+
+    if (rlcf->literal) {
+        ngx_memzero(&ctx->literal, sizeof(ngx_http_replace_literal_ctx_t));
+        return NGX_OK;
+    }
+
+    if (ngx_http_replace_vm_reset(ctx, rlcf, offset) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ctx->vm_idle = 1;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_replace_sregex_reset(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx)
+{
+    sre_reset_pool(ctx->vm_pool);
+}
+
+
+/*
+ * A drop-in replacement for sre_vm_pike_exec() with the same return values
+ * and the same ctx->ovector and pending_matched conventions.
+ *
+ * Locations whose regexes are all plain strings are served by the
+ * Aho-Corasick automaton in ngx_http_replace_literal.c instead.
+ *
+ * When the location has a first-byte prefilter and the Pike VM holds no
+ * thread at all, the bytes that cannot start any match are skipped with
+ * ngx_http_replace_scan() and the VM is restarted right at the next
+ * candidate byte. With "replace_filter_engine dfa", the lazy DFA skips
+ * further, up to the last offset before a possible match end at which no
+ * thread was in progress.
+ *
+ * With "replace_filter_engine jit", the JIT-compiled Thompson program
+ * first checks whether any match can end in the next few kilobytes of the
+ * buffer. When none can, only the last max_len - 1 bytes of that window
+ * may start a match, and the Pike VM never sees the bytes before them.
+ */
+
+static sre_int_t
+ngx_http_replace_sregex_exec(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, u_char *input, size_t size, unsigned eof,
+    sre_int_t **pending_matched)
+{
+    u_char                        *p, *q, *last, *end, *gated;
+    sre_int_t                      rc;
+    ngx_http_replace_dfa_t        *dfa;
+    ngx_http_replace_loc_conf_t   *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_replace_filter_module);
+
+    if (rlcf->literal) {
+        return ngx_http_replace_literal_exec(rlcf->literal, &ctx->literal,
+                                             rlcf->scan, input, size,
+                                             ctx->stream_pos
+                                             + (input - ctx->buf->pos),
+                                             eof, ctx->ovector,
+                                             pending_matched);
+    }
+
+    dfa = (rlcf->dfa && !rlcf->dfa->full) ? rlcf->dfa : NULL;
+
+    if (rlcf->scan == NULL && dfa == NULL && rlcf->jit_code == NULL) {
+        return ngx_http_replace_vm_exec(ctx, rlcf, input, size, eof,
+                                        pending_matched);
+    }
+
+    p = input;
+    last = input + size;
+    gated = input;
+
+    for ( ;; ) {
+
+        if (ctx->vm_idle) {
+
+            if (rlcf->jit_code && p >= gated) {
+
+                /* gate a window at a time to keep the VM near the hits */
+
+                if (last - p > NGX_HTTP_REPLACE_JIT_WINDOW + rlcf->max_len) {
+                    end = p + NGX_HTTP_REPLACE_JIT_WINDOW + rlcf->max_len;
+
+                } else {
+                    end = last;
+                }
+
+                rc = ngx_http_replace_jit_gate(ctx, rlcf, p, end,
+                                               eof && end == last);
+
+                if (rc == NGX_ERROR) {
+                    return SRE_ERROR;
+                }
+
+                if (rc == NGX_DECLINED) {
+                    if (eof && end == last) {
+                        return SRE_DECLINED;
+                    }
+
+                    /* only the last max_len - 1 bytes may start a match */
+
+                    if (end - p >= rlcf->max_len) {
+                        dd("jit gate skipped %d bytes",
+                           (int) (end - p - rlcf->max_len + 1));
+
+                        p = end - (rlcf->max_len - 1);
+                        ctx->vm_reset = 1;
+
+                        if (end != last) {
+                            continue;
+                        }
+                    }
+                }
+
+                gated = end;
+            }
+
+            if (dfa) {
+                if (ngx_http_replace_dfa_exec(dfa, rlcf->scan, p, last, &q,
+                                              r->connection->log)
+                    != NGX_OK)
+                {
+                    return SRE_ERROR;
+                }
+
+            } else if (rlcf->scan) {
+                q = ngx_http_replace_scan(rlcf->scan, p, last);
+
+            } else {
+                q = p;
+            }
+
+            if (q == last || q - p >= NGX_HTTP_REPLACE_MIN_SKIP) {
+                dd("prefilter skipped %d bytes", (int) (q - p));
+
+                p = q;
+                ctx->vm_reset = 1;
+            }
+
+            if (p == last) {
+                if (eof) {
+                    return SRE_DECLINED;
+                }
+
+                ctx->ovector[0] = -1;
+                ctx->ovector[1] = -1;
+
+                if (pending_matched) {
+                    *pending_matched = NULL;
+                }
+
+                return SRE_AGAIN;
+            }
+
+            if (ctx->vm_reset
+                && ngx_http_replace_vm_reset(ctx, rlcf, ctx->stream_pos
+                                             + (p - ctx->buf->pos))
+                   != NGX_OK)
+            {
+                return SRE_ERROR;
+            }
+        }
+
+        if (last - p > NGX_HTTP_REPLACE_VM_CHUNK) {
+            end = p + NGX_HTTP_REPLACE_VM_CHUNK;
+
+        } else {
+            end = last;
+        }
+
+        rc = ngx_http_replace_vm_exec(ctx, rlcf, p, end - p,
+                                      eof && end == last, pending_matched);
+
+        if (rc != SRE_AGAIN || end == last) {
+            return rc;
+        }
+
+        p = end;
+    }
+
+    /* cannot reach here */
+}
+
+
+/*
+ * Returns NGX_DECLINED when no match can end in [p, last), and NGX_OK when
+ * one might.
+ */
+
+static ngx_int_t
+ngx_http_replace_jit_gate(ngx_http_replace_ctx_t *ctx,
+    ngx_http_replace_loc_conf_t *rlcf, u_char *p, u_char *last,
+    unsigned eof)
+{
+    sre_int_t                 rc;
+    sre_vm_thompson_ctx_t    *tctx;
+
+    if (p == last) {
+        return NGX_DECLINED;
+    }
+
+    sre_reset_pool(ctx->jit_pool);
+
+    tctx = sre_vm_thompson_jit_create_ctx(ctx->jit_pool, rlcf->jit_code);
+    if (tctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    rc = rlcf->jit_handler(tctx, p, last - p, eof);
+
+    dd("jit gate on %d bytes: %d", (int) (last - p), (int) rc);
+
+    if (rc == SRE_ERROR) {
+        return NGX_ERROR;
+    }
+
+    return (rc == SRE_OK) ? NGX_OK : NGX_DECLINED;
+}
+
+
+/*
+ * Restarts the Pike VM with an empty thread list as if it had already
+ * consumed "offset" bytes of the stream. Only valid when the VM is idle.
+ */
+
+ngx_int_t
+ngx_http_replace_vm_reset(ngx_http_replace_ctx_t *ctx,
+    ngx_http_replace_loc_conf_t *rlcf, sre_int_t offset)
+{
+    dd("reset vm at offset %ld", (long) offset);
+
+    sre_reset_pool(ctx->vm_pool);
+
+    if (ctx->program) {
+        /* the variants have no captures */
+        ctx->vm_ctx = sre_vm_pike_create_ctx(ctx->vm_pool, ctx->program,
+                                             ctx->ovector,
+                                             2 * sizeof(sre_int_t));
+
+    } else {
+        ctx->vm_ctx = sre_vm_pike_create_ctx(ctx->vm_pool,
+                                             ctx->vm_program
+                                             ? ctx->vm_program
+                                             : rlcf->program,
+                                             ctx->ovector,
+                                             rlcf->vm_ovecsize);
+    }
+
+    if (ctx->vm_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->vm_offset = offset;
+    ctx->vm_reset = 0;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Called right after a rule got exhausted: restarts the VM after the match
+ * with the program of the location without the rules exhausted so far, so
+ * that they no longer cost anything. The counters in ctx->counts remain
+ * the reference for the other backends.
+ */
+
+ngx_int_t
+ngx_http_replace_vm_variant(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx)
+{
+    ngx_uint_t                     i, id, mask, *limit;
+    ngx_http_replace_variants_t   *v;
+    ngx_http_replace_loc_conf_t   *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_replace_filter_module);
+
+    v = rlcf->variants;
+
+    if (v == NULL
+        || rlcf->literal
+        || rlcf->backend != &ngx_http_replace_sregex_backend)
+    {
+        return NGX_OK;
+    }
+
+    limit = rlcf->multi_limit.elts;
+    mask = 0;
+
+    for (i = 0; i < v->nrules; i++) {
+        id = v->rules[i];
+
+        if (ctx->counts[id] >= limit[id]) {
+            mask |= 1 << i;
+        }
+    }
+
+    if (v->programs[mask] == NULL) {
+        /* no rule left, see ctx->once */
+        return NGX_OK;
+    }
+
+    dd("switch to vm variant %d", (int) mask);
+
+    ctx->program = v->programs[mask];
+    ctx->ids = v->ids[mask];
+
+    return ngx_http_replace_vm_reset(ctx, rlcf, ctx->ovector[1]);
+}
+
+
+/*
+ * Runs the capturing program over the bytes of the match just found by the
+ * capture-free one, which are all on ctx->captured, to fill in the rest of
+ * ctx->ovector. Without assertions, a regex cannot tell the match from the
+ * whole stream, so the same rule matches the same bytes again.
+ */
+
+ngx_int_t
+ngx_http_replace_exec_captures(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx)
+{
+    u_char                        *p, *last;
+    sre_int_t                      rc, from, to, start, end;
+    ngx_uint_t                     i, n;
+    ngx_chain_t                   *cl;
+    sre_vm_pike_ctx_t             *vm;
+    ngx_http_replace_loc_conf_t   *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_replace_filter_module);
+
+    from = ctx->ovector[0];
+    to = ctx->ovector[1];
+
+    sre_reset_pool(ctx->capture_pool);
+
+    vm = sre_vm_pike_create_ctx(ctx->capture_pool, rlcf->capture_program,
+                                ctx->ovector, rlcf->ovecsize);
+    if (vm == NULL) {
+        return NGX_ERROR;
+    }
+
+    rc = SRE_AGAIN;
+
+    for (cl = ctx->captured; cl; cl = cl->next) {
+
+        if (cl->buf->file_last <= from) {
+            continue;
+        }
+
+        if (cl->buf->file_pos >= to) {
+            break;
+        }
+
+        start = ngx_max(from, (sre_int_t) cl->buf->file_pos);
+        end = ngx_min(to, (sre_int_t) cl->buf->file_last);
+
+        p = cl->buf->pos + (start - cl->buf->file_pos);
+        last = cl->buf->pos + (end - cl->buf->file_pos);
+
+        rc = sre_vm_pike_exec(vm, p, last - p, 0, NULL);
+
+        if (rc != SRE_AGAIN) {
+            break;
+        }
+    }
+
+    if (rc == SRE_AGAIN) {
+        rc = sre_vm_pike_exec(vm, (u_char *) "", 0, 1, NULL);
+    }
+
+    dd("capturing vm exec on (%ld, %ld): %d", (long) from, (long) to,
+       (int) rc);
+
+    if (rc != ctx->regex_id
+        || ctx->ovector[0] != 0
+        || ctx->ovector[1] != to - from)
+    {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      "capturing regex mismatch on match (%i, %i) of "
+                      "regex %i: %i", (ngx_int_t) from, (ngx_int_t) to,
+                      (ngx_int_t) ctx->regex_id, (ngx_int_t) rc);
+        return NGX_ERROR;
+    }
+
+    n = rlcf->ovecsize / sizeof(sre_int_t);
+
+    for (i = 0; i < n; i++) {
+        if (ctx->ovector[i] >= 0) {
+            ctx->ovector[i] += from;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static sre_int_t
+ngx_http_replace_vm_exec(ngx_http_replace_ctx_t *ctx,
+    ngx_http_replace_loc_conf_t *rlcf, u_char *input, size_t size,
+    unsigned eof, sre_int_t **pending_matched)
+{
+    sre_int_t     rc, *matched;
+    ngx_uint_t    i, n;
+
+    rc = sre_vm_pike_exec(ctx->vm_ctx, input, size, eof, pending_matched);
+
+    dd("vm pike exec: %d", (int) rc);
+
+    matched = pending_matched ? *pending_matched : NULL;
+
+    if (rc >= 0) {
+        /* the VM restarts from scratch right after a match */
+        ctx->vm_idle = 1;
+
+        if (ctx->ids) {
+            rc = ctx->ids[rc];
+        }
+
+    } else if (rc == SRE_AGAIN) {
+        ctx->vm_idle = (ctx->ovector[0] == -1 && matched == NULL);
+
+    } else {
+        return rc;
+    }
+
+    if (ctx->vm_offset == 0) {
+        return rc;
+    }
+
+    n = (rc >= 0 && ctx->program == NULL)
+        ? rlcf->vm_ovecsize / sizeof(sre_int_t) : 2;
+
+    for (i = 0; i < n; i++) {
+        if (ctx->ovector[i] >= 0) {
+            ctx->ovector[i] += ctx->vm_offset;
+        }
+    }
+
+    if (matched) {
+        for (i = 0; i < 2; i++) {
+            ctx->pending_matched[i] = matched[i] >= 0
+                                      ? matched[i] + ctx->vm_offset : -1;
+        }
+
+        *pending_matched = ctx->pending_matched;
+    }
+
+    return rc;
+}
@@ -0,0 +1,88 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef _NGX_HTTP_REPLACE_ENGINE_H_INCLUDED_
+#define _NGX_HTTP_REPLACE_ENGINE_H_INCLUDED_
+
+
+#include "ngx_http_replace_filter_module.h"
+
+
+/*
+ * A regex backend. Whatever the backend, the sregex program of the location
+ * is always compiled first: it validates the regexes, defines the number
+ * of captures and is the fallback of the other backends.
+ *
+ * exec() follows the conventions of sre_vm_pike_exec(): it returns the id
+ * of the matched regex with the match and its captures in ctx->ovector,
+ * SRE_DECLINED when nothing can match anymore, or SRE_AGAIN with the
+ * stream offsets of the data that may still be part of a match in
+ * ctx->ovector[0] and ctx->ovector[1] (-1 when there is none). After a
+ * match, the data right after the match is fed again.
+ */
+
+/*
+ * ngx_http_replace_exec() results beside the sregex ones: the run was
+ * posted to a thread pool, see ngx_http_replace_thread_exec()
+ */
+#define NGX_HTTP_REPLACE_EXEC_POSTED  -100
+#define NGX_HTTP_REPLACE_EXEC_INLINE  -101
+
+
+struct ngx_http_replace_backend_s {
+    ngx_str_t                   name;
+
+    /* NGX_DECLINED falls back to sregex */
+    ngx_int_t                 (*compile)(ngx_conf_t *cf,
+                                         ngx_http_replace_loc_conf_t *rlcf);
+
+    ngx_int_t                 (*create_ctx)(ngx_http_request_t *r,
+                                            ngx_http_replace_ctx_t *ctx);
+
+    sre_int_t                 (*exec)(ngx_http_request_t *r,
+                                      ngx_http_replace_ctx_t *ctx,
+                                      u_char *input, size_t size,
+                                      unsigned eof,
+                                      sre_int_t **pending_matched);
+
+    /*
+     * drops the partial matches and starts matching again at the stream
+     * offset given, after an overflow of the pending data
+     */
+    ngx_int_t                 (*restart)(ngx_http_request_t *r,
+                                         ngx_http_replace_ctx_t *ctx,
+                                         sre_int_t offset);
+
+    /* releases the matching state once nothing can match anymore */
+    void                      (*reset)(ngx_http_request_t *r,
+                                       ngx_http_replace_ctx_t *ctx);
+};
+
+
+ngx_int_t ngx_http_replace_sregex_check(ngx_conf_t *cf,
+    ngx_http_replace_loc_conf_t *rlcf);
+sre_int_t ngx_http_replace_exec(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, u_char *input, size_t size, unsigned eof,
+    sre_int_t **pending_matched);
+ngx_int_t ngx_http_replace_stop_at_init(ngx_conf_t *cf,
+    ngx_http_replace_loc_conf_t *rlcf);
+sre_program_t *ngx_http_replace_sregex_copy(ngx_http_request_t *r,
+    ngx_http_replace_loc_conf_t *rlcf, sre_pool_t *pool);
+ngx_int_t ngx_http_replace_vm_reset(ngx_http_replace_ctx_t *ctx,
+    ngx_http_replace_loc_conf_t *rlcf, sre_int_t offset);
+ngx_int_t ngx_http_replace_vm_variant(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx);
+ngx_int_t ngx_http_replace_exec_captures(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx);
+
+
+extern ngx_http_replace_backend_t  ngx_http_replace_sregex_backend;
+#if (NGX_PCRE2)
+extern ngx_http_replace_backend_t  ngx_http_replace_pcre2_backend;
+#endif
+
+
+#endif /* _NGX_HTTP_REPLACE_ENGINE_H_INCLUDED_ */
@@ -13,9 +13,16 @@
 
 
 #include "ngx_http_replace_filter_module.h"
+#include "ngx_http_replace_cache.h"
+#include "ngx_http_replace_engine.h"
+#include "ngx_http_replace_inflate.h"
 #include "ngx_http_replace_parse.h"
+#include "ngx_http_replace_program.h"
 #include "ngx_http_replace_script.h"
+#include "ngx_http_replace_static.h"
+#include "ngx_http_replace_thread.h"
 #include "ngx_http_replace_util.h"
+#include "ngx_http_replace_vm.h"
 
 
 enum {
@@ -23,31 +30,72 @@ enum {
 };
 
 
+/* handled on the next iteration of the event loop when possible */
+#if (nginx_version >= 1017005)
+#define ngx_http_replace_posted_events  ngx_posted_next_events
+#else
+#define ngx_http_replace_posted_events  ngx_posted_events
+#endif
+
+
+static ngx_int_t ngx_http_replace_process(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, ngx_chain_t *in);
 static ngx_int_t ngx_http_replace_output(ngx_http_request_t *r,
     ngx_http_replace_ctx_t *ctx);
+static ngx_int_t ngx_http_replace_init_ctx(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx);
+static ngx_int_t ngx_http_replace_output_verbatim(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, ngx_buf_t **last);
+static ngx_int_t ngx_http_replace_post_resume(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx);
+static void ngx_http_replace_cleanup_resume(void *data);
+static ngx_int_t ngx_http_replace_send_cached(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, ngx_chain_t *in);
+static ngx_int_t ngx_http_replace_collect(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, ngx_chain_t *in);
 static char *ngx_http_replace_filter(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_replace_program_cache(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char *ngx_http_replace_stop_at(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 static void *ngx_http_replace_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_replace_merge_loc_conf(ngx_conf_t *cf,
     void *parent, void *child);
+static ngx_int_t ngx_http_replace_add_variables(ngx_conf_t *cf);
+static ngx_int_t ngx_http_replace_overflows_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_replace_filter_init(ngx_conf_t *cf);
-static void ngx_http_replace_cleanup_pool(void *data);
 static void *ngx_http_replace_create_main_conf(ngx_conf_t *cf);
-
-
-#define ngx_http_replace_regex_is_disabled(ctx)                              \
-    ((ctx)->disabled[(ctx)->regex_id / 8] & (1 << ((ctx)->regex_id % 8)))
-
-
-#define ngx_http_replace_regex_set_disabled(ctx)                             \
-    (ctx)->disabled[(ctx)->regex_id / 8] |= (1 << ((ctx)->regex_id % 8))
+static ngx_int_t ngx_http_replace_compile(ngx_conf_t *cf,
+    ngx_http_replace_loc_conf_t *rlcf);
+static ngx_int_t ngx_http_replace_lazy_compile(ngx_http_request_t *r,
+    ngx_http_replace_loc_conf_t *rlcf);
+static ngx_int_t ngx_http_replace_analyze_regexes(ngx_conf_t *cf,
+    ngx_http_replace_loc_conf_t *rlcf);
+static ngx_int_t ngx_http_replace_create_dfa(ngx_conf_t *cf,
+    ngx_http_replace_loc_conf_t *rlcf);
+static ngx_int_t ngx_http_replace_create_jit(ngx_conf_t *cf,
+    ngx_http_replace_loc_conf_t *rlcf);
+static void ngx_http_replace_cleanup_jit(void *data);
+static ngx_int_t ngx_http_replace_compile_scanner(ngx_conf_t *cf,
+    ngx_http_replace_loc_conf_t *rlcf);
+static ngx_int_t ngx_http_replace_compile_variants(ngx_conf_t *cf,
+    ngx_http_replace_loc_conf_t *rlcf);
+
+
+#define ngx_http_replace_regex_is_disabled(ctx, rlcf)                        \
+    (((ngx_uint_t *) (rlcf)->multi_limit.elts)[(ctx)->regex_id]              \
+     && (ctx)->counts[(ctx)->regex_id]                                       \
+        >= ((ngx_uint_t *) (rlcf)->multi_limit.elts)[(ctx)->regex_id])
 
 
 static volatile ngx_cycle_t  *ngx_http_replace_prev_cycle = NULL;
 
 
-#define NGX_HTTP_REPLACE_CLEAR_LAST_MODIFIED    0
-#define NGX_HTTP_REPLACE_KEEP_LAST_MODIFIED     1
+static ngx_path_init_t  ngx_http_replace_static_path = {
+    ngx_string("replace_static"), { 1, 2, 0 }
+};
 
 
 static ngx_conf_enum_t  ngx_http_replace_filter_last_modified[] = {
@@ -57,11 +105,47 @@ static ngx_conf_enum_t  ngx_http_replace_filter_last_modified[] = {
 };
 
 
+static ngx_conf_enum_t  ngx_http_replace_filter_overflow[] = {
+    { ngx_string("stop"), NGX_HTTP_REPLACE_OVERFLOW_STOP },
+    { ngx_string("restart"), NGX_HTTP_REPLACE_OVERFLOW_RESTART },
+    { ngx_null_string, 0 }
+};
+
+
+static ngx_http_variable_t  ngx_http_replace_vars[] = {
+
+    { ngx_string("replace_filter_overflows"), NULL,
+      ngx_http_replace_overflows_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_null_string, NULL, NULL, 0, 0, 0 }
+};
+
+
+#define NGX_HTTP_REPLACE_ENGINE_PIKE    0
+#define NGX_HTTP_REPLACE_ENGINE_DFA     1
+#define NGX_HTTP_REPLACE_ENGINE_JIT     2
+#define NGX_HTTP_REPLACE_ENGINE_PCRE2   3
+
+
+/* the per-location limit on the lazily built DFA states */
+#define NGX_HTTP_REPLACE_DFA_CACHE_SIZE  (1024 * 1024)
+
+
+static ngx_conf_enum_t  ngx_http_replace_filter_engine[] = {
+    { ngx_string("pike"), NGX_HTTP_REPLACE_ENGINE_PIKE },
+    { ngx_string("dfa"), NGX_HTTP_REPLACE_ENGINE_DFA },
+    { ngx_string("jit"), NGX_HTTP_REPLACE_ENGINE_JIT },
+    { ngx_string("pcre2"), NGX_HTTP_REPLACE_ENGINE_PCRE2 },
+    { ngx_null_string, 0 }
+};
+
+
 static ngx_command_t  ngx_http_replace_filter_commands[] = {
 
     { ngx_string("replace_filter"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
-                        |NGX_CONF_TAKE23,
+                        |NGX_CONF_TAKE2|NGX_CONF_TAKE3|NGX_CONF_TAKE4,
       ngx_http_replace_filter,
       NGX_HTTP_LOC_CONF_OFFSET,
       0,
@@ -83,6 +167,110 @@ static ngx_command_t  ngx_http_replace_filter_commands[] = {
       offsetof(ngx_http_replace_loc_conf_t, max_buffered_size),
       NULL },
 
+    { ngx_string("replace_filter_overflow"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
+                        |NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_replace_loc_conf_t, overflow),
+      &ngx_http_replace_filter_overflow },
+
+    { ngx_string("replace_filter_max_replacements"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
+                        |NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_replace_loc_conf_t, max_replacements),
+      NULL },
+
+    { ngx_string("replace_filter_scan_limit"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
+                        |NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_replace_loc_conf_t, scan_limit),
+      NULL },
+
+    { ngx_string("replace_filter_stop_at"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
+                        |NGX_CONF_TAKE1,
+      ngx_http_replace_stop_at,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("replace_filter_sendfile"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
+                        |NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_replace_loc_conf_t, sendfile),
+      NULL },
+
+    { ngx_string("replace_filter_sendfile_window"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
+                        |NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_replace_loc_conf_t, sendfile_window),
+      NULL },
+
+    { ngx_string("replace_filter_slice"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
+                        |NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_replace_loc_conf_t, slice),
+      NULL },
+
+    { ngx_string("replace_filter_decompress"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
+                        |NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_replace_loc_conf_t, decompress),
+      NULL },
+
+    { ngx_string("replace_filter_decompress_buffers"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
+                        |NGX_CONF_TAKE2,
+      ngx_conf_set_bufs_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_replace_loc_conf_t, decompress_bufs),
+      NULL },
+
+    { ngx_string("replace_filter_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
+                        |NGX_CONF_1MORE,
+      ngx_http_replace_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("replace_filter_static"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
+                        |NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_replace_loc_conf_t, static_files),
+      NULL },
+
+    { ngx_string("replace_filter_static_path"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF
+                        |NGX_CONF_TAKE1234,
+      ngx_conf_set_path_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_replace_loc_conf_t, static_path),
+      NULL },
+
+    { ngx_string("replace_filter_thread_pool"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
+                        |NGX_CONF_TAKE12,
+      ngx_http_replace_thread_pool,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("replace_filter_last_modified"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
                         |NGX_CONF_1MORE,
@@ -91,6 +279,37 @@ static ngx_command_t  ngx_http_replace_filter_commands[] = {
       offsetof(ngx_http_replace_loc_conf_t, last_modified),
       &ngx_http_replace_filter_last_modified },
 
+    { ngx_string("replace_filter_engine"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
+                        |NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_replace_loc_conf_t, engine),
+      &ngx_http_replace_filter_engine },
+
+    { ngx_string("replace_filter_lazy_compile"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
+                        |NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_replace_loc_conf_t, lazy_compile),
+      NULL },
+
+    { ngx_string("replace_filter_vm_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
+                        |NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_replace_loc_conf_t, vm_cache_size),
+      NULL },
+
+    { ngx_string("replace_filter_program_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_replace_program_cache,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("replace_filter_skip"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
           |NGX_CONF_TAKE1,
@@ -104,7 +323,7 @@ static ngx_command_t  ngx_http_replace_filter_commands[] = {
 
 
 static ngx_http_module_t  ngx_http_replace_filter_module_ctx = {
-    NULL,                                  /* preconfiguration */
+    ngx_http_replace_add_variables,        /* preconfiguration */
     ngx_http_replace_filter_init,          /* postconfiguration */
 
     ngx_http_replace_create_main_conf,     /* create main configuration */
@@ -128,7 +347,7 @@ ngx_module_t  ngx_http_replace_filter_module = {
     NULL,                                  /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
-    NULL,                                  /* exit process */
+    ngx_http_replace_vm_exit_process,      /* exit process */
     NULL,                                  /* exit master */
     NGX_MODULE_V1_PADDING
 };
@@ -141,25 +360,57 @@ static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
 static ngx_int_t
 ngx_http_replace_header_filter(ngx_http_request_t *r)
 {
-    size_t                         size;
+    ngx_int_t                      encoding;
     ngx_str_t                      skip;
-    ngx_pool_cleanup_t            *cln;
     ngx_http_replace_ctx_t        *ctx;
+    ngx_http_replace_static_t     *st;
     ngx_http_replace_loc_conf_t   *rlcf;
 
     rlcf = ngx_http_get_module_loc_conf(r, ngx_http_replace_filter_module);
 
     dd("replace header filter");
 
+    /* set by ngx_http_replace_static_handler() */
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_replace_filter_module);
+
+    if (ctx) {
+        st = ctx->sidecar;
+        ngx_http_set_ctx(r, NULL, ngx_http_replace_filter_module);
+
+        if (st->sent) {
+            return ngx_http_next_header_filter(r);
+        }
+
+    } else {
+        st = NULL;
+    }
+
     if (rlcf->regexes.nelts == 0
         || r->headers_out.content_length_n == 0
-        || (r->headers_out.content_encoding
-            && r->headers_out.content_encoding->value.len)
+        || r->headers_out.status == NGX_HTTP_NO_CONTENT
+        || r->headers_out.status == NGX_HTTP_NOT_MODIFIED
         || ngx_http_test_content_type(r, &rlcf->types) == NULL)
     {
         return ngx_http_next_header_filter(r);
     }
 
+    encoding = 0;
+
+    if (r->headers_out.content_encoding
+        && r->headers_out.content_encoding->value.len)
+    {
+        if (!rlcf->decompress) {
+            return ngx_http_next_header_filter(r);
+        }
+
+        encoding = ngx_http_replace_inflate_encoding(
+                                     &r->headers_out.content_encoding->value);
+        if (encoding == NGX_DECLINED) {
+            return ngx_http_next_header_filter(r);
+        }
+    }
+
     dd("skip: %p", rlcf->skip);
 
     if (rlcf->skip != NULL) {
@@ -172,6 +423,23 @@ ngx_http_replace_header_filter(ngx_http_request_t *r)
         }
     }
 
+    if (r == r->main) {
+        ngx_http_clear_content_length(r);
+
+        if (rlcf->last_modified == NGX_HTTP_REPLACE_CLEAR_LAST_MODIFIED) {
+            ngx_http_clear_last_modified(r);
+        }
+    }
+
+    if (r->header_only) {
+        return ngx_http_next_header_filter(r);
+    }
+
+    /*
+     * the matching state is only set up by the body filter, on the first
+     * data, see ngx_http_replace_init_ctx()
+     */
+
     ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_replace_ctx_t));
     if (ctx == NULL) {
         return NGX_ERROR;
@@ -181,95 +449,159 @@ ngx_http_replace_header_filter(ngx_http_request_t *r)
     ctx->last_pending = &ctx->pending;
     ctx->last_pending2 = &ctx->pending2;
     ctx->last_captured = &ctx->captured;
+    ctx->last_out = &ctx->out;
 
-    ctx->sub = ngx_pcalloc(r->pool,
-                           rlcf->multi_replace.nelts * sizeof(ngx_str_t));
-    if (ctx->sub == NULL) {
-        return NGX_ERROR;
+    ngx_http_set_ctx(r, ctx, ngx_http_replace_filter_module);
+
+    if (encoding) {
+        if (ngx_http_replace_inflate_create(r, ctx, encoding) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        r->headers_out.content_encoding->hash = 0;
+        r->headers_out.content_encoding = NULL;
+
+        ngx_http_clear_accept_ranges(r);
+        ngx_http_weak_etag(r);
     }
 
-    ctx->ovector = ngx_palloc(r->pool, rlcf->ovecsize);
-    if (ctx->ovector == NULL) {
+    if (rlcf->cache_zone
+        && ngx_http_replace_cache_lookup(r, ctx) == NGX_ERROR)
+    {
         return NGX_ERROR;
     }
 
-    size = ngx_align(rlcf->regexes.nelts, 8) / 8;
-    ctx->disabled = ngx_pcalloc(r->pool, size);
-    if (ctx->disabled == NULL) {
-        return NGX_ERROR;
+    if (st && r->headers_out.status == NGX_HTTP_OK && encoding == 0
+        && (ctx->cache == NULL || !ctx->cache->hit))
+    {
+        ctx->sidecar = st;
+        r->filter_need_in_memory = 1;
     }
 
-    ctx->vm_pool = sre_create_pool(1024);
-    if (ctx->vm_pool == NULL) {
-        return NGX_ERROR;
+    if (!rlcf->sendfile) {
+        r->filter_need_in_memory = 1;
     }
 
-    dd("created vm pool %p", ctx->vm_pool);
+    return ngx_http_next_header_filter(r);
+}
+
 
-    cln = ngx_pool_cleanup_add(r->pool, 0);
-    if (cln == NULL) {
-        sre_destroy_pool(ctx->vm_pool);
+static ngx_int_t
+ngx_http_replace_init_ctx(ngx_http_request_t *r, ngx_http_replace_ctx_t *ctx)
+{
+    ngx_http_replace_loc_conf_t   *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_replace_filter_module);
+
+    if (rlcf->backend == NULL
+        && ngx_http_replace_lazy_compile(r, rlcf) != NGX_OK)
+    {
         return NGX_ERROR;
     }
 
-    cln->data = ctx->vm_pool;
-    cln->handler = ngx_http_replace_cleanup_pool;
+    if (ngx_http_replace_vm_get(r, ctx) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
-    ctx->vm_ctx = sre_vm_pike_create_ctx(ctx->vm_pool, rlcf->program,
-                                         ctx->ovector, rlcf->ovecsize);
-    if (ctx->vm_ctx == NULL) {
+    if (rlcf->backend->create_ctx(r, ctx) != NGX_OK) {
         return NGX_ERROR;
     }
 
-    ngx_http_set_ctx(r, ctx, ngx_http_replace_filter_module);
+    ctx->ready = 1;
 
-    ctx->last_out = &ctx->out;
+    return NGX_OK;
+}
 
-    r->filter_need_in_memory = 1;
 
-    if (r == r->main) {
-        ngx_http_clear_content_length(r);
+static ngx_int_t
+ngx_http_replace_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
+{
+    ngx_int_t                  rc;
+    ngx_chain_t               *cl;
 
-        if (rlcf->last_modified == NGX_HTTP_REPLACE_CLEAR_LAST_MODIFIED) {
-            ngx_http_clear_last_modified(r);
+    ngx_http_replace_ctx_t        *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_replace_filter_module);
+
+    if (ctx == NULL) {
+        return ngx_http_next_body_filter(r, in);
+    }
+
+    if (ctx->cache && ctx->cache->hit) {
+        return ngx_http_replace_send_cached(r, ctx, in);
+    }
+
+    if (!ctx->ready) {
+
+        /* nothing was buffered yet */
+
+        for (cl = in; cl; cl = cl->next) {
+            if (ngx_buf_size(cl->buf)) {
+                break;
+            }
+        }
+
+        if (cl == NULL) {
+            if (ngx_http_replace_collect(r, ctx, in) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            return ngx_http_next_body_filter(r, in);
+        }
+
+        if (ngx_http_replace_init_ctx(r, ctx) != NGX_OK) {
+            return NGX_ERROR;
         }
     }
 
-    return ngx_http_next_header_filter(r);
-}
+    if (ctx->inflate == NULL) {
+        return ngx_http_replace_process(r, ctx, in);
+    }
 
+    if (ngx_http_replace_inflate(r, ctx, in, &in) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
-static void
-ngx_http_replace_cleanup_pool(void *data)
-{
-    sre_pool_t          *pool = data;
+    rc = ngx_http_replace_process(r, ctx, in);
 
-    if (pool) {
-        dd("destroy sre pool %p", pool);
-        sre_destroy_pool(pool);
+    if (rc == NGX_ERROR) {
+        return rc;
     }
+
+    if (ctx->inflate->in) {
+
+        /* compressed data is left for when a window is sent */
+
+        r->buffered |= NGX_HTTP_SUB_BUFFERED;
+
+        if (ngx_http_replace_inflate_window_free(ctx)
+            && ngx_http_replace_post_resume(r, ctx) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+    } else if (ctx->in == NULL && ctx->buf == NULL) {
+        r->buffered &= ~NGX_HTTP_SUB_BUFFERED;
+    }
+
+    return rc;
 }
 
 
 static ngx_int_t
-ngx_http_replace_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
+ngx_http_replace_process(ngx_http_request_t *r, ngx_http_replace_ctx_t *ctx,
+    ngx_chain_t *in)
 {
     ngx_int_t                  rc;
-    ngx_buf_t                 *b;
+    size_t                     scanned = 0;
+    ngx_buf_t                 *b, *shadow;
     ngx_str_t                 *sub;
     ngx_chain_t               *cl, *cur = NULL, *rematch = NULL;
 
-    ngx_http_replace_ctx_t        *ctx;
     ngx_http_replace_loc_conf_t   *rlcf;
 
     rlcf = ngx_http_get_module_loc_conf(r, ngx_http_replace_filter_module);
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_replace_filter_module);
-
-    if (ctx == NULL) {
-        return ngx_http_next_body_filter(r, in);
-    }
-
     if ((in == NULL
          && ctx->buf == NULL
          && ctx->in == NULL
@@ -278,7 +610,7 @@ ngx_http_replace_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
         return ngx_http_next_body_filter(r, in);
     }
 
-    if ((ctx->once || ctx->vm_done) && (ctx->buf == NULL || ctx->in == NULL)) {
+    if ((ctx->once || ctx->vm_done) && ctx->buf == NULL && ctx->in == NULL) {
 
         if (ctx->busy) {
             if (ngx_http_replace_output(r, ctx) == NGX_ERROR) {
@@ -286,9 +618,28 @@ ngx_http_replace_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
             }
         }
 
+        if (ngx_http_replace_collect(r, ctx, in) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
         return ngx_http_next_body_filter(r, in);
     }
 
+#if (NGX_THREADS)
+    if (ctx->thread && ctx->thread->busy) {
+
+        /* only take the new data and flush the output meanwhile */
+
+        if (in && ngx_chain_add_copy(r->pool, &ctx->in, in) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        rc = ngx_http_replace_output(r, ctx);
+
+        return (rc == NGX_ERROR) ? NGX_ERROR : NGX_AGAIN;
+    }
+#endif
+
     /* add the incoming chain to the chain ctx->in */
 
     if (in) {
@@ -297,6 +648,16 @@ ngx_http_replace_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
         }
     }
 
+#if (NGX_THREADS)
+    if (ctx->thread) {
+        cur = ctx->thread->cur;
+        rematch = ctx->thread->rematch;
+
+        ctx->thread->cur = NULL;
+        ctx->thread->rematch = NULL;
+    }
+#endif
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http sub filter \"%V\"", &r->uri);
 
@@ -304,21 +665,57 @@ ngx_http_replace_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 
         if (ctx->buf == NULL) {
             cur = ctx->in;
-            ctx->buf = cur->buf;
             ctx->in = cur->next;
 
-            ctx->pos = ctx->buf->pos;
-            ctx->special_buf = ngx_buf_special(ctx->buf);
-            ctx->last_buf = (ctx->buf->last_buf || ctx->buf->last_in_chain);
+            if (rlcf->sendfile && ngx_http_replace_file_buf(cur->buf)) {
 
-            dd("=== new incoming buf: size=%d, special=%u, last=%u",
-               (int) ngx_buf_size(ctx->buf), ctx->special_buf,
-               ctx->last_buf);
-        }
+                if (ctx->once || ctx->vm_done) {
+                    if (ngx_http_replace_output_file(r, ctx, cur->buf)
+                        != NGX_OK)
+                    {
+                        return NGX_ERROR;
+                    }
 
-        b = NULL;
+                    continue;
+                }
 
-        while (ctx->pos < ctx->buf->last
+                if (ngx_http_replace_read_window(r, ctx, cur->buf)
+                    != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+
+                ctx->buf = ctx->part;
+
+            } else if (rlcf->slice
+                       && ngx_buf_in_memory(cur->buf)
+                       && (size_t) (cur->buf->last - cur->buf->pos)
+                          > rlcf->slice)
+            {
+                if (ngx_http_replace_slice_buf(r, ctx, cur->buf, rlcf->slice)
+                    != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+
+                ctx->buf = ctx->part;
+
+            } else {
+                ctx->buf = cur->buf;
+            }
+
+            ctx->pos = ctx->buf->pos;
+            ctx->special_buf = ngx_buf_special(ctx->buf);
+            ctx->last_buf = (ctx->buf->last_buf || ctx->buf->last_in_chain);
+
+            dd("=== new incoming buf: size=%d, special=%u, last=%u",
+               (int) ngx_buf_size(ctx->buf), ctx->special_buf,
+               ctx->last_buf);
+        }
+
+        b = NULL;
+
+        while (ctx->pos < ctx->buf->last
                || (ctx->special_buf && ctx->last_buf))
         {
             rc = rlcf->parse_buf(r, ctx, rematch);
@@ -331,6 +728,18 @@ ngx_http_replace_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
                 return rc;
             }
 
+#if (NGX_THREADS)
+            if (rc == NGX_DONE) {
+
+                /* the regexes run in a thread, see ngx_http_replace_exec() */
+
+                ctx->thread->cur = cur;
+                ctx->thread->rematch = rematch;
+
+                goto suspend;
+            }
+#endif
+
             if (rc == NGX_DECLINED) {
 
                 if (ctx->pending) {
@@ -351,7 +760,7 @@ ngx_http_replace_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
                     ctx->copy_end = NULL;
                 }
 
-                sre_reset_pool(ctx->vm_pool);
+                rlcf->backend->reset(r, ctx);
                 ctx->vm_done = 1;
             }
 
@@ -373,6 +782,10 @@ ngx_http_replace_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
                 b->pos = ctx->copy_start;
                 b->last = ctx->copy_end;
 
+                if (ctx->buf == ctx->window) {
+                    ngx_http_replace_window_span(ctx, b);
+                }
+
                 *ctx->last_out = cl;
                 ctx->last_out = &cl->next;
             }
@@ -391,23 +804,15 @@ ngx_http_replace_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 
             /* rc == NGX_OK || rc == NGX_BUSY */
 
-            cl = ngx_http_replace_get_free_buf(r->pool, &ctx->free);
-            if (cl == NULL) {
-                return NGX_ERROR;
-            }
-
-            b = cl->buf;
-
-            dd("free data buf: %p", b);
-
             sub = &ctx->sub[ctx->regex_id];
 
             if (sub->data == NULL
-                || rlcf->parse_buf == ngx_http_replace_capturing_parse)
+                || rlcf->parse_buf == ngx_http_replace_capturing_parse
+                || ngx_http_replace_regex_is_disabled(ctx, rlcf))
             {
                 ngx_http_replace_complex_value_t            *cv;
 
-                if (ngx_http_replace_regex_is_disabled(ctx)) {
+                if (ngx_http_replace_regex_is_disabled(ctx, rlcf)) {
                     cv = &rlcf->verbatim;
 
                 } else {
@@ -415,59 +820,98 @@ ngx_http_replace_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
                     cv = &cv[ctx->regex_id];
                 }
 
-                if (ngx_http_replace_complex_value(r, ctx->captured,
-                                                   rlcf->ncaps,
-                                                   ctx->ovector,
-                                                   cv, sub)
-                    != NGX_OK)
-                {
-                    return NGX_ERROR;
-                }
+                if (cv->verbatim) {
+
+                    /* pass the matched data itself through */
+
+                    if (ngx_http_replace_output_verbatim(r, ctx, &b)
+                        != NGX_OK)
+                    {
+                        return NGX_ERROR;
+                    }
+
+                    sub = NULL;
+
+                } else {
 
-                /* release ctx->captured */
-                if (ctx->captured) {
-                    dd("release ctx captured: %p", ctx->captured);
-                    *ctx->last_captured = ctx->free;
-                    ctx->free = ctx->captured;
+                    if (rlcf->capture_program
+                        && cv->group_variables
+                        && ngx_http_replace_exec_captures(r, ctx) != NGX_OK)
+                    {
+                        return NGX_ERROR;
+                    }
 
-                    ctx->captured = NULL;
-                    ctx->last_captured = &ctx->captured;
+                    if (ngx_http_replace_complex_value(r, ctx->captured,
+                                                       rlcf->ncaps,
+                                                       ctx->ovector,
+                                                       cv, sub)
+                        != NGX_OK)
+                    {
+                        return NGX_ERROR;
+                    }
                 }
             }
 
-            dd("emit replaced value: \"%.*s\"", (int) sub->len, sub->data);
+            /* release ctx->captured */
+            if (ctx->captured) {
+                dd("release ctx captured: %p", ctx->captured);
+                *ctx->last_captured = ctx->free;
+                ctx->free = ctx->captured;
 
-            if (sub->len) {
-                b->memory = 1;
-                b->pos = sub->data;
-                b->last = sub->data + sub->len;
+                ctx->captured = NULL;
+                ctx->last_captured = &ctx->captured;
+            }
 
-            } else {
-                b->sync = 1;
+            if (sub) {
+                dd("emit replaced value: \"%.*s\"", (int) sub->len,
+                   sub->data);
+
+                cl = ngx_http_replace_get_free_buf(r->pool, &ctx->free);
+                if (cl == NULL) {
+                    return NGX_ERROR;
+                }
+
+                b = cl->buf;
+
+                if (sub->len) {
+                    b->memory = 1;
+                    b->pos = sub->data;
+                    b->last = sub->data + sub->len;
+
+                } else {
+                    b->sync = 1;
+                }
+
+                *ctx->last_out = cl;
+                ctx->last_out = &cl->next;
             }
 
-            cl->buf = b;
-            cl->next = NULL;
+            if (!ctx->once
+                && !ngx_http_replace_regex_is_disabled(ctx, rlcf))
+            {
+                ngx_uint_t    *limit;
 
-            *ctx->last_out = cl;
-            ctx->last_out = &cl->next;
+                limit = rlcf->multi_limit.elts;
 
-            if (!ctx->once && !ngx_http_replace_regex_is_disabled(ctx)) {
-                uint8_t    *once;
+                if (rlcf->max_replacements
+                    && ++ctx->replacements == rlcf->max_replacements)
+                {
+                    ctx->once = 1;
 
-                once = rlcf->multi_once.elts;
+                } else if (limit[ctx->regex_id]
+                           && ++ctx->counts[ctx->regex_id]
+                              == limit[ctx->regex_id])
+                {
+                    /* the rule is exhausted */
 
-                if (rlcf->regexes.nelts == 1) {
-                    ctx->once = once[0];
+                    if (++ctx->disabled_count == rlcf->regexes.nelts) {
+                        ctx->once = 1;
 
-                } else {
-                    if (once[ctx->regex_id]) {
-                        ngx_http_replace_regex_set_disabled(ctx);
-                        if (!rlcf->seen_global
-                            && ++ctx->disabled_count == rlcf->regexes.nelts)
-                        {
-                            ctx->once = 1;
-                        }
+                    } else if (rlcf->variants
+                               && ngx_http_replace_vm_variant(r, ctx)
+                                  != NGX_OK)
+                    {
+                        return NGX_ERROR;
                     }
                 }
             }
@@ -484,8 +928,22 @@ ngx_http_replace_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
             continue;
         }
 
+        shadow = ctx->buf;
+
+        if (ctx->buf == ctx->part && cur) {
+            shadow = ctx->part_buf;
+
+            if (ngx_http_replace_next_part(ctx)) {
+
+                /* match the next part of the same buf */
+
+                ctx->in = cur;
+                shadow = NULL;
+            }
+        }
+
         if ((ctx->buf->flush || ctx->last_buf || ngx_buf_in_memory(ctx->buf))
-            && cur)
+            && cur && shadow)
         {
             if (b == NULL) {
                 cl = ngx_http_replace_get_free_buf(r->pool, &ctx->free);
@@ -504,12 +962,13 @@ ngx_http_replace_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
             b->last_buf = ctx->buf->last_buf;
             b->last_in_chain = ctx->buf->last_in_chain;
             b->flush = ctx->buf->flush;
-            b->shadow = ctx->buf;
-            b->recycled = ctx->buf->recycled;
+            b->shadow = shadow;
+            b->recycled = shadow->recycled;
         }
 
         if (!ctx->special_buf) {
             ctx->stream_pos += ctx->buf->last - ctx->buf->pos;
+            scanned += ctx->buf->last - ctx->buf->pos;
         }
 
         if (rematch) {
@@ -555,9 +1014,32 @@ rematch:
                                     ctx->last_pending2);
         */
 #endif
+
+        if (rlcf->slice && scanned >= rlcf->slice
+            && ctx->buf == NULL && ctx->in
+            && !ctx->once && !ctx->vm_done)
+        {
+            /* leave the rest to the next iteration of the event loop */
+
+            if (ngx_http_replace_post_resume(r, ctx) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            break;
+        }
     } /* while */
 
+#if (NGX_THREADS)
+suspend:
+#endif
+
     if (ctx->out == NULL && ctx->busy == NULL) {
+
+        if (ctx->in || ctx->buf) {
+            /* a whole slice may have become pending data */
+            r->buffered |= NGX_HTTP_SUB_BUFFERED;
+        }
+
         return NGX_OK;
     }
 
@@ -589,6 +1071,10 @@ ngx_http_replace_output(ngx_http_request_t *r, ngx_http_replace_ctx_t *ctx)
     /* ngx_http_replace_dump_chain("ctx->out", &ctx->out, ctx->last_out); */
 #endif
 
+    if (ngx_http_replace_collect(r, ctx, ctx->out) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
     rc = ngx_http_next_body_filter(r, ctx->out);
 
     /* we are essentially duplicating the logic of
@@ -674,6 +1160,231 @@ ngx_http_replace_output(ngx_http_request_t *r, ngx_http_replace_ctx_t *ctx)
 }
 
 
+/*
+ * Emits the bytes of the match with buffers pointing into ctx->captured,
+ * which refer to either the incoming buffer or the pending data, instead
+ * of copying them to a new string.
+ */
+
+static ngx_int_t
+ngx_http_replace_output_verbatim(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, ngx_buf_t **last)
+{
+    sre_int_t            from, to, start, end;
+    ngx_buf_t           *b, *cb;
+    ngx_chain_t         *cl, *ncl;
+
+    from = ctx->ovector[0];
+    to = ctx->ovector[1];
+
+    for (cl = ctx->captured; cl; cl = cl->next) {
+        cb = cl->buf;
+
+        start = ngx_max(from, (sre_int_t) cb->file_pos);
+        end = ngx_min(to, (sre_int_t) cb->file_last);
+
+        if (start >= end) {
+            continue;
+        }
+
+        ncl = ngx_http_replace_get_free_buf(r->pool, &ctx->free);
+        if (ncl == NULL) {
+            return NGX_ERROR;
+        }
+
+        b = ncl->buf;
+
+        b->memory = 1;
+        b->pos = cb->pos + (start - cb->file_pos);
+        b->last = b->pos + (end - start);
+
+        dd("emit verbatim: \"%.*s\"", (int) (end - start), b->pos);
+
+        if (ctx->part_buf) {
+            ngx_http_replace_window_span(ctx, b);
+        }
+
+        *ctx->last_out = ncl;
+        ctx->last_out = &ncl->next;
+
+        *last = b;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_replace_post_resume(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx)
+{
+    ngx_event_t             *ev;
+    ngx_pool_cleanup_t      *cln;
+
+    ev = ctx->resume;
+
+    if (ev == NULL) {
+        ev = ngx_pcalloc(r->pool, sizeof(ngx_event_t));
+        if (ev == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln->handler = ngx_http_replace_cleanup_resume;
+        cln->data = ev;
+
+        ev->handler = ngx_http_replace_resume_handler;
+        ev->data = r;
+        ev->log = r->connection->log;
+
+        ctx->resume = ev;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "replace filter slice done, posting");
+
+    ngx_post_event(ev, &ngx_http_replace_posted_events);
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_replace_resume_handler(ngx_event_t *ev)
+{
+    ngx_connection_t        *c;
+    ngx_http_request_t      *r;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "replace filter resume \"%V?%V\"", &r->uri, &r->args);
+
+    if (ngx_http_output_filter(r, NULL) == NGX_ERROR) {
+        ngx_http_finalize_request(r, NGX_ERROR);
+
+    } else if (!(r->buffered & NGX_HTTP_SUB_BUFFERED)) {
+
+        /* let the write event handler finalize the request if it waits */
+
+        ngx_post_event(c->write, &ngx_posted_events);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_replace_cleanup_resume(void *data)
+{
+    ngx_event_t  *ev = data;
+
+    if (ev->posted) {
+        ngx_delete_posted_event(ev);
+    }
+}
+
+
+/* feeds the output to replace_filter_cache and replace_filter_static */
+
+static ngx_int_t
+ngx_http_replace_collect(ngx_http_request_t *r, ngx_http_replace_ctx_t *ctx,
+    ngx_chain_t *in)
+{
+    if (ctx->cache && ngx_http_replace_cache_collect(r, ctx, in) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ctx->sidecar && ngx_http_replace_static_write(r, ctx, in) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * Sends the output stored by replace_filter_cache in place of the response
+ * body, which is only consumed.
+ */
+
+static ngx_int_t
+ngx_http_replace_send_cached(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, ngx_chain_t *in)
+{
+    ngx_buf_t                      *b, *sb;
+    ngx_chain_t                    *cl, *out, **ll;
+    ngx_http_replace_cache_ctx_t   *cc;
+
+    cc = ctx->cache;
+
+    out = NULL;
+    ll = &out;
+
+    if (!cc->sent) {
+        cc->sent = 1;
+
+        if (cc->len) {
+            b = ngx_calloc_buf(r->pool);
+            if (b == NULL) {
+                return NGX_ERROR;
+            }
+
+            b->pos = cc->data;
+            b->last = cc->data + cc->len;
+            b->memory = 1;
+
+            cl = ngx_alloc_chain_link(r->pool);
+            if (cl == NULL) {
+                return NGX_ERROR;
+            }
+
+            cl->buf = b;
+            *ll = cl;
+            ll = &cl->next;
+        }
+    }
+
+    for (cl = in; cl; cl = cl->next) {
+        b = cl->buf;
+
+        if (b->last_buf || b->last_in_chain || b->flush) {
+            sb = ngx_calloc_buf(r->pool);
+            if (sb == NULL) {
+                return NGX_ERROR;
+            }
+
+            sb->last_buf = b->last_buf;
+            sb->last_in_chain = b->last_in_chain;
+            sb->flush = b->flush;
+            sb->sync = 1;
+
+            *ll = ngx_alloc_chain_link(r->pool);
+            if (*ll == NULL) {
+                return NGX_ERROR;
+            }
+
+            (*ll)->buf = sb;
+            ll = &(*ll)->next;
+        }
+
+        b->pos = b->last;
+        b->file_pos = b->file_last;
+    }
+
+    *ll = NULL;
+
+    return ngx_http_next_body_filter(r, out);
+}
+
+
 static char *
 ngx_http_replace_filter(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -682,9 +1393,9 @@ ngx_http_replace_filter(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     int             *flags;
     u_char          *p, **re;
+    ngx_int_t        n;
     ngx_str_t       *value;
-    ngx_uint_t       i;
-    uint8_t         *once;
+    ngx_uint_t       i, j, *limit;
 
     ngx_pool_cleanup_t                          *cln;
     ngx_http_replace_complex_value_t            *cv;
@@ -734,25 +1445,39 @@ ngx_http_replace_filter(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
     *flags = 0;
 
-    once = ngx_array_push(&rlcf->multi_once);
-    if (once == NULL) {
+    limit = ngx_array_push(&rlcf->multi_limit);
+    if (limit == NULL) {
         return NGX_CONF_ERROR;
     }
-    *once = 1;  /* default to once */
+    *limit = 1;  /* default to once */
+
+    n = 0;
+
+    for (j = 3; j < cf->args->nelts; j++) {
 
-    if (cf->args->nelts == 4) {
-        /* 3 user args */
+        if (ngx_strncmp(value[j].data, "n=", 2) == 0) {
+            if (n) {
+                return "is duplicate";
+            }
+
+            n = ngx_atoi(value[j].data + 2, value[j].len - 2);
+            if (n == NGX_ERROR || n == 0) {
+                return "specifies an invalid replacement count";
+            }
+
+            continue;
+        }
 
-        p = value[3].data;
+        p = value[j].data;
 
-        for (i = 0; i < value[3].len; i++) {
+        for (i = 0; i < value[j].len; i++) {
             switch (p[i]) {
             case 'i':
                 *flags |= SRE_REGEX_CASELESS;
                 break;
 
             case 'g':
-                *once = 0;
+                *limit = 0;
                 break;
 
             default:
@@ -761,15 +1486,24 @@ ngx_http_replace_filter(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         }
     }
 
-    if (*once) {
-        rlcf->seen_once = 1;
+    if (n) {
+        if (*limit == 0) {
+            return "specifies both the \"g\" flag and a replacement count";
+        }
+
+        *limit = n;
+    }
+
+    if (*limit) {
+        rlcf->seen_limited = 1;
 
     } else {
         rlcf->seen_global = 1;
     }
 
-    if (rlcf->seen_once && rlcf->regexes.nelts > 1) {
-        rlcf->parse_buf = ngx_http_replace_capturing_parse;
+    if (rlcf->seen_limited && rlcf->regexes.nelts > 1) {
+
+        /* for the matches of the rules that are exhausted */
 
         if (rlcf->verbatim.value.data == NULL) {
             ngx_str_t           v = ngx_string("$&");
@@ -810,33 +1544,121 @@ ngx_http_replace_filter(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 }
 
 
-static void *
-ngx_http_replace_create_loc_conf(ngx_conf_t *cf)
+static char *
+ngx_http_replace_program_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
 {
-    ngx_http_replace_loc_conf_t  *conf;
+    ngx_http_replace_main_conf_t    *rmcf = conf;
 
-    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_replace_loc_conf_t));
-    if (conf == NULL) {
-        return NULL;
+    ngx_str_t       *value;
+
+    if (rmcf->program_cache.data) {
+        return "is duplicate";
     }
 
-    /*
-     * set by ngx_pcalloc():
-     *
-     *     conf->types = { NULL };
-     *     conf->types_keys = NULL;
-     *     conf->program = NULL;
-     *     conf->ncaps = 0;
-     *     conf->ovecsize = 0;
-     *     conf->parse_buf = NULL;
-     *     conf->verbatim = { {0, NULL}, NULL, NULL, 0 };
-     *     conf->seen_once = 0;
-     *     conf->seen_global = 0;
-     *     conf->skip = NULL;
+    value = cf->args->elts;
+
+    rmcf->program_cache = value[1];
+
+    if (ngx_conf_full_name(cf->cycle, &rmcf->program_cache, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_replace_stop_at(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_replace_loc_conf_t     *rlcf = conf;
+
+    ngx_str_t       *value;
+
+    if (rlcf->stop_at.data) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (value[1].len == 0) {
+        return "takes an empty string";
+    }
+
+    rlcf->stop_at = value[1];
+
+    if (ngx_http_replace_stop_at_init(cf, rlcf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_http_replace_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_replace_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_replace_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->types = { NULL };
+     *     conf->types_keys = NULL;
+     *     conf->program = NULL;
+     *     conf->capture_program = NULL;
+     *     conf->regex_info = NULL;
+     *     conf->scan = NULL;
+     *     conf->literal = NULL;
+     *     conf->dfa = NULL;
+     *     conf->backend = NULL;
+     *     conf->backend_conf = NULL;
+     *     conf->shared = NULL;
+     *     conf->vm_cache = NULL;
+     *     conf->jit_code = NULL;
+     *     conf->jit_handler = NULL;
+     *     conf->max_len = 0;
+     *     conf->ncaps = 0;
+     *     conf->ovecsize = 0;
+     *     conf->vm_ovecsize = 0;
+     *     conf->parse_buf = NULL;
+     *     conf->verbatim = { {0, NULL}, NULL, NULL, 0, 0 };
+     *     conf->seen_limited = 0;
+     *     conf->seen_global = 0;
+     *     conf->restartable = 0;
+     *     conf->skip = NULL;
+     *     conf->cache_key = NULL;
+     *     conf->rules_hash = 0;
+     *     conf->variants = NULL;
+     *     conf->stop_at = { 0, NULL };
+     *     conf->stop_at_next = NULL;
      */
 
     conf->max_buffered_size = NGX_CONF_UNSET_SIZE;
+    conf->overflow = NGX_CONF_UNSET_UINT;
+    conf->max_replacements = NGX_CONF_UNSET_UINT;
+    conf->scan_limit = NGX_CONF_UNSET_SIZE;
+    conf->sendfile = NGX_CONF_UNSET;
+    conf->sendfile_window = NGX_CONF_UNSET_SIZE;
+    conf->slice = NGX_CONF_UNSET_SIZE;
+    conf->decompress = NGX_CONF_UNSET;
+    conf->cache_zone = NGX_CONF_UNSET_PTR;
+    conf->cache_max_size = NGX_CONF_UNSET_SIZE;
+    conf->static_files = NGX_CONF_UNSET;
+    conf->static_path = NULL;
+#if (NGX_THREADS)
+    conf->thread_pool = NGX_CONF_UNSET_PTR;
+    conf->thread_threshold = NGX_CONF_UNSET_SIZE;
+#endif
     conf->last_modified = NGX_CONF_UNSET_UINT;
+    conf->engine = NGX_CONF_UNSET_UINT;
+    conf->lazy_compile = NGX_CONF_UNSET;
+    conf->vm_cache_size = NGX_CONF_UNSET_UINT;
 
     ngx_array_init(&conf->multi_replace, cf->pool, 4,
                    sizeof(ngx_http_replace_complex_value_t));
@@ -845,7 +1667,7 @@ ngx_http_replace_create_loc_conf(ngx_conf_t *cf)
 
     ngx_array_init(&conf->regexes, cf->pool, 4, sizeof(u_char *));
 
-    ngx_array_init(&conf->multi_once, cf->pool, 4, sizeof(uint8_t));
+    ngx_array_init(&conf->multi_limit, cf->pool, 4, sizeof(ngx_uint_t));
 
     return conf;
 }
@@ -854,26 +1676,79 @@ ngx_http_replace_create_loc_conf(ngx_conf_t *cf)
 static char *
 ngx_http_replace_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 {
-    u_char         **value;
-    sre_int_t        err_offset, err_regex_id;
-    ngx_str_t        prefix, suffix;
-    sre_pool_t      *ppool; /* parser pool */
-    sre_regex_t     *re;
-    sre_program_t   *prog;
-
-    ngx_http_replace_main_conf_t    *rmcf;
-
     ngx_http_replace_loc_conf_t *prev = parent;
     ngx_http_replace_loc_conf_t *conf = child;
 
+    ngx_http_replace_main_conf_t  *rmcf;
+
     ngx_conf_merge_size_value(conf->max_buffered_size,
                               prev->max_buffered_size,
                               8192);
 
+    ngx_conf_merge_uint_value(conf->overflow, prev->overflow,
+                              NGX_HTTP_REPLACE_OVERFLOW_STOP);
+
+    ngx_conf_merge_uint_value(conf->max_replacements, prev->max_replacements,
+                              0);
+
+    ngx_conf_merge_size_value(conf->scan_limit, prev->scan_limit, 0);
+
+    if (conf->stop_at.data == NULL) {
+        conf->stop_at = prev->stop_at;
+        conf->stop_at_next = prev->stop_at_next;
+    }
+
+    ngx_conf_merge_value(conf->sendfile, prev->sendfile, 0);
+
+    ngx_conf_merge_size_value(conf->sendfile_window, prev->sendfile_window,
+                              32768);
+
+    if (conf->sendfile_window == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "replace_filter_sendfile_window must not be 0");
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_conf_merge_size_value(conf->slice, prev->slice, 0);
+
+    ngx_conf_merge_value(conf->decompress, prev->decompress, 0);
+
+    ngx_conf_merge_bufs_value(conf->decompress_bufs, prev->decompress_bufs,
+                              4, 8192);
+
+    if (conf->cache_zone == NGX_CONF_UNSET_PTR) {
+        ngx_conf_merge_ptr_value(conf->cache_zone, prev->cache_zone, NULL);
+        conf->cache_key = prev->cache_key;
+        conf->cache_max_size = prev->cache_max_size;
+    }
+
+    ngx_conf_merge_value(conf->static_files, prev->static_files, 0);
+
+    if (ngx_conf_merge_path_value(cf, &conf->static_path, prev->static_path,
+                                  &ngx_http_replace_static_path)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+#if (NGX_THREADS)
+    if (conf->thread_pool == NGX_CONF_UNSET_PTR) {
+        ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+        conf->thread_threshold = prev->thread_threshold;
+    }
+#endif
+
     ngx_conf_merge_uint_value(conf->last_modified,
                               prev->last_modified,
                               NGX_HTTP_REPLACE_CLEAR_LAST_MODIFIED);
 
+    ngx_conf_merge_uint_value(conf->engine, prev->engine,
+                              NGX_HTTP_REPLACE_ENGINE_PIKE);
+
+    ngx_conf_merge_value(conf->lazy_compile, prev->lazy_compile, 0);
+
+    ngx_conf_merge_uint_value(conf->vm_cache_size, prev->vm_cache_size, 16);
+
     if (ngx_http_merge_types(cf, &conf->types_keys, &conf->types,
                              &prev->types_keys, &prev->types,
                              ngx_http_html_default_types)
@@ -886,58 +1761,666 @@ ngx_http_replace_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
         conf->skip = prev->skip;
     }
 
-    if (conf->regexes.nelts > 0 && conf->program == NULL) {
+    if (conf->regexes.nelts == 0) {
 
-        dd("parsing and compiling %d regexes", (int) conf->regexes.nelts);
+        conf->regexes       = prev->regexes;
+        conf->multi_limit   = prev->multi_limit;
+        conf->multi_flags   = prev->multi_flags;
+        conf->multi_replace = prev->multi_replace;
+        conf->parse_buf     = prev->parse_buf;
+        conf->verbatim      = prev->verbatim;
+        conf->program       = prev->program;
+        conf->capture_program = prev->capture_program;
+        conf->regex_info    = prev->regex_info;
+        conf->scan          = prev->scan;
+        conf->literal       = prev->literal;
+        conf->dfa           = prev->dfa;
+        conf->variants      = prev->variants;
+        conf->backend_conf  = prev->backend_conf;
+        conf->jit_code      = prev->jit_code;
+        conf->jit_handler   = prev->jit_handler;
+        conf->max_len       = prev->max_len;
+        conf->ncaps         = prev->ncaps;
+        conf->ovecsize      = prev->ovecsize;
+        conf->vm_ovecsize   = prev->vm_ovecsize;
+        conf->seen_limited  = prev->seen_limited;
+        conf->seen_global   = prev->seen_global;
+        conf->restartable   = prev->restartable;
+        conf->shared        = prev->shared;
 
-        ppool = sre_create_pool(1024);
-        if (ppool == NULL) {
+    } else if (conf->lazy_compile) {
+        if (ngx_http_replace_sregex_check(cf, conf) != NGX_OK) {
             return NGX_CONF_ERROR;
         }
+    }
 
-        value = conf->regexes.elts;
+    if ((conf->cache_zone || conf->static_files)
+        && ngx_http_replace_cache_init_rules(conf) != NGX_OK)
+    {
+        /* the output also depends on nginx variables */
+        conf->cache_zone = NULL;
+        conf->static_files = 0;
+    }
 
-        re = sre_regex_parse_multi(ppool, value, conf->regexes.nelts,
-                                   &conf->ncaps, conf->multi_flags.elts,
-                                   &err_offset, &err_regex_id);
+    if (conf->static_files && conf->regexes.nelts > 0) {
+        rmcf = ngx_http_conf_get_module_main_conf(cf,
+                                            ngx_http_replace_filter_module);
+        rmcf->static_files = 1;
+    }
+
+    if (conf->regexes.nelts > 0) {
+        conf->vm_cache = ngx_http_replace_vm_cache_create(cf,
+                                                     conf->vm_cache_size);
+        if (conf->vm_cache == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (conf->program == NULL && conf->regexes.nelts > 0
+        && conf->lazy_compile)
+    {
+        /* see ngx_http_replace_lazy_compile() */
+        return NGX_CONF_OK;
+    }
 
-        if (re == NULL) {
+    if (ngx_http_replace_compile(cf, conf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
 
-            if (err_offset >= 0) {
-                prefix.data = value[err_regex_id];
-                prefix.len = err_offset;
+    return NGX_CONF_OK;
+}
 
-                suffix.data = value[err_regex_id] + err_offset;
-                suffix.len = ngx_strlen(value[err_regex_id]) - err_offset;
 
-                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                                   "failed to parse regex at offset %i: "
-                                   "syntax error; marked by <-- HERE in "
-                                   "\"%V <-- HERE %V\"",
-                                   (ngx_int_t) err_offset, &prefix, &suffix);
+/*
+ * Compiles the rules of a location along with the tables of its engine,
+ * either when nginx loads the configuration or, with
+ * "replace_filter_lazy_compile", on the first request to the location.
+ */
 
-            } else {
+static ngx_int_t
+ngx_http_replace_compile(ngx_conf_t *cf, ngx_http_replace_loc_conf_t *rlcf)
+{
+    ngx_int_t                    rc;
+    ngx_http_replace_program_t  *shared;
 
-                if (err_regex_id >= 0) {
-                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                                       "failed to parse regex \"%s\"",
-                                       value[err_regex_id]);
+    if (rlcf->regexes.nelts > 0 && rlcf->program == NULL) {
 
-                } else {
-                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                                       "failed to parse regex \"%s\" "
-                                       "and its siblings",
-                                       value[0]);
+        rc = ngx_http_replace_program_get(cf, rlcf);
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc != NGX_OK) {
+            if (ngx_http_replace_sregex_backend.compile(cf, rlcf) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            if (ngx_http_replace_analyze_regexes(cf, rlcf) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            if (rlcf->ncaps > 0
+                && rlcf->parse_buf == ngx_http_replace_capturing_parse
+                && ngx_http_replace_compile_scanner(cf, rlcf) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            ngx_http_replace_program_save(rlcf);
+        }
+
+        /* the limits are not part of the program key */
+
+        if (ngx_http_replace_compile_variants(cf, rlcf) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    shared = rlcf->shared;
+
+    if (rlcf->engine != NGX_HTTP_REPLACE_ENGINE_DFA) {
+        rlcf->dfa = NULL;
+
+    } else if (rlcf->dfa == NULL
+               && rlcf->regexes.nelts > 0
+               && rlcf->literal == NULL)
+    {
+        if (shared && shared->dfa_done) {
+            rlcf->dfa = shared->dfa;
+
+        } else {
+            if (ngx_http_replace_create_dfa(cf, rlcf) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            if (shared) {
+                shared->dfa = rlcf->dfa;
+                shared->dfa_done = 1;
+            }
+        }
+    }
+
+    if (rlcf->engine != NGX_HTTP_REPLACE_ENGINE_JIT) {
+        rlcf->jit_code = NULL;
+        rlcf->jit_handler = NULL;
+
+    } else if (rlcf->jit_code == NULL
+               && rlcf->regexes.nelts > 0
+               && rlcf->literal == NULL)
+    {
+        if (shared && shared->jit_done) {
+            rlcf->jit_code = shared->jit_code;
+            rlcf->jit_handler = shared->jit_handler;
+
+        } else {
+            if (ngx_http_replace_create_jit(cf, rlcf) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            if (shared) {
+                shared->jit_code = rlcf->jit_code;
+                shared->jit_handler = rlcf->jit_handler;
+                shared->jit_done = 1;
+            }
+        }
+    }
+
+    rlcf->backend = &ngx_http_replace_sregex_backend;
+
+    if (rlcf->engine != NGX_HTTP_REPLACE_ENGINE_PCRE2) {
+        rlcf->backend_conf = NULL;
+
+    } else if (rlcf->regexes.nelts > 0) {
+
+#if (NGX_PCRE2)
+        if (rlcf->backend_conf == NULL) {
+
+            if (shared && shared->backend_done) {
+                rlcf->backend_conf = shared->backend_conf;
+
+            } else {
+                if (ngx_http_replace_pcre2_backend.compile(cf, rlcf)
+                    == NGX_ERROR)
+                {
+                    return NGX_ERROR;
+                }
+
+                if (shared) {
+                    shared->backend_conf = rlcf->backend_conf;
+                    shared->backend_done = 1;
                 }
             }
+        }
 
-            sre_destroy_pool(ppool);
-            return NGX_CONF_ERROR;
+        if (rlcf->backend_conf) {
+            rlcf->backend = &ngx_http_replace_pcre2_backend;
+
+            /* PCRE2 reports the submatches itself */
+            rlcf->capture_program = NULL;
         }
+#else
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "replace_filter_engine pcre2 requires nginx "
+                           "to be built with PCRE2, using pike");
+#endif
+    }
 
-        rmcf = ngx_http_conf_get_module_main_conf(cf,
+    return NGX_OK;
+}
+
+
+/*
+ * Compiles the rules of the location in the worker process, as if nginx
+ * was loading the configuration. The programs are allocated from the
+ * cycle pool and kept until the next configuration load.
+ */
+
+static ngx_int_t
+ngx_http_replace_lazy_compile(ngx_http_request_t *r,
+    ngx_http_replace_loc_conf_t *rlcf)
+{
+    ngx_int_t                rc;
+    ngx_conf_t               cf;
+    ngx_http_conf_ctx_t      conf_ctx;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "replace filter compiling \"%s\" and its siblings",
+                   ((u_char **) rlcf->regexes.elts)[0]);
+
+    conf_ctx.main_conf = r->main_conf;
+    conf_ctx.srv_conf = r->srv_conf;
+    conf_ctx.loc_conf = r->loc_conf;
+
+    ngx_memzero(&cf, sizeof(ngx_conf_t));
+
+    cf.ctx = &conf_ctx;
+    cf.cycle = (ngx_cycle_t *) ngx_cycle;
+    cf.pool = ngx_cycle->pool;
+    cf.log = r->connection->log;
+    cf.module_type = NGX_HTTP_MODULE;
+    cf.cmd_type = NGX_HTTP_LOC_CONF;
+
+    cf.temp_pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, cf.log);
+    if (cf.temp_pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    rc = ngx_http_replace_compile(&cf, rlcf);
+
+    ngx_destroy_pool(cf.temp_pool);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_replace_analyze_regexes(ngx_conf_t *cf,
+    ngx_http_replace_loc_conf_t *rlcf)
+{
+    int                             *flags;
+    u_char                         **value;
+    uint8_t                          first[32];
+    ngx_int_t                        rc;
+    ngx_str_t                       *literals;
+    ngx_uint_t                       i, j, n, prefilter, literal;
+    ngx_http_replace_re_t           *re;
+    ngx_http_replace_regex_info_t   *info;
+
+    n = rlcf->regexes.nelts;
+    value = rlcf->regexes.elts;
+    flags = rlcf->multi_flags.elts;
+
+    info = ngx_palloc(cf->pool, n * sizeof(ngx_http_replace_regex_info_t));
+    if (info == NULL) {
+        return NGX_ERROR;
+    }
+
+    rlcf->regex_info = info;
+
+    literals = ngx_palloc(cf->temp_pool, n * sizeof(ngx_str_t));
+    if (literals == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(first, sizeof(first));
+    prefilter = 1;
+    literal = 1;
+
+    rlcf->max_len = 0;
+
+    for (i = 0; i < n; i++) {
+        re = ngx_http_replace_regex_parse(cf->temp_pool, value[i], flags[i]);
+
+        ngx_http_replace_regex_analyze(re, &info[i]);
+
+        dd("regex \"%s\": opaque=%d, nullable=%d, assertions=%d, max=%d",
+           value[i], info[i].opaque, info[i].nullable, info[i].assertions,
+           (int) info[i].max_len);
+
+        /*
+         * the VM may only be restarted at an arbitrary offset when no regex
+         * can match the empty string nor look at the preceding context
+         */
+
+        if (info[i].nullable || info[i].assertions) {
+            prefilter = 0;
+        }
+
+        if (info[i].max_len == NGX_HTTP_REPLACE_UNBOUNDED
+            || rlcf->max_len == NGX_HTTP_REPLACE_UNBOUNDED)
+        {
+            rlcf->max_len = NGX_HTTP_REPLACE_UNBOUNDED;
+
+        } else if (info[i].max_len > rlcf->max_len) {
+            rlcf->max_len = info[i].max_len;
+        }
+
+        for (j = 0; j < sizeof(first); j++) {
+            first[j] |= info[i].first[j];
+        }
+
+        /* the automaton folds case for all the strings or for none */
+
+        if (!literal
+            || (flags[i] & SRE_REGEX_CASELESS)
+               != (flags[0] & SRE_REGEX_CASELESS))
+        {
+            literal = 0;
+            continue;
+        }
+
+        /* a literal is never longer than its regex source */
+
+        literals[i].data = ngx_pnalloc(cf->temp_pool, ngx_strlen(value[i]));
+        if (literals[i].data == NULL) {
+            return NGX_ERROR;
+        }
+
+        rc = ngx_http_replace_regex_literal(re, &info[i], flags[i],
+                                            literals[i].data);
+        if (rc == NGX_DECLINED) {
+            literal = 0;
+            continue;
+        }
+
+        literals[i].len = rc;
+    }
+
+    /* the automaton may have been loaded from the program cache file */
+
+    if (literal && rlcf->literal == NULL) {
+        rc = ngx_http_replace_literal_compile(cf->pool, literals, n,
+                                              flags[0] & SRE_REGEX_CASELESS,
+                                              &rlcf->literal);
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (!prefilter) {
+        return NGX_OK;
+    }
+
+    rlcf->restartable = 1;
+
+    for (j = 0; j < sizeof(first); j++) {
+        if (first[j] != 0xff) {
+            break;
+        }
+    }
+
+    if (j == sizeof(first)) {
+        /* every byte may start a match */
+        return NGX_OK;
+    }
+
+    rlcf->scan = ngx_palloc(cf->pool, sizeof(ngx_http_replace_scan_t));
+    if (rlcf->scan == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_replace_scan_init(rlcf->scan, first);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_replace_create_dfa(ngx_conf_t *cf, ngx_http_replace_loc_conf_t *rlcf)
+{
+    int                         *flags;
+    u_char                     **value;
+    ngx_int_t                    rc;
+    ngx_uint_t                   i, n;
+    ngx_http_replace_re_t      **res;
+
+    n = rlcf->regexes.nelts;
+    value = rlcf->regexes.elts;
+    flags = rlcf->multi_flags.elts;
+
+    res = ngx_palloc(cf->temp_pool, n * sizeof(ngx_http_replace_re_t *));
+    if (res == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* the DFA keeps referring to the byte sets of the parse trees */
+
+    for (i = 0; i < n; i++) {
+        res[i] = ngx_http_replace_regex_parse(cf->pool, value[i], flags[i]);
+    }
+
+    rc = ngx_http_replace_dfa_create(cf->pool, res, n,
+                                     NGX_HTTP_REPLACE_DFA_CACHE_SIZE,
+                                     &rlcf->dfa);
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (rc == NGX_DECLINED) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "replace_filter_engine dfa does not support "
+                           "regex \"%s\" or its siblings, using pike",
+                           value[0]);
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * Tracking the submatches of every thread makes the Pike VM several times
+ * slower. When no regex uses assertions, the stream is scanned with a copy
+ * of the program without captures, and the original program only runs
+ * over the bytes of the matches whose replacement needs $1, $2, etc. See
+ * ngx_http_replace_exec_captures().
+ */
+
+static ngx_int_t
+ngx_http_replace_compile_scanner(ngx_conf_t *cf,
+    ngx_http_replace_loc_conf_t *rlcf)
+{
+    u_char                         **value, **regexes;
+    sre_int_t                        err_offset, err_regex_id;
+    sre_uint_t                       ncaps;
+    ngx_uint_t                       i, n;
+    sre_pool_t                      *ppool;
+    sre_regex_t                     *re;
+    sre_program_t                   *prog;
+    ngx_http_replace_main_conf_t    *rmcf;
+
+    n = rlcf->regexes.nelts;
+    value = rlcf->regexes.elts;
+
+    for (i = 0; i < n; i++) {
+        if (rlcf->regex_info[i].assertions) {
+            /* "\b" or "$" may see past the end of the match */
+            return NGX_OK;
+        }
+    }
+
+    regexes = ngx_palloc(cf->temp_pool, n * sizeof(u_char *));
+    if (regexes == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < n; i++) {
+        regexes[i] = ngx_http_replace_regex_strip_captures(cf->temp_pool,
+                                                           value[i]);
+        if (regexes[i] == NULL) {
+            return NGX_ERROR;
+        }
+
+        dd("scanner regex: \"%s\"", regexes[i]);
+    }
+
+    ppool = sre_create_pool(1024);
+    if (ppool == NULL) {
+        return NGX_ERROR;
+    }
+
+    re = sre_regex_parse_multi(ppool, regexes, n, &ncaps,
+                               rlcf->multi_flags.elts, &err_offset,
+                               &err_regex_id);
+
+    if (re == NULL || ncaps != 0) {
+        /* should not happen, just keep capturing everywhere */
+        sre_destroy_pool(ppool);
+        return NGX_OK;
+    }
+
+    rmcf = ngx_http_conf_get_module_main_conf(cf,
+                                              ngx_http_replace_filter_module);
+
+    prog = sre_regex_compile(rmcf->compiler_pool, re);
+
+    sre_destroy_pool(ppool);
+
+    if (prog == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "failed to compile regex \"%s\" and its "
+                           "siblings", regexes[0]);
+        return NGX_ERROR;
+    }
+
+    rlcf->capture_program = rlcf->program;
+    rlcf->program = prog;
+    rlcf->vm_ovecsize = 2 * sizeof(sre_int_t);
+
+    return NGX_OK;
+}
+
+
+/*
+ * Rules without "g" keep running in the VM once exhausted, their matches
+ * being passed through unchanged. With a few of them, the program is
+ * compiled again for every subset of exhausted rules, and the VM switches
+ * to the one without them, see ngx_http_replace_vm_variant(). Once they are
+ * all exhausted, the global rules run as fast as in a location without the
+ * other rules.
+ */
+
+static ngx_int_t
+ngx_http_replace_compile_variants(ngx_conf_t *cf,
+    ngx_http_replace_loc_conf_t *rlcf)
+{
+    int                             *flags, *vflags;
+    u_char                         **value, **regexes, **stripped;
+    sre_int_t                        err_offset, err_regex_id, *ids;
+    sre_uint_t                       ncaps;
+    ngx_uint_t                       i, j, m, n, mask, *limit, nrules;
+    ngx_uint_t                       rules[NGX_HTTP_REPLACE_MAX_VARIANT_RULES];
+    sre_pool_t                      *ppool;
+    sre_regex_t                     *re;
+    sre_program_t                   *prog;
+    ngx_http_replace_program_t      *shared;
+    ngx_http_replace_variants_t     *v;
+    ngx_http_replace_main_conf_t    *rmcf;
+
+    n = rlcf->regexes.nelts;
+
+    rlcf->variants = NULL;
+
+    if (!rlcf->seen_limited
+        || n < 2
+        || !rlcf->restartable
+        || rlcf->literal
+        || (rlcf->ncaps > 0
+            && rlcf->capture_program == NULL
+            && rlcf->parse_buf == ngx_http_replace_capturing_parse))
+    {
+        /* the VM cannot be restarted with another program in between */
+        return NGX_OK;
+    }
+
+    limit = rlcf->multi_limit.elts;
+    nrules = 0;
+
+    for (i = 0; i < n; i++) {
+        if (limit[i] == 0) {
+            continue;
+        }
+
+        if (nrules == NGX_HTTP_REPLACE_MAX_VARIANT_RULES) {
+            /* too many programs, keep the pass-through alone */
+            return NGX_OK;
+        }
+
+        rules[nrules++] = i;
+    }
+
+    /* the programs only depend on the rule set and on the rules limited */
+
+    shared = rlcf->shared;
+
+    for (v = shared ? shared->variants : NULL; v; v = v->next) {
+        if (v->nrules == nrules
+            && ngx_memcmp(v->rules, rules, nrules * sizeof(ngx_uint_t)) == 0)
+        {
+            dd("reusing variants %p", v);
+
+            rlcf->variants = v;
+            return NGX_OK;
+        }
+    }
+
+    v = ngx_pcalloc(cf->pool, sizeof(ngx_http_replace_variants_t));
+    if (v == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->nrules = nrules;
+    ngx_memcpy(v->rules, rules, nrules * sizeof(ngx_uint_t));
+
+    value = rlcf->regexes.elts;
+    flags = rlcf->multi_flags.elts;
+
+    stripped = ngx_palloc(cf->temp_pool, 2 * n * sizeof(u_char *));
+    vflags = ngx_palloc(cf->temp_pool, n * sizeof(int));
+
+    if (stripped == NULL || vflags == NULL) {
+        return NGX_ERROR;
+    }
+
+    regexes = stripped + n;
+
+    for (i = 0; i < n; i++) {
+        stripped[i] = ngx_http_replace_regex_strip_captures(cf->temp_pool,
+                                                            value[i]);
+        if (stripped[i] == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    rmcf = ngx_http_conf_get_module_main_conf(cf,
                                               ngx_http_replace_filter_module);
 
+    for (mask = 1; mask < ((ngx_uint_t) 1 << v->nrules); mask++) {
+
+        ids = ngx_palloc(cf->pool, n * sizeof(sre_int_t));
+        if (ids == NULL) {
+            return NGX_ERROR;
+        }
+
+        m = 0;
+
+        for (i = 0; i < n; i++) {
+
+            for (j = 0; j < v->nrules; j++) {
+                if (v->rules[j] == i && (mask & (1 << j))) {
+                    break;
+                }
+            }
+
+            if (j < v->nrules) {
+                /* exhausted */
+                continue;
+            }
+
+            regexes[m] = stripped[i];
+            vflags[m] = flags[i];
+            ids[m] = i;
+            m++;
+        }
+
+        if (m == 0) {
+            /* every rule is exhausted, see ctx->once */
+            continue;
+        }
+
+        ppool = sre_create_pool(1024);
+        if (ppool == NULL) {
+            return NGX_ERROR;
+        }
+
+        re = sre_regex_parse_multi(ppool, regexes, m, &ncaps, vflags,
+                                   &err_offset, &err_regex_id);
+
+        if (re == NULL || ncaps != 0) {
+            /* should not happen, just keep the pass-through alone */
+            sre_destroy_pool(ppool);
+            return NGX_OK;
+        }
+
         prog = sre_regex_compile(rmcf->compiler_pool, re);
 
         sre_destroy_pool(ppool);
@@ -945,30 +2428,150 @@ ngx_http_replace_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
         if (prog == NULL) {
             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                                "failed to compile regex \"%s\" and its "
-                               "siblings", value[0]);
+                               "siblings", regexes[0]);
+            return NGX_ERROR;
+        }
 
-            return NGX_CONF_ERROR;
+        dd("variant %d: %d regexes", (int) mask, (int) m);
+
+        v->programs[mask] = prog;
+        v->ids[mask] = ids;
+    }
+
+    if (shared) {
+        v->next = shared->variants;
+        shared->variants = v;
+    }
+
+    rlcf->variants = v;
+
+    return NGX_OK;
+}
+
+
+/*
+ * The JIT-compiled Thompson program only tells whether a match ends in a
+ * buffer, so it can only gate the Pike VM when the VM may be restarted at
+ * an arbitrary offset and when every match is of a bounded length.
+ */
+
+static ngx_int_t
+ngx_http_replace_create_jit(ngx_conf_t *cf, ngx_http_replace_loc_conf_t *rlcf)
+{
+    u_char                         **value;
+    sre_int_t                        rc;
+    ngx_pool_cleanup_t              *cln;
+    sre_vm_thompson_code_t          *code;
+    ngx_http_replace_main_conf_t    *rmcf;
+
+    value = rlcf->regexes.elts;
+
+    if (!rlcf->restartable || rlcf->max_len == NGX_HTTP_REPLACE_UNBOUNDED) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "replace_filter_engine jit requires regexes of "
+                           "bounded length without assertions, but got "
+                           "\"%s\" or its siblings, using pike", value[0]);
+        return NGX_OK;
+    }
+
+    rmcf = ngx_http_conf_get_module_main_conf(cf,
+                                              ngx_http_replace_filter_module);
+
+    rc = sre_vm_thompson_jit_compile(rmcf->compiler_pool, rlcf->program,
+                                     &code);
+
+    if (rc == SRE_DECLINED) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "replace_filter_engine jit is not supported by "
+                           "sregex on this platform, using pike");
+        return NGX_OK;
+    }
+
+    if (rc != SRE_OK) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "failed to JIT compile regex \"%s\" and its "
+                           "siblings", value[0]);
+        return NGX_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        sre_vm_thompson_jit_free(code);
+        return NGX_ERROR;
+    }
+
+    cln->data = code;
+    cln->handler = ngx_http_replace_cleanup_jit;
+
+    rlcf->jit_code = code;
+    rlcf->jit_handler = sre_vm_thompson_jit_get_handler(code);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_replace_cleanup_jit(void *data)
+{
+    sre_vm_thompson_code_t  *code = data;
+
+    if (code) {
+        dd("free jit code %p", code);
+        sre_vm_thompson_jit_free(code);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_replace_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t  *var, *v;
+
+    for (v = ngx_http_replace_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
         }
 
-        conf->program = prog;
-        conf->ovecsize = 2 * (conf->ncaps + 1) * sizeof(sre_int_t);
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
 
-    } else {
+    return NGX_OK;
+}
 
-        conf->regexes       = prev->regexes;
-        conf->multi_once    = prev->multi_once;
-        conf->multi_flags   = prev->multi_flags;
-        conf->multi_replace = prev->multi_replace;
-        conf->parse_buf     = prev->parse_buf;
-        conf->verbatim      = prev->verbatim;
-        conf->program       = prev->program;
-        conf->ncaps         = prev->ncaps;
-        conf->ovecsize      = prev->ovecsize;
-        conf->seen_once     = prev->seen_once;
-        conf->seen_global   = prev->seen_global;
+
+/*
+ * $replace_filter_overflows: the number of times the pending data of the
+ * response exceeded replace_filter_max_buffered_size
+ */
+
+static ngx_int_t
+ngx_http_replace_overflows_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                  *p;
+    ngx_http_replace_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_replace_filter_module);
+
+    if (ctx == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
     }
 
-    return NGX_CONF_OK;
+    p = ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%ui", ctx->overflows) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
 }
 
 
@@ -976,11 +2579,24 @@ static ngx_int_t
 ngx_http_replace_filter_init(ngx_conf_t *cf)
 {
     int                              multi_http_blocks;
+    ngx_http_handler_pt             *h;
+    ngx_http_core_main_conf_t       *cmcf;
     ngx_http_replace_main_conf_t    *rmcf;
 
     rmcf =
         ngx_http_conf_get_module_main_conf(cf, ngx_http_replace_filter_module);
 
+    if (ngx_http_replace_program_cache_write(cf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (rmcf->programs_reused) {
+        ngx_log_error(NGX_LOG_NOTICE, cf->log, 0,
+                      "replace_filter: compiled %ui rule sets, reused them "
+                      "in %ui other places", rmcf->programs_compiled,
+                      rmcf->programs_reused);
+    }
+
     if (ngx_http_replace_prev_cycle != ngx_cycle) {
         ngx_http_replace_prev_cycle = ngx_cycle;
         multi_http_blocks = 0;
@@ -995,8 +2611,17 @@ ngx_http_replace_filter_init(ngx_conf_t *cf)
 
         ngx_http_next_body_filter = ngx_http_top_body_filter;
         ngx_http_top_body_filter = ngx_http_replace_body_filter;
+    }
 
-        return NGX_OK;
+    if (rmcf->static_files) {
+        cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+        h = ngx_array_push(&cmcf->phases[NGX_HTTP_CONTENT_PHASE].handlers);
+        if (h == NULL) {
+            return NGX_ERROR;
+        }
+
+        *h = ngx_http_replace_static_handler;
     }
 
     return NGX_OK;
@@ -1015,7 +2640,14 @@ ngx_http_replace_create_main_conf(ngx_conf_t *cf)
 
     /* set by ngx_pcalloc:
      *      rmcf->compiler_pool = NULL;
+     *      rmcf->programs_used = NULL;
+     *      rmcf->programs_compiled = 0;
+     *      rmcf->programs_reused = 0;
+     *      rmcf->program_cache = { 0, NULL };
      */
 
+    ngx_rbtree_init(&rmcf->programs, &rmcf->programs_sentinel,
+                    ngx_str_rbtree_insert_value);
+
     return rmcf;
 }
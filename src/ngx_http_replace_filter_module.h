@@ -3,6 +3,10 @@
 
 
 #include "ngx_http_replace_script.h"
+#include "ngx_http_replace_regex.h"
+#include "ngx_http_replace_scan.h"
+#include "ngx_http_replace_literal.h"
+#include "ngx_http_replace_dfa.h"
 #include <ngx_core.h>
 #include <ngx_http.h>
 #include <nginx.h>
@@ -12,12 +16,55 @@
 extern ngx_module_t  ngx_http_replace_filter_module;
 
 
+#define NGX_HTTP_REPLACE_CLEAR_LAST_MODIFIED    0
+#define NGX_HTTP_REPLACE_KEEP_LAST_MODIFIED     1
+
+#define NGX_HTTP_REPLACE_OVERFLOW_STOP          0
+#define NGX_HTTP_REPLACE_OVERFLOW_RESTART       1
+
+
+typedef struct ngx_http_replace_backend_s  ngx_http_replace_backend_t;
+typedef struct ngx_http_replace_program_s  ngx_http_replace_program_t;
+typedef struct ngx_http_replace_vm_cache_s  ngx_http_replace_vm_cache_t;
+typedef struct ngx_http_replace_inflate_s  ngx_http_replace_inflate_t;
+typedef struct ngx_http_replace_cache_ctx_s  ngx_http_replace_cache_ctx_t;
+typedef struct ngx_http_replace_static_s  ngx_http_replace_static_t;
+typedef struct ngx_http_replace_thread_s  ngx_http_replace_thread_t;
+
+
+/* a block of memory for the pending data of a request */
+
+typedef struct ngx_http_replace_segment_s  ngx_http_replace_segment_t;
+
+struct ngx_http_replace_segment_s {
+    ngx_http_replace_segment_t    *next;
+
+    u_char                        *start;
+    u_char                        *last;
+    u_char                        *end;
+};
+
+
 typedef struct {
     sre_int_t                  regex_id;
     sre_int_t                  stream_pos;
+    sre_int_t                  vm_offset; /* stream offset the VM
+                                             was (re)started at */
+    sre_int_t                  pending_matched[2];
     sre_int_t                 *ovector;
     sre_pool_t                *vm_pool;
     sre_vm_pike_ctx_t         *vm_ctx;
+    sre_pool_t                *jit_pool;  /* for the Thompson JIT gate */
+    sre_pool_t                *capture_pool;
+
+    sre_program_t             *program;  /* the variant in use, if any */
+    sre_program_t             *vm_program;  /* private copy of the
+                                               program, if any */
+    sre_int_t                 *ids;  /* of its regexes */
+
+    void                      *backend_ctx;  /* of the other backends */
+
+    ngx_http_replace_literal_ctx_t  literal;
 
     ngx_chain_t               *pending; /* pending data before the
                                            pending matched capture */
@@ -27,8 +74,22 @@ typedef struct {
                                             matched capture */
     ngx_chain_t              **last_pending2;
 
+    ngx_http_replace_segment_t    *segments;  /* the one in use first */
+
     ngx_buf_t                 *buf;
 
+    ngx_buf_t                 *part;  /* the window or the slice */
+    ngx_buf_t                 *part_buf;  /* matched in parts */
+    off_t                      part_offset;  /* of the current part */
+    ngx_buf_t                 *window;  /* replace_filter_sendfile */
+    ngx_buf_t                 *slice;  /* replace_filter_slice */
+    ngx_event_t               *resume;
+    ngx_http_replace_inflate_t    *inflate;  /* of the compressed
+                                                 response body */
+    ngx_http_replace_cache_ctx_t  *cache;  /* replace_filter_cache */
+    ngx_http_replace_static_t     *sidecar;  /* replace_filter_static */
+    ngx_http_replace_thread_t     *thread;  /* replace_filter_thread_pool */
+
     ngx_str_t                 *sub;
 
     u_char                    *pos;
@@ -45,15 +106,25 @@ typedef struct {
     ngx_chain_t               *rematch;
     ngx_chain_t               *captured;
     ngx_chain_t              **last_captured;
-    uint8_t                   *disabled;
-    sre_uint_t                 disabled_count;
+    sre_int_t                  scan_end;  /* the stream offset the rules
+                                             stop at, if known */
+    sre_int_t                  stop_scanned;  /* for the stop_at string */
+    ngx_uint_t                 stop_state;
+
+    ngx_uint_t                *counts;  /* of the replacements per rule */
+    ngx_uint_t                 replacements;
+    sre_uint_t                 disabled_count;  /* of the exhausted rules */
 
     size_t                     total_buffered;
+    ngx_uint_t                 overflows;  /* of the pending data */
 
+    unsigned                   ready:1;  /* the matching state is set up */
     unsigned                   once:1;
     unsigned                   vm_done:1;
     unsigned                   special_buf:1;
     unsigned                   last_buf:1;
+    unsigned                   vm_idle:1;
+    unsigned                   vm_reset:1;
 } ngx_http_replace_ctx_t;
 
 
@@ -63,25 +134,125 @@ typedef ngx_int_t (*ngx_http_replace_parse_buf_pt)(ngx_http_request_t *r,
 
 typedef struct {
     sre_pool_t              *compiler_pool;
+
+    ngx_rbtree_t             programs;  /* of ngx_http_replace_program_t */
+    ngx_rbtree_node_t        programs_sentinel;
+    ngx_http_replace_program_t  *programs_used;  /* by this configuration */
+    ngx_uint_t               programs_compiled;
+    ngx_uint_t               programs_reused;
+
+    ngx_http_replace_vm_cache_t  *vm_caches;  /* of all the locations */
+
+    ngx_str_t                program_cache;  /* replace_filter_program_cache */
+
+    unsigned                 program_cache_loaded:1;
+    unsigned                 static_files:1;  /* used anywhere */
 } ngx_http_replace_main_conf_t;
 
 
+#define NGX_HTTP_REPLACE_MAX_VARIANT_RULES  4
+#define NGX_HTTP_REPLACE_MAX_VARIANTS                                        \
+    (1 << NGX_HTTP_REPLACE_MAX_VARIANT_RULES)
+
+
+/*
+ * The programs of a location with rules without "g", without the ones
+ * already exhausted. Bit i of the index stands for the rule rules[i].
+ * Shared by the locations with the same program and the same rules
+ * without "g", see ngx_http_replace_program_t.
+ */
+
+typedef struct ngx_http_replace_variants_s  ngx_http_replace_variants_t;
+
+struct ngx_http_replace_variants_s {
+    ngx_http_replace_variants_t   *next;
+
+    ngx_uint_t                 nrules;
+    ngx_uint_t                 rules[NGX_HTTP_REPLACE_MAX_VARIANT_RULES];
+
+    sre_program_t             *programs[NGX_HTTP_REPLACE_MAX_VARIANTS];
+    sre_int_t                 *ids[NGX_HTTP_REPLACE_MAX_VARIANTS];
+                                   /* the original regex ids */
+};
+
+
 typedef struct {
     sre_uint_t                 ncaps;
     size_t                     ovecsize;
+    size_t                     vm_ovecsize;  /* for the program below */
 
-    ngx_array_t                multi_once;  /* of uint8_t */
+    ngx_array_t                multi_limit;  /* of ngx_uint_t, the number
+                                                of replacements per rule,
+                                                0 with "g" */
     ngx_array_t                regexes;  /* of u_char* */
     ngx_array_t                multi_flags;  /* of int */
     ngx_array_t                multi_replace;
                                      /* of ngx_http_replace_complex_value_t */
 
     sre_program_t             *program;
+    sre_program_t             *capture_program;  /* run on the matched
+                                                    bytes only, when
+                                                    the program above
+                                                    has no captures */
+
+    ngx_http_replace_regex_info_t  *regex_info;  /* per regex */
+    ngx_http_replace_scan_t        *scan;  /* first-byte prefilter */
+    ngx_http_replace_literal_t     *literal;  /* replaces the program
+                                                 when all the regexes
+                                                 are plain strings */
+    ngx_http_replace_dfa_t         *dfa;
+    ngx_http_replace_variants_t    *variants;
+
+    sre_vm_thompson_code_t         *jit_code;
+    sre_vm_thompson_exec_pt         jit_handler;
+
+    ngx_int_t                  max_len;  /* of any match, or
+                                            NGX_HTTP_REPLACE_UNBOUNDED */
+
+    ngx_uint_t                 engine;  /* replace_filter_engine */
+    ngx_flag_t                 lazy_compile;
+
+    ngx_uint_t                 vm_cache_size;  /* replace_filter_vm_cache */
+    ngx_http_replace_vm_cache_t    *vm_cache;
+
+    ngx_http_replace_backend_t    *backend;
+    void                          *backend_conf;  /* of the other
+                                                     backends */
+
+    ngx_http_replace_program_t    *shared;  /* the program cache entry
+                                               of the rule set */
 
     ngx_hash_t                 types;
     ngx_array_t               *types_keys;
 
     size_t                     max_buffered_size;
+    ngx_uint_t                 overflow;  /* replace_filter_overflow */
+    ngx_uint_t                 max_replacements;
+                                    /* replace_filter_max_replacements */
+    size_t                     scan_limit;  /* replace_filter_scan_limit */
+    ngx_str_t                  stop_at;  /* replace_filter_stop_at */
+    ngx_uint_t                *stop_at_next;
+
+    ngx_flag_t                 sendfile;  /* replace_filter_sendfile */
+    size_t                     sendfile_window;
+    size_t                     slice;  /* replace_filter_slice */
+
+    ngx_flag_t                 decompress;  /* replace_filter_decompress */
+    ngx_bufs_t                 decompress_bufs;
+
+    ngx_shm_zone_t            *cache_zone;  /* replace_filter_cache */
+    ngx_http_complex_value_t  *cache_key;
+    size_t                     cache_max_size;
+
+    ngx_flag_t                 static_files;  /* replace_filter_static */
+    ngx_path_t                *static_path;
+
+    uint64_t                   rules_hash;  /* for the caches above */
+
+#if (NGX_THREADS)
+    ngx_thread_pool_t         *thread_pool;  /* replace_filter_thread_pool */
+    size_t                     thread_threshold;
+#endif
 
     ngx_uint_t                 last_modified;
                                     /* replace_filter_last_modified */
@@ -91,9 +262,13 @@ typedef struct {
 
     ngx_http_complex_value_t  *skip;
 
-    unsigned                   seen_once;  /* :1 */
+    unsigned                   seen_limited;  /* :1 */
     unsigned                   seen_global;  /* :1 */
+    unsigned                   restartable;  /* :1 */
 } ngx_http_replace_loc_conf_t;
 
 
+void ngx_http_replace_resume_handler(ngx_event_t *ev);
+
+
 #endif /* _NGX_HTTP_REPLACE_FILTER_MODULE_H_INCLUDED_ */
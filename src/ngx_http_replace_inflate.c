@@ -0,0 +1,386 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef DDEBUG
+#define DDEBUG 0
+#endif
+#include "ddebug.h"
+
+
+#include "ngx_http_replace_inflate.h"
+
+
+static ngx_int_t ngx_http_replace_inflate_start(
+    ngx_http_replace_inflate_t *iz);
+static ngx_chain_t *ngx_http_replace_inflate_get_window(
+    ngx_http_replace_inflate_t *iz);
+static ngx_int_t ngx_http_replace_inflate_emit(ngx_http_replace_inflate_t *iz,
+    ngx_chain_t *wcl, ngx_chain_t ***last);
+static void *ngx_http_replace_inflate_alloc(void *opaque, u_int items,
+    u_int size);
+static void ngx_http_replace_inflate_free(void *opaque, void *address);
+
+
+ngx_int_t
+ngx_http_replace_inflate_encoding(ngx_str_t *value)
+{
+    if (value->len == sizeof("gzip") - 1
+        && ngx_strncasecmp(value->data, (u_char *) "gzip", value->len) == 0)
+    {
+        return NGX_HTTP_REPLACE_GZIP;
+    }
+
+    if (value->len == sizeof("deflate") - 1
+        && ngx_strncasecmp(value->data, (u_char *) "deflate", value->len)
+           == 0)
+    {
+        return NGX_HTTP_REPLACE_DEFLATE;
+    }
+
+    return NGX_DECLINED;
+}
+
+
+ngx_int_t
+ngx_http_replace_inflate_create(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, ngx_uint_t encoding)
+{
+    ngx_http_replace_inflate_t    *iz;
+    ngx_http_replace_loc_conf_t   *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_replace_filter_module);
+
+    iz = ngx_pcalloc(r->pool, sizeof(ngx_http_replace_inflate_t));
+    if (iz == NULL) {
+        return NGX_ERROR;
+    }
+
+    iz->bufs = rlcf->decompress_bufs;
+    iz->request = r;
+    iz->encoding = encoding;
+
+    ctx->inflate = iz;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Inflates as much of the compressed data received so far as the free
+ * windows can take, and returns the windows filled in "out". The data
+ * left stays in ctx->inflate->in until a window is sent.
+ */
+
+ngx_int_t
+ngx_http_replace_inflate(ngx_http_request_t *r, ngx_http_replace_ctx_t *ctx,
+    ngx_chain_t *in, ngx_chain_t **out)
+{
+    int                          rc;
+    ngx_buf_t                   *b, *w;
+    ngx_chain_t                 *wcl, **ll;
+    ngx_http_replace_inflate_t  *iz;
+
+    iz = ctx->inflate;
+
+    *out = NULL;
+    ll = out;
+
+    if (in) {
+        if (ngx_chain_add_copy(r->pool, &iz->in, in) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (!iz->started && iz->in) {
+        if (ngx_http_replace_inflate_start(iz) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    wcl = NULL;
+
+    while (iz->in) {
+        b = iz->in->buf;
+
+        if (b->pos < b->last && iz->done) {
+
+            if (iz->encoding != NGX_HTTP_REPLACE_GZIP) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                              "replace filter: %uz bytes after the end of "
+                              "the compressed data",
+                              (size_t) (b->last - b->pos));
+                return NGX_ERROR;
+            }
+
+            /* the next member of a multi-member gzip body, see RFC 1952 */
+
+            rc = inflateReset(&iz->zstream);
+
+            if (rc != Z_OK) {
+                ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                              "replace filter: inflateReset() failed: %d",
+                              rc);
+                return NGX_ERROR;
+            }
+
+            iz->done = 0;
+        }
+
+        if (b->pos < b->last) {
+
+            if (wcl == NULL) {
+                if (!ngx_http_replace_inflate_window_free(ctx)) {
+                    break;
+                }
+
+                wcl = ngx_http_replace_inflate_get_window(iz);
+                if (wcl == NULL) {
+                    return NGX_ERROR;
+                }
+            }
+
+            w = wcl->buf;
+
+            iz->zstream.next_in = b->pos;
+            iz->zstream.avail_in = b->last - b->pos;
+            iz->zstream.next_out = w->last;
+            iz->zstream.avail_out = w->end - w->last;
+
+            rc = inflate(&iz->zstream, Z_NO_FLUSH);
+
+            dd("inflate: %d, in: %d, out: %d", rc,
+               (int) iz->zstream.avail_in, (int) iz->zstream.avail_out);
+
+            if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                              "replace filter: inflate() failed: %d", rc);
+                return NGX_ERROR;
+            }
+
+            b->pos = iz->zstream.next_in;
+            w->last = iz->zstream.next_out;
+
+            if (rc == Z_STREAM_END) {
+                /* the state is kept for the next gzip member, if any */
+                iz->done = 1;
+                continue;
+            }
+
+            if (w->last == w->end) {
+                if (ngx_http_replace_inflate_emit(iz, wcl, &ll) != NGX_OK) {
+                    return NGX_ERROR;
+                }
+
+                wcl = NULL;
+                continue;
+            }
+
+            if (b->pos < b->last) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                              "replace filter: inflate() made no progress: "
+                              "%d", rc);
+                return NGX_ERROR;
+            }
+        }
+
+        /* b is consumed */
+
+        iz->in = iz->in->next;
+
+        if (b->last_buf && !iz->done && iz->zstream.total_in) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "replace filter: truncated compressed data");
+            return NGX_ERROR;
+        }
+
+        if (!b->last_buf && !b->last_in_chain && !b->flush) {
+            continue;
+        }
+
+        if (wcl == NULL) {
+            wcl = ngx_alloc_chain_link(r->pool);
+            if (wcl == NULL) {
+                return NGX_ERROR;
+            }
+
+            wcl->buf = ngx_calloc_buf(r->pool);
+            if (wcl->buf == NULL) {
+                return NGX_ERROR;
+            }
+
+            wcl->next = NULL;
+
+            wcl->buf->last_buf = b->last_buf;
+            wcl->buf->last_in_chain = b->last_in_chain;
+            wcl->buf->flush = b->flush;
+
+            *ll = wcl;
+            ll = &wcl->next;
+
+            wcl = NULL;
+            continue;
+        }
+
+        wcl->buf->last_buf = b->last_buf;
+        wcl->buf->last_in_chain = b->last_in_chain;
+        wcl->buf->flush = b->flush;
+
+        if (ngx_http_replace_inflate_emit(iz, wcl, &ll) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        wcl = NULL;
+    }
+
+    if (wcl) {
+        if (wcl->buf->last > wcl->buf->pos) {
+            if (ngx_http_replace_inflate_emit(iz, wcl, &ll) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+        } else {
+            wcl->next = iz->free;
+            iz->free = wcl;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+/* recycles the windows sent, and tells if one can be used */
+
+ngx_uint_t
+ngx_http_replace_inflate_window_free(ngx_http_replace_ctx_t *ctx)
+{
+    ngx_buf_t                   *w;
+    ngx_chain_t                 *cl, **ll;
+    ngx_http_replace_inflate_t  *iz;
+
+    iz = ctx->inflate;
+
+    ll = &iz->busy;
+
+    while (*ll) {
+        cl = *ll;
+        w = cl->buf;
+
+        if (w->pos < w->last) {
+            ll = &cl->next;
+            continue;
+        }
+
+        w->pos = w->start;
+        w->last = w->start;
+        w->flush = 0;
+        w->last_buf = 0;
+        w->last_in_chain = 0;
+
+        *ll = cl->next;
+
+        cl->next = iz->free;
+        iz->free = cl;
+    }
+
+    return iz->free != NULL || iz->nwindows < iz->bufs.num;
+}
+
+
+static ngx_int_t
+ngx_http_replace_inflate_start(ngx_http_replace_inflate_t *iz)
+{
+    int          rc;
+
+    iz->zstream.zalloc = ngx_http_replace_inflate_alloc;
+    iz->zstream.zfree = ngx_http_replace_inflate_free;
+    iz->zstream.opaque = iz;
+
+    /* a zlib stream for "deflate", see RFC 9110 */
+
+    rc = inflateInit2(&iz->zstream, iz->encoding == NGX_HTTP_REPLACE_GZIP
+                                    ? MAX_WBITS + 16 : MAX_WBITS);
+
+    if (rc != Z_OK) {
+        ngx_log_error(NGX_LOG_ALERT, iz->request->connection->log, 0,
+                      "replace filter: inflateInit2() failed: %d", rc);
+        return NGX_ERROR;
+    }
+
+    iz->started = 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_chain_t *
+ngx_http_replace_inflate_get_window(ngx_http_replace_inflate_t *iz)
+{
+    ngx_chain_t         *cl;
+
+    if (iz->free) {
+        cl = iz->free;
+        iz->free = cl->next;
+        cl->next = NULL;
+        return cl;
+    }
+
+    cl = ngx_alloc_chain_link(iz->request->pool);
+    if (cl == NULL) {
+        return NULL;
+    }
+
+    cl->buf = ngx_create_temp_buf(iz->request->pool, iz->bufs.size);
+    if (cl->buf == NULL) {
+        return NULL;
+    }
+
+    cl->buf->tag = (ngx_buf_tag_t) &ngx_http_replace_filter_module;
+    cl->next = NULL;
+
+    iz->nwindows++;
+
+    return cl;
+}
+
+
+static ngx_int_t
+ngx_http_replace_inflate_emit(ngx_http_replace_inflate_t *iz,
+    ngx_chain_t *wcl, ngx_chain_t ***last)
+{
+    ngx_chain_t         *cl;
+
+    cl = ngx_alloc_chain_link(iz->request->pool);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    cl->buf = wcl->buf;
+    cl->next = NULL;
+
+    **last = cl;
+    *last = &cl->next;
+
+    wcl->next = iz->busy;
+    iz->busy = wcl;
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_replace_inflate_alloc(void *opaque, u_int items, u_int size)
+{
+    ngx_http_replace_inflate_t  *iz = opaque;
+
+    return ngx_palloc(iz->request->pool, items * size);
+}
+
+
+static void
+ngx_http_replace_inflate_free(void *opaque, void *address)
+{
+    /* the memory is released with the request pool */
+}
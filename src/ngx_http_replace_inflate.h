@@ -0,0 +1,52 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef _NGX_HTTP_REPLACE_INFLATE_H_INCLUDED_
+#define _NGX_HTTP_REPLACE_INFLATE_H_INCLUDED_
+
+
+#include "ngx_http_replace_filter_module.h"
+#include <zlib.h>
+
+
+#define NGX_HTTP_REPLACE_GZIP     1
+#define NGX_HTTP_REPLACE_DEFLATE  2
+
+
+/*
+ * The decompression state of a response with replace_filter_decompress on.
+ * The compressed data is inflated into up to bufs.num windows of bufs.size
+ * bytes, which are handed to the matching as the response body and reused
+ * once they are sent.
+ */
+
+struct ngx_http_replace_inflate_s {
+    z_stream                    zstream;
+
+    ngx_chain_t                *in;  /* compressed data not inflated yet */
+    ngx_chain_t                *busy;  /* windows being matched or sent */
+    ngx_chain_t                *free;
+    ngx_int_t                   nwindows;  /* allocated */
+    ngx_bufs_t                  bufs;
+
+    ngx_http_request_t         *request;
+
+    unsigned                    encoding:2;
+    unsigned                    started:1;
+    unsigned                    done:1;  /* Z_STREAM_END of the last
+                                            member so far */
+};
+
+
+ngx_int_t ngx_http_replace_inflate_encoding(ngx_str_t *value);
+ngx_int_t ngx_http_replace_inflate_create(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, ngx_uint_t encoding);
+ngx_int_t ngx_http_replace_inflate(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, ngx_chain_t *in, ngx_chain_t **out);
+ngx_uint_t ngx_http_replace_inflate_window_free(ngx_http_replace_ctx_t *ctx);
+
+
+#endif /* _NGX_HTTP_REPLACE_INFLATE_H_INCLUDED_ */
@@ -0,0 +1,324 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef DDEBUG
+#define DDEBUG 0
+#endif
+#include "ddebug.h"
+
+
+#include "ngx_http_replace_literal.h"
+
+
+/*
+ * A streaming Aho-Corasick automaton for rule sets made of plain strings
+ * only. It reproduces the leftmost-first semantics of sregex's Pike VM
+ * (the earliest starting match wins, then the rule declared first), and
+ * it follows the same ctx->ovector and pending_matched conventions, so
+ * the parsers cannot tell it from the VM.
+ */
+
+
+/* keep the dense transition table within 16MB */
+#define NGX_HTTP_REPLACE_LITERAL_MAX_TABLE  (4 * 1024 * 1024)
+
+
+static ngx_uint_t ngx_http_replace_literal_final(
+    ngx_http_replace_literal_t *lit, ngx_http_replace_literal_ctx_t *lctx,
+    uint32_t state, sre_int_t pos);
+
+
+ngx_int_t
+ngx_http_replace_literal_compile(ngx_pool_t *pool, ngx_str_t *literals,
+    ngx_uint_t n, unsigned caseless, ngx_http_replace_literal_t **out)
+{
+    u_char                              *p, c;
+    uint32_t                            *next, *queue, s, t, f;
+    ngx_uint_t                           i, j, k, nclasses, size, head, tail;
+    ngx_http_replace_literal_t          *lit;
+    ngx_http_replace_literal_state_t    *states;
+
+    lit = ngx_pcalloc(pool, sizeof(ngx_http_replace_literal_t));
+    if (lit == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* byte classes: one per distinct byte in the literals, 0 for the rest */
+
+    nclasses = 1;
+    size = 1;
+
+    for (i = 0; i < n; i++) {
+        p = literals[i].data;
+
+        for (j = 0; j < literals[i].len; j++) {
+            if (lit->classes[p[j]] == 0) {
+                lit->classes[p[j]] = (u_char) nclasses++;
+            }
+        }
+
+        size += literals[i].len;
+    }
+
+    if (caseless) {
+        for (c = 'A'; c <= 'Z'; c++) {
+            lit->classes[c] = lit->classes[c | 0x20];
+        }
+    }
+
+    if (nclasses > 256 || size * nclasses > NGX_HTTP_REPLACE_LITERAL_MAX_TABLE)
+    {
+        return NGX_DECLINED;
+    }
+
+    next = ngx_pcalloc(pool, size * nclasses * sizeof(uint32_t));
+    if (next == NULL) {
+        return NGX_ERROR;
+    }
+
+    states = ngx_palloc(pool, size * sizeof(ngx_http_replace_literal_state_t));
+    if (states == NULL) {
+        return NGX_ERROR;
+    }
+
+    queue = ngx_palloc(pool, size * sizeof(uint32_t));
+    if (queue == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (s = 0; s < size; s++) {
+        states[s].fail = 0;
+        states[s].depth = 0;
+        states[s].out_len = 0;
+        states[s].out_id = NGX_HTTP_REPLACE_LITERAL_NONE;
+        states[s].below = NGX_HTTP_REPLACE_LITERAL_NONE;
+    }
+
+    /* the trie */
+
+    lit->nstates = 1;
+
+    for (i = 0; i < n; i++) {
+        p = literals[i].data;
+        s = 0;
+
+        for (j = 0; j < literals[i].len; j++) {
+
+            if (states[s].below == NGX_HTTP_REPLACE_LITERAL_NONE) {
+                states[s].below = (uint32_t) i;
+            }
+
+            k = s * nclasses + lit->classes[p[j]];
+
+            if (next[k] == 0) {
+                t = (uint32_t) lit->nstates++;
+
+                next[k] = t;
+                states[t].depth = states[s].depth + 1;
+            }
+
+            s = next[k];
+        }
+
+        /* the same string declared again can never win */
+
+        if (states[s].out_id == NGX_HTTP_REPLACE_LITERAL_NONE) {
+            states[s].out_len = (uint32_t) literals[i].len;
+            states[s].out_id = (uint32_t) i;
+        }
+    }
+
+    /*
+     * failure links and the complete transition function, in breadth
+     * first order
+     */
+
+    head = 0;
+    tail = 0;
+
+    for (k = 0; k < nclasses; k++) {
+        t = next[k];
+
+        if (t) {
+            queue[tail++] = t;
+        }
+    }
+
+    while (head < tail) {
+        s = queue[head++];
+        f = states[s].fail;
+
+        if (states[s].out_len == 0) {
+            states[s].out_len = states[f].out_len;
+            states[s].out_id = states[f].out_id;
+        }
+
+        for (k = 0; k < nclasses; k++) {
+            t = next[s * nclasses + k];
+
+            if (t) {
+                states[t].fail = next[f * nclasses + k];
+                queue[tail++] = t;
+
+            } else {
+                next[s * nclasses + k] = next[f * nclasses + k];
+            }
+        }
+    }
+
+    ngx_pfree(pool, queue);
+
+    lit->next = next;
+    lit->states = states;
+    lit->nclasses = nclasses;
+
+    dd("literal automaton: %d states, %d classes", (int) lit->nstates,
+       (int) nclasses);
+
+    *out = lit;
+
+    return NGX_OK;
+}
+
+
+sre_int_t
+ngx_http_replace_literal_exec(ngx_http_replace_literal_t *lit,
+    ngx_http_replace_literal_ctx_t *lctx, ngx_http_replace_scan_t *scan,
+    u_char *input, size_t size, sre_int_t offset, unsigned eof,
+    sre_int_t *ovector, sre_int_t **pending_matched)
+{
+    u_char                              *p, *last;
+    uint32_t                             state, t;
+    sre_int_t                            start, end, from;
+    ngx_http_replace_literal_state_t    *st;
+
+    p = input;
+    last = input + size;
+    state = lctx->state;
+
+    while (p < last) {
+
+        if (state == 0 && !lctx->matched && scan) {
+            p = ngx_http_replace_scan(scan, p, last);
+            if (p == last) {
+                break;
+            }
+        }
+
+        state = lit->next[state * lit->nclasses + lit->classes[*p++]];
+        st = &lit->states[state];
+
+        if (st->out_len == 0 && !lctx->matched) {
+            continue;
+        }
+
+        end = offset + (p - input);
+
+        if (st->out_len) {
+            start = end - st->out_len;
+
+            if (!lctx->matched
+                || start < lctx->match[0]
+                || (start == lctx->match[0] && st->out_id < lctx->id))
+            {
+                lctx->match[0] = start;
+                lctx->match[1] = end;
+                lctx->id = st->out_id;
+                lctx->matched = 1;
+
+                dd("literal candidate %d: (%ld, %ld)", (int) lctx->id,
+                   (long) start, (long) end);
+            }
+        }
+
+        if (ngx_http_replace_literal_final(lit, lctx, state, end)) {
+            goto matched;
+        }
+    }
+
+    if (eof) {
+        if (lctx->matched) {
+            goto matched;
+        }
+
+        lctx->state = 0;
+        return SRE_DECLINED;
+    }
+
+    lctx->state = state;
+
+    /* find the earliest thread that can still produce a match */
+
+    end = offset + size;
+    from = -1;
+
+    for (t = state; t; t = lit->states[t].fail) {
+        if (lit->states[t].below != NGX_HTTP_REPLACE_LITERAL_NONE) {
+            from = end - lit->states[t].depth;
+            break;
+        }
+    }
+
+    if (lctx->matched && (from == -1 || lctx->match[0] < from)) {
+        from = lctx->match[0];
+    }
+
+    ovector[0] = from;
+    ovector[1] = (from == -1) ? -1 : end;
+
+    if (pending_matched) {
+        *pending_matched = lctx->matched ? lctx->match : NULL;
+    }
+
+    return SRE_AGAIN;
+
+matched:
+
+    ovector[0] = lctx->match[0];
+    ovector[1] = lctx->match[1];
+
+    lctx->state = 0;
+    lctx->matched = 0;
+
+    return (sre_int_t) lctx->id;
+}
+
+
+/*
+ * The pending match is final when no live thread can still complete a
+ * match that starts earlier, or at the same offset for a rule declared
+ * earlier.
+ */
+
+static ngx_uint_t
+ngx_http_replace_literal_final(ngx_http_replace_literal_t *lit,
+    ngx_http_replace_literal_ctx_t *lctx, uint32_t state, sre_int_t pos)
+{
+    uint32_t                             t;
+    sre_int_t                            start;
+    ngx_http_replace_literal_state_t    *st;
+
+    for (t = state; t; t = st->fail) {
+        st = &lit->states[t];
+        start = pos - st->depth;
+
+        if (start > lctx->match[0]) {
+            break;
+        }
+
+        if (start < lctx->match[0]) {
+            if (st->below != NGX_HTTP_REPLACE_LITERAL_NONE) {
+                return 0;
+            }
+
+            continue;
+        }
+
+        return st->below >= lctx->id;
+    }
+
+    return 1;
+}
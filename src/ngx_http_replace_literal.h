@@ -0,0 +1,75 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef _NGX_HTTP_REPLACE_LITERAL_H_INCLUDED_
+#define _NGX_HTTP_REPLACE_LITERAL_H_INCLUDED_
+
+
+#include <nginx.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <sregex/sregex.h>
+
+
+#include "ngx_http_replace_scan.h"
+
+
+#define NGX_HTTP_REPLACE_LITERAL_NONE  ((uint32_t) -1)
+
+/*
+ * The version of the automata saved to the program cache file: bump it
+ * whenever the meaning of their tables changes
+ */
+#define NGX_HTTP_REPLACE_LITERAL_VERSION  1
+
+
+typedef struct {
+    uint32_t                    fail;
+    uint32_t                    depth;
+
+    uint32_t                    out_len;  /* the longest literal that is a
+                                             suffix of this state, 0 if
+                                             none */
+    uint32_t                    out_id;
+
+    uint32_t                    below;  /* the smallest id of the literals
+                                           that can still be completed
+                                           from this state */
+} ngx_http_replace_literal_state_t;
+
+
+typedef struct {
+    ngx_uint_t                  nclasses;
+    ngx_uint_t                  nstates;
+
+    u_char                      classes[256];
+
+    uint32_t                   *next;  /* nstates * nclasses */
+    ngx_http_replace_literal_state_t   *states;
+} ngx_http_replace_literal_t;
+
+
+/* the per-request matching state */
+
+typedef struct {
+    uint32_t                    state;
+    uint32_t                    id;  /* of the pending match */
+    sre_int_t                   match[2];  /* the pending match, if any */
+
+    unsigned                    matched:1;
+} ngx_http_replace_literal_ctx_t;
+
+
+ngx_int_t ngx_http_replace_literal_compile(ngx_pool_t *pool,
+    ngx_str_t *literals, ngx_uint_t n, unsigned caseless,
+    ngx_http_replace_literal_t **out);
+sre_int_t ngx_http_replace_literal_exec(ngx_http_replace_literal_t *lit,
+    ngx_http_replace_literal_ctx_t *lctx, ngx_http_replace_scan_t *scan,
+    u_char *input, size_t size, sre_int_t offset, unsigned eof,
+    sre_int_t *ovector, sre_int_t **pending_matched);
+
+
+#endif /* _NGX_HTTP_REPLACE_LITERAL_H_INCLUDED_ */
@@ -13,9 +13,16 @@
 
 
 #include "ngx_http_replace_parse.h"
+#include "ngx_http_replace_engine.h"
 #include "ngx_http_replace_util.h"
 
 
+static ngx_int_t ngx_http_replace_capture_match(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, ngx_chain_t *rematch);
+static sre_int_t ngx_http_replace_bound_from(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, sre_int_t from, sre_int_t to);
+static ngx_int_t ngx_http_replace_overflow(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, sre_int_t offset);
 static void ngx_http_replace_check_total_buffered(ngx_http_request_t *r,
     ngx_http_replace_ctx_t *ctx, sre_int_t len, sre_int_t mlen);
 
@@ -26,9 +33,8 @@ ngx_http_replace_capturing_parse(ngx_http_request_t *r,
 {
     sre_int_t              ret, from, to;
     ngx_int_t              rc;
-    ngx_chain_t           *new_rematch = NULL;
     ngx_chain_t           *cl;
-    ngx_chain_t          **last_rematch, **last;
+    ngx_chain_t          **last;
     size_t                 len;
 
     dd("replace capturing parse");
@@ -51,148 +57,20 @@ ngx_http_replace_capturing_parse(ngx_http_request_t *r,
        ctx->special_buf, ctx->last_buf,
        (int) (ctx->buf->last - ctx->pos), ctx->pos);
 
-    ret = sre_vm_pike_exec(ctx->vm_ctx, ctx->pos, len, ctx->last_buf, NULL);
+    ret = ngx_http_replace_exec(r, ctx, ctx->pos, len, ctx->last_buf, NULL);
 
     dd("vm pike exec: %d", (int) ret);
 
+    if (ret == NGX_HTTP_REPLACE_EXEC_POSTED) {
+        /* retried once the thread pool is done */
+        return NGX_DONE;
+    }
+
     if (ret >= 0) {
         ctx->regex_id       = ret;
         ctx->total_buffered = 0;
 
-        from = ctx->ovector[0];
-        to = ctx->ovector[1];
-
-        dd("pike vm ok: (%d, %d)", (int) from, (int) to);
-
-        if (from >= ctx->stream_pos) {
-            /* the match is completely on the current buf */
-
-            if (ctx->pending) {
-                *ctx->last_out = ctx->pending;
-                ctx->last_out = ctx->last_pending;
-
-                ctx->pending = NULL;
-                ctx->last_pending = &ctx->pending;
-            }
-
-            /* prepare ctx->captured */
-
-            cl = ngx_http_replace_get_free_buf(r->pool, &ctx->free);
-            if (cl == NULL) {
-                return NGX_ERROR;
-            }
-
-            cl->buf->pos = ctx->buf->pos;
-            cl->buf->last = ctx->buf->last;
-            cl->buf->memory = 1;
-            cl->buf->file_pos = ctx->stream_pos;
-            cl->buf->file_last = ctx->stream_pos
-                                 + (cl->buf->last - cl->buf->pos);
-
-            *ctx->last_captured = cl;
-            ctx->last_captured = &cl->next;
-
-            dd("ctx captured: %p", ctx->captured);
-
-            /* prepare copy-out data */
-
-            ctx->copy_start = ctx->pos;
-            ctx->copy_end = ctx->buf->pos + (from - ctx->stream_pos);
-
-            dd("copy len: %d", (int) (ctx->copy_end - ctx->copy_start));
-
-            ctx->pos = ctx->buf->pos + (to - ctx->stream_pos);
-            return NGX_OK;
-        }
-
-        /* from < ctx->stream_pos */
-
-        if (ctx->pending) {
-
-            if (ngx_http_replace_split_chain(r, ctx, &ctx->pending,
-                                             &ctx->last_pending, from,
-                                             &cl, &last, 1)
-                != NGX_OK)
-            {
-                return NGX_ERROR;
-            }
-
-            if (ctx->pending) {
-                *ctx->last_out = ctx->pending;
-                ctx->last_out = ctx->last_pending;
-
-                ctx->pending = NULL;
-                ctx->last_pending = &ctx->pending;
-            }
-
-            if (cl) {
-                if (to >= ctx->stream_pos) {
-                    /* no pending data to be rematched */
-
-                    if (to == ctx->stream_pos) {
-                        *ctx->last_captured = cl;
-                        ctx->last_captured = &cl->next;
-
-                    } else {
-                        *ctx->last_captured = cl;
-                        ctx->last_captured = last;
-
-                        cl = ngx_http_replace_get_free_buf(r->pool, &ctx->free);
-                        if (cl == NULL) {
-                            return NGX_ERROR;
-                        }
-
-                        cl->buf->pos = ctx->buf->pos;
-                        cl->buf->last = ctx->buf->last;
-                        cl->buf->memory = 1;
-                        cl->buf->file_pos = ctx->stream_pos;
-                        cl->buf->file_last = ctx->stream_pos
-                                             + (cl->buf->last - cl->buf->pos);
-
-                        *ctx->last_captured = cl;
-                        ctx->last_captured = &cl->next;
-                    }
-
-                } else {
-                    /* there's pending data to be rematched */
-
-                    if (ngx_http_replace_split_chain(r, ctx, &cl,
-                                                     &last,
-                                                     to, &new_rematch,
-                                                     &last_rematch, 1)
-                        != NGX_OK)
-                    {
-                        return NGX_ERROR;
-                    }
-
-                    if (cl) {
-                        *ctx->last_captured = cl;
-                        ctx->last_captured = last;
-                    }
-
-                    if (new_rematch) {
-                        if (rematch) {
-                            ctx->rematch = rematch;
-                        }
-
-                        /* prepend cl to ctx->rematch */
-                        *last_rematch = ctx->rematch;
-                        ctx->rematch = new_rematch;
-                    }
-                }
-            }
-        }
-
-#if (DDEBUG)
-        ngx_http_replace_dump_chain("ctx->rematch", &ctx->rematch, NULL);
-#endif
-
-        ctx->copy_start = NULL;
-        ctx->copy_end = NULL;
-
-        ctx->pos = ctx->buf->pos + (to - ctx->stream_pos);
-
-        return new_rematch ? NGX_BUSY : NGX_OK;
+        return ngx_http_replace_capture_match(r, ctx, rematch);
     }
 
     switch (ret) {
@@ -210,6 +88,8 @@ ngx_http_replace_capturing_parse(ngx_http_request_t *r,
             to = ctx->stream_pos + (ctx->buf->last - ctx->buf->pos);
         }
 
+        from = ngx_http_replace_bound_from(r, ctx, from, to);
+
         dd("pike vm again (adjusted): stream pos:%d, (%d, %d)",
            (int) ctx->stream_pos, (int) from, (int) to);
 
@@ -268,8 +148,11 @@ ngx_http_replace_capturing_parse(ngx_http_request_t *r,
 
 #if 1
             if (rc == NGX_BUSY) {
-                dd("stop processing because of buffer size limit reached");
-                ctx->once = 1;
+                dd("buffer size limit reached");
+                if (ngx_http_replace_overflow(r, ctx, -1) == NGX_ERROR) {
+                    return NGX_ERROR;
+                }
+
                 ctx->copy_start = ctx->pos;
                 ctx->copy_end = ctx->buf->last;
                 ctx->pos = ctx->buf->last;
@@ -332,7 +215,9 @@ ngx_http_replace_capturing_parse(ngx_http_request_t *r,
 
 #if 1
         if (rc == NGX_BUSY) {
-            ctx->once = 1;
+            if (ngx_http_replace_overflow(r, ctx, -1) == NGX_ERROR) {
+                return NGX_ERROR;
+            }
 
             if (ctx->pending) {
                 *ctx->last_out = ctx->pending;
@@ -385,6 +270,7 @@ ngx_http_replace_non_capturing_parse(ngx_http_request_t *r,
     ngx_chain_t          **last_rematch, **last;
     size_t                 len;
     sre_int_t             *pending_matched;
+    unsigned               keep;
 
     dd("replace non capturing parse");
 
@@ -406,15 +292,35 @@ ngx_http_replace_non_capturing_parse(ngx_http_request_t *r,
        ctx->special_buf, ctx->last_buf,
        (int) (ctx->buf->last - ctx->pos), ctx->pos);
 
-    ret = sre_vm_pike_exec(ctx->vm_ctx, ctx->pos, len, ctx->last_buf,
-                           &pending_matched);
+    /*
+     * once a once rule fired, its later matches are passed through
+     * unchanged, unless the VM no longer runs it, see
+     * ngx_http_replace_vm_variant(), so the bytes of the possible matches
+     * are kept as with the capturing parse
+     */
+
+    keep = (ctx->disabled_count > 0 && ctx->program == NULL);
+
+    pending_matched = NULL;
+
+    ret = ngx_http_replace_exec(r, ctx, ctx->pos, len, ctx->last_buf,
+                                keep ? NULL : &pending_matched);
 
     dd("vm pike exec: %d", (int) ret);
 
+    if (ret == NGX_HTTP_REPLACE_EXEC_POSTED) {
+        /* retried once the thread pool is done */
+        return NGX_DONE;
+    }
+
     if (ret >= 0) {
         ctx->regex_id = ret;
         ctx->total_buffered = 0;
 
+        if (keep) {
+            return ngx_http_replace_capture_match(r, ctx, rematch);
+        }
+
         from = ctx->ovector[0];
         to = ctx->ovector[1];
 
@@ -547,6 +453,10 @@ ngx_http_replace_non_capturing_parse(ngx_http_request_t *r,
             dd("pending matched: (%ld, %ld)", (long) mfrom, (long) mto);
         }
 
+        if (pending_matched == NULL && ctx->pending2 == NULL) {
+            from = ngx_http_replace_bound_from(r, ctx, from, to);
+        }
+
         if (from == to) {
             if (ctx->pending) {
                 ctx->total_buffered = 0;
@@ -609,9 +519,13 @@ ngx_http_replace_non_capturing_parse(ngx_http_request_t *r,
                     }
 
                     if (rc == NGX_BUSY) {
-                        dd("stop processing because of buffer size limit "
-                           "reached");
-                        ctx->once = 1;
+                        dd("buffer size limit reached");
+                        if (ngx_http_replace_overflow(r, ctx, -1)
+                            == NGX_ERROR)
+                        {
+                            return NGX_ERROR;
+                        }
+
                         ctx->copy_start = ctx->pos;
                         ctx->copy_end = ctx->buf->last;
                         ctx->pos = ctx->buf->last;
@@ -631,13 +545,30 @@ ngx_http_replace_non_capturing_parse(ngx_http_request_t *r,
 
 #if 1
                     if (rc == NGX_BUSY) {
-                        dd("stop processing because of buffer size limit "
-                           "reached");
-                        ctx->once = 1;
-                        ctx->copy_start = ctx->pos;
-                        ctx->copy_end = ctx->buf->last;
-                        ctx->pos = ctx->buf->last;
-                        return NGX_AGAIN;
+                        dd("buffer size limit reached");
+                        if (ngx_http_replace_overflow(r, ctx, mto)
+                            == NGX_ERROR)
+                        {
+                            return NGX_ERROR;
+                        }
+
+                        /*
+                         * (from, mfrom) is copied from the current buf
+                         * right before the pending match
+                         */
+
+                        if (ctx->pending) {
+                            *ctx->last_pending = ctx->free;
+                            ctx->free = ctx->pending;
+
+                            ctx->pending = NULL;
+                            ctx->last_pending = &ctx->pending;
+                        }
+
+                        ctx->copy_end = ctx->buf->pos
+                                        + (mfrom - ctx->stream_pos);
+                        ctx->pos = ctx->buf->pos + (mto - ctx->stream_pos);
+                        return NGX_OK;
                     }
 #endif
 
@@ -654,8 +585,11 @@ ngx_http_replace_non_capturing_parse(ngx_http_request_t *r,
 
 #if 1
                 if (rc == NGX_BUSY) {
-                    dd("stop processing because of buffer size limit reached");
-                    ctx->once = 1;
+                    dd("buffer size limit reached");
+                    if (ngx_http_replace_overflow(r, ctx, -1) == NGX_ERROR) {
+                        return NGX_ERROR;
+                    }
+
                     ctx->copy_start = ctx->pos;
                     ctx->copy_end = ctx->buf->last;
                     ctx->pos = ctx->buf->last;
@@ -776,7 +710,9 @@ ngx_http_replace_non_capturing_parse(ngx_http_request_t *r,
 
 #if 1
                 if (rc == NGX_BUSY) {
-                    ctx->once = 1;
+                    if (ngx_http_replace_overflow(r, ctx, mto) == NGX_ERROR) {
+                        return NGX_ERROR;
+                    }
 
                     if (ctx->pending) {
                         *ctx->last_out = ctx->pending;
@@ -837,7 +773,9 @@ ngx_http_replace_non_capturing_parse(ngx_http_request_t *r,
                 }
 
                 if (rc == NGX_BUSY) {
-                    ctx->once = 1;
+                    if (ngx_http_replace_overflow(r, ctx, mto) == NGX_ERROR) {
+                        return NGX_ERROR;
+                    }
 
                     if (ctx->pending) {
                         *ctx->last_out = ctx->pending;
@@ -872,7 +810,9 @@ ngx_http_replace_non_capturing_parse(ngx_http_request_t *r,
 
 #if 1
             if (rc == NGX_BUSY) {
-                ctx->once = 1;
+                if (ngx_http_replace_overflow(r, ctx, -1) == NGX_ERROR) {
+                    return NGX_ERROR;
+                }
 
                 if (ctx->pending) {
                     *ctx->last_out = ctx->pending;
@@ -918,6 +858,231 @@ ngx_http_replace_non_capturing_parse(ngx_http_request_t *r,
 }
 
 
+/*
+ * Sets ctx->captured to the bytes of the match in ctx->ovector, which may
+ * start on ctx->pending, and queues the pending bytes after it, if any,
+ * for rematching.
+ */
+
+static ngx_int_t
+ngx_http_replace_capture_match(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, ngx_chain_t *rematch)
+{
+    sre_int_t              from, to;
+    ngx_chain_t           *new_rematch = NULL;
+    ngx_chain_t           *cl;
+    ngx_chain_t          **last_rematch, **last;
+
+    from = ctx->ovector[0];
+    to = ctx->ovector[1];
+
+    dd("pike vm ok: (%d, %d)", (int) from, (int) to);
+
+    if (from >= ctx->stream_pos) {
+        /* the match is completely on the current buf */
+
+        if (ctx->pending) {
+            *ctx->last_out = ctx->pending;
+            ctx->last_out = ctx->last_pending;
+
+            ctx->pending = NULL;
+            ctx->last_pending = &ctx->pending;
+        }
+
+        /* prepare ctx->captured */
+
+        cl = ngx_http_replace_get_free_buf(r->pool, &ctx->free);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        cl->buf->pos = ctx->buf->pos;
+        cl->buf->last = ctx->buf->last;
+        cl->buf->memory = 1;
+        cl->buf->file_pos = ctx->stream_pos;
+        cl->buf->file_last = ctx->stream_pos
+                             + (cl->buf->last - cl->buf->pos);
+
+        *ctx->last_captured = cl;
+        ctx->last_captured = &cl->next;
+
+        dd("ctx captured: %p", ctx->captured);
+
+        /* prepare copy-out data */
+
+        ctx->copy_start = ctx->pos;
+        ctx->copy_end = ctx->buf->pos + (from - ctx->stream_pos);
+
+        dd("copy len: %d", (int) (ctx->copy_end - ctx->copy_start));
+
+        ctx->pos = ctx->buf->pos + (to - ctx->stream_pos);
+        return NGX_OK;
+    }
+
+    /* from < ctx->stream_pos */
+
+    if (ctx->pending) {
+
+        if (ngx_http_replace_split_chain(r, ctx, &ctx->pending,
+                                         &ctx->last_pending, from,
+                                         &cl, &last, 1)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        if (ctx->pending) {
+            *ctx->last_out = ctx->pending;
+            ctx->last_out = ctx->last_pending;
+
+            ctx->pending = NULL;
+            ctx->last_pending = &ctx->pending;
+        }
+
+        if (cl) {
+            if (to >= ctx->stream_pos) {
+                /* no pending data to be rematched */
+
+                if (to == ctx->stream_pos) {
+                    *ctx->last_captured = cl;
+                    ctx->last_captured = &cl->next;
+
+                } else {
+                    *ctx->last_captured = cl;
+                    ctx->last_captured = last;
+
+                    cl = ngx_http_replace_get_free_buf(r->pool, &ctx->free);
+                    if (cl == NULL) {
+                        return NGX_ERROR;
+                    }
+
+                    cl->buf->pos = ctx->buf->pos;
+                    cl->buf->last = ctx->buf->last;
+                    cl->buf->memory = 1;
+                    cl->buf->file_pos = ctx->stream_pos;
+                    cl->buf->file_last = ctx->stream_pos
+                                         + (cl->buf->last - cl->buf->pos);
+
+                    *ctx->last_captured = cl;
+                    ctx->last_captured = &cl->next;
+                }
+
+            } else {
+                /* there's pending data to be rematched */
+
+                if (ngx_http_replace_split_chain(r, ctx, &cl,
+                                                 &last,
+                                                 to, &new_rematch,
+                                                 &last_rematch, 1)
+                    != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+
+                if (cl) {
+                    *ctx->last_captured = cl;
+                    ctx->last_captured = last;
+                }
+
+                if (new_rematch) {
+                    if (rematch) {
+                        ctx->rematch = rematch;
+                    }
+
+                    /* prepend cl to ctx->rematch */
+                    *last_rematch = ctx->rematch;
+                    ctx->rematch = new_rematch;
+                }
+            }
+        }
+    }
+
+#if (DDEBUG)
+    ngx_http_replace_dump_chain("ctx->rematch", &ctx->rematch, NULL);
+#endif
+
+    ctx->copy_start = NULL;
+    ctx->copy_end = NULL;
+
+    ctx->pos = ctx->buf->pos + (to - ctx->stream_pos);
+
+    return new_rematch ? NGX_BUSY : NGX_OK;
+}
+
+
+/*
+ * When no match is longer than rlcf->max_len, none may start before the
+ * last max_len - 1 bytes seen, whatever the state of the backend, so the
+ * data before them can be released right away. The assertions count as
+ * zero bytes in max_len while the VM still waits for the next byte to
+ * check them, so the regexes with assertions get no bound.
+ */
+
+static sre_int_t
+ngx_http_replace_bound_from(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, sre_int_t from, sre_int_t to)
+{
+    sre_int_t                      bound;
+    ngx_http_replace_loc_conf_t   *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_replace_filter_module);
+
+    if (!rlcf->restartable
+        || rlcf->max_len == NGX_HTTP_REPLACE_UNBOUNDED
+        || rlcf->max_len == 0)
+    {
+        return from;
+    }
+
+    bound = ctx->stream_pos + (ctx->buf->last - ctx->buf->pos)
+            - (rlcf->max_len - 1);
+
+    if (from >= bound) {
+        return from;
+    }
+
+    dd("released %ld bytes beyond the longest match", (long) (bound - from));
+
+    return ngx_min(bound, to);
+}
+
+
+/*
+ * The pending data would exceed replace_filter_max_buffered_size: with
+ * "replace_filter_overflow restart", the matching starts over at the stream
+ * offset "offset" (-1 for the end of the current buf), otherwise it stops
+ * for the rest of the response.
+ */
+
+static ngx_int_t
+ngx_http_replace_overflow(ngx_http_request_t *r, ngx_http_replace_ctx_t *ctx,
+    sre_int_t offset)
+{
+    ngx_http_replace_loc_conf_t   *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_replace_filter_module);
+
+    ctx->overflows++;
+
+    if (rlcf->overflow == NGX_HTTP_REPLACE_OVERFLOW_STOP) {
+        ctx->once = 1;
+        return NGX_DECLINED;
+    }
+
+    if (offset == -1) {
+        offset = ctx->stream_pos + (ctx->buf->last - ctx->buf->pos);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "replace filter: overflow #%ui, restarting at %O",
+                   ctx->overflows, (off_t) offset);
+
+    ctx->total_buffered = 0;
+
+    return rlcf->backend->restart(r, ctx, offset);
+}
+
+
 static void
 ngx_http_replace_check_total_buffered(ngx_http_request_t *r,
     ngx_http_replace_ctx_t *ctx, sre_int_t len, sre_int_t mlen)
@@ -0,0 +1,453 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef DDEBUG
+#define DDEBUG 0
+#endif
+#include "ddebug.h"
+
+
+#include "ngx_http_replace_engine.h"
+
+
+#if (NGX_PCRE2)
+
+
+/*
+ * The PCRE2 backend ("replace_filter_engine pcre2").
+ *
+ * All the regexes of a location are compiled into a single PCRE2 pattern,
+ *
+ *     (?|(?:re0)(*MARK:0)|(?i:re1)(*MARK:1)|...)
+ *
+ * where the branch reset group numbers the captures of every regex from 1,
+ * like sregex does, and the mark tells which regex matched.
+ *
+ * PCRE2 is not a streaming matcher, so the data that may still start a
+ * match is kept and matched again together with the next buffer. With
+ * PCRE2_PARTIAL_HARD, pcre2_match() reports a partial match as soon as it
+ * hits the end of the data, which is exactly when sregex returns
+ * SRE_AGAIN. This is only correct when no regex looks at the data before
+ * the match, so the regexes with assertions are left to sregex.
+ */
+
+
+typedef struct {
+    pcre2_code                 *code;
+} ngx_http_replace_pcre2_t;
+
+
+typedef struct {
+    pcre2_match_data           *match_data;
+
+    u_char                     *buf;  /* the data that may start a match */
+    size_t                      len;
+    size_t                      size;
+
+    sre_int_t                   base;  /* the stream offset of buf[0] */
+} ngx_http_replace_pcre2_ctx_t;
+
+
+static ngx_int_t ngx_http_replace_pcre2_compile(ngx_conf_t *cf,
+    ngx_http_replace_loc_conf_t *rlcf);
+static void ngx_http_replace_pcre2_cleanup(void *data);
+static ngx_int_t ngx_http_replace_pcre2_create_ctx(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx);
+static sre_int_t ngx_http_replace_pcre2_exec(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, u_char *input, size_t size, unsigned eof,
+    sre_int_t **pending_matched);
+static ngx_int_t ngx_http_replace_pcre2_restart(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, sre_int_t offset);
+static void ngx_http_replace_pcre2_reset(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx);
+static ngx_int_t ngx_http_replace_pcre2_reserve(ngx_http_request_t *r,
+    ngx_http_replace_pcre2_ctx_t *pctx, size_t size);
+static void *ngx_http_replace_pcre2_malloc(PCRE2_SIZE size, void *data);
+static void ngx_http_replace_pcre2_free(void *p, void *data);
+
+
+ngx_http_replace_backend_t  ngx_http_replace_pcre2_backend = {
+    ngx_string("pcre2"),
+    ngx_http_replace_pcre2_compile,
+    ngx_http_replace_pcre2_create_ctx,
+    ngx_http_replace_pcre2_exec,
+    ngx_http_replace_pcre2_restart,
+    ngx_http_replace_pcre2_reset
+};
+
+
+static ngx_int_t
+ngx_http_replace_pcre2_compile(ngx_conf_t *cf,
+    ngx_http_replace_loc_conf_t *rlcf)
+{
+    int                         *flags, errcode;
+    u_char                      *pattern, *p, **value;
+    size_t                       len;
+    uint32_t                     ncaps;
+    ngx_uint_t                   i, n;
+    PCRE2_SIZE                   erroff;
+    pcre2_code                  *code;
+    ngx_pool_cleanup_t          *cln;
+    ngx_http_replace_pcre2_t    *pc;
+    u_char                       errstr[128];
+
+    n = rlcf->regexes.nelts;
+    value = rlcf->regexes.elts;
+    flags = rlcf->multi_flags.elts;
+
+    if (!rlcf->restartable) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "replace_filter_engine pcre2 does not support "
+                           "regex \"%s\" or its siblings, using pike",
+                           value[0]);
+        return NGX_DECLINED;
+    }
+
+    len = sizeof("(?|)") - 1;
+
+    for (i = 0; i < n; i++) {
+        len += sizeof("|(?i:)(*MARK:)") - 1 + ngx_strlen(value[i])
+               + NGX_INT_T_LEN;
+    }
+
+    pattern = ngx_pnalloc(cf->temp_pool, len);
+    if (pattern == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(pattern, "(?|", sizeof("(?|") - 1);
+
+    for (i = 0; i < n; i++) {
+        if (i > 0) {
+            *p++ = '|';
+        }
+
+        p = ngx_sprintf(p, "(?%s:%s)(*MARK:%ui)",
+                        (flags[i] & SRE_REGEX_CASELESS) ? "i" : "",
+                        value[i], i);
+    }
+
+    *p++ = ')';
+
+    dd("pcre2 pattern: \"%.*s\"", (int) (p - pattern), pattern);
+
+    code = pcre2_compile(pattern, p - pattern, 0, &errcode, &erroff, NULL);
+
+    if (code == NULL) {
+        pcre2_get_error_message(errcode, errstr, sizeof(errstr));
+
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "replace_filter_engine pcre2 failed to compile "
+                           "regex \"%s\" or its siblings: %s, using pike",
+                           value[0], errstr);
+        return NGX_DECLINED;
+    }
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        pcre2_code_free(code);
+        return NGX_ERROR;
+    }
+
+    cln->data = code;
+    cln->handler = ngx_http_replace_pcre2_cleanup;
+
+    if (pcre2_jit_compile(code, PCRE2_JIT_COMPLETE | PCRE2_JIT_PARTIAL_HARD)
+        != 0)
+    {
+        ngx_conf_log_error(NGX_LOG_INFO, cf, 0,
+                           "PCRE2 JIT is not available for regex \"%s\" "
+                           "and its siblings", value[0]);
+    }
+
+    if (pcre2_pattern_info(code, PCRE2_INFO_CAPTURECOUNT, &ncaps) != 0
+        || ncaps != rlcf->ncaps)
+    {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "replace_filter_engine pcre2 does not number the "
+                           "captures of regex \"%s\" or its siblings like "
+                           "sregex, using pike", value[0]);
+        return NGX_DECLINED;
+    }
+
+    pc = ngx_palloc(cf->pool, sizeof(ngx_http_replace_pcre2_t));
+    if (pc == NULL) {
+        return NGX_ERROR;
+    }
+
+    pc->code = code;
+
+    rlcf->backend_conf = pc;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_replace_pcre2_cleanup(void *data)
+{
+    pcre2_code  *code = data;
+
+    pcre2_code_free(code);
+}
+
+
+static ngx_int_t
+ngx_http_replace_pcre2_create_ctx(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx)
+{
+    pcre2_general_context          *gctx;
+    ngx_http_replace_pcre2_t       *pc;
+    ngx_http_replace_pcre2_ctx_t   *pctx;
+    ngx_http_replace_loc_conf_t    *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_replace_filter_module);
+
+    pc = rlcf->backend_conf;
+
+    pctx = ngx_pcalloc(r->pool, sizeof(ngx_http_replace_pcre2_ctx_t));
+    if (pctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* the match data lives in the request pool */
+
+    gctx = pcre2_general_context_create(ngx_http_replace_pcre2_malloc,
+                                        ngx_http_replace_pcre2_free,
+                                        r->pool);
+    if (gctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    pctx->match_data = pcre2_match_data_create_from_pattern(pc->code, gctx);
+    if (pctx->match_data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->backend_ctx = pctx;
+
+    return NGX_OK;
+}
+
+
+static sre_int_t
+ngx_http_replace_pcre2_exec(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, u_char *input, size_t size, unsigned eof,
+    sre_int_t **pending_matched)
+{
+    int                             rc;
+    u_char                         *subject;
+    size_t                          len, from;
+    ngx_int_t                       id;
+    ngx_uint_t                      i, n;
+    PCRE2_SIZE                     *ov;
+    PCRE2_SPTR                      mark;
+    ngx_http_replace_pcre2_t       *pc;
+    ngx_http_replace_pcre2_ctx_t   *pctx;
+    ngx_http_replace_loc_conf_t    *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_replace_filter_module);
+
+    pc = rlcf->backend_conf;
+    pctx = ctx->backend_ctx;
+
+    if (pctx->len) {
+        if (ngx_http_replace_pcre2_reserve(r, pctx, size) != NGX_OK) {
+            return SRE_ERROR;
+        }
+
+        ngx_memcpy(pctx->buf + pctx->len, input, size);
+        pctx->len += size;
+
+        subject = pctx->buf;
+        len = pctx->len;
+
+    } else {
+        subject = input;
+        len = size;
+    }
+
+    rc = pcre2_match(pc->code, subject, len, 0, eof ? 0 : PCRE2_PARTIAL_HARD,
+                     pctx->match_data, NULL);
+
+    dd("pcre2 match on %d bytes at %ld: %d", (int) len, (long) pctx->base,
+       rc);
+
+    ov = pcre2_get_ovector_pointer(pctx->match_data);
+
+    if (rc == PCRE2_ERROR_NOMATCH) {
+        pctx->base += len;
+        pctx->len = 0;
+
+        if (eof) {
+            return SRE_DECLINED;
+        }
+
+        ctx->ovector[0] = -1;
+        ctx->ovector[1] = -1;
+
+        if (pending_matched) {
+            *pending_matched = NULL;
+        }
+
+        return SRE_AGAIN;
+    }
+
+    if (rc == PCRE2_ERROR_PARTIAL) {
+
+        /* keep the data from the start of the partial match */
+
+        from = ov[0];
+
+        if (subject == pctx->buf) {
+            ngx_memmove(pctx->buf, pctx->buf + from, len - from);
+
+        } else {
+            if (ngx_http_replace_pcre2_reserve(r, pctx, len - from)
+                != NGX_OK)
+            {
+                return SRE_ERROR;
+            }
+
+            ngx_memcpy(pctx->buf, subject + from, len - from);
+        }
+
+        pctx->base += from;
+        pctx->len = len - from;
+
+        ctx->ovector[0] = pctx->base;
+        ctx->ovector[1] = pctx->base + pctx->len;
+
+        if (pending_matched) {
+            *pending_matched = NULL;
+        }
+
+        return SRE_AGAIN;
+    }
+
+    if (rc < 0) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "pcre2_match() failed: %d", rc);
+        return SRE_ERROR;
+    }
+
+    mark = pcre2_get_mark(pctx->match_data);
+
+    id = (mark == NULL) ? NGX_ERROR
+                        : ngx_atoi((u_char *) mark,
+                                   ngx_strlen((u_char *) mark));
+
+    if (id == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      "pcre2 match without a regex id");
+        return SRE_ERROR;
+    }
+
+    n = rlcf->ovecsize / sizeof(sre_int_t);
+
+    for (i = 0; i < n; i++) {
+        ctx->ovector[i] = (ov[i] == PCRE2_UNSET)
+                          ? -1 : pctx->base + (sre_int_t) ov[i];
+    }
+
+    /* the data right after the match is fed again */
+
+    pctx->base = ctx->ovector[1];
+    pctx->len = 0;
+
+    return (sre_int_t) id;
+}
+
+
+/* the kept data is dropped, the buffer itself is reused */
+
+static ngx_int_t
+ngx_http_replace_pcre2_restart(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, sre_int_t offset)
+{
+    ngx_http_replace_pcre2_ctx_t   *pctx;
+
+    pctx = ctx->backend_ctx;
+
+    pctx->base = offset;
+    pctx->len = 0;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_replace_pcre2_reset(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx)
+{
+    ngx_http_replace_pcre2_ctx_t   *pctx;
+
+    pctx = ctx->backend_ctx;
+
+    if (pctx->buf) {
+        ngx_pfree(r->pool, pctx->buf);
+    }
+
+    pctx->buf = NULL;
+    pctx->len = 0;
+    pctx->size = 0;
+}
+
+
+/* makes room for "size" more bytes after the kept data */
+
+static ngx_int_t
+ngx_http_replace_pcre2_reserve(ngx_http_request_t *r,
+    ngx_http_replace_pcre2_ctx_t *pctx, size_t size)
+{
+    u_char      *buf;
+    size_t       n;
+
+    if (pctx->len + size <= pctx->size) {
+        return NGX_OK;
+    }
+
+    n = ngx_max(pctx->len + size, 2 * pctx->size);
+
+    buf = ngx_palloc(r->pool, n);
+    if (buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (pctx->len) {
+        ngx_memcpy(buf, pctx->buf, pctx->len);
+    }
+
+    if (pctx->buf) {
+        ngx_pfree(r->pool, pctx->buf);
+    }
+
+    pctx->buf = buf;
+    pctx->size = n;
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_replace_pcre2_malloc(PCRE2_SIZE size, void *data)
+{
+    ngx_pool_t  *pool = data;
+
+    return ngx_palloc(pool, size);
+}
+
+
+static void
+ngx_http_replace_pcre2_free(void *p, void *data)
+{
+    ngx_pool_t  *pool = data;
+
+    ngx_pfree(pool, p);
+}
+
+
+#endif /* NGX_PCRE2 */
@@ -0,0 +1,644 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef DDEBUG
+#define DDEBUG 0
+#endif
+#include "ddebug.h"
+
+
+#include "ngx_http_replace_program.h"
+#include "ngx_http_replace_parse.h"
+
+
+/*
+ * The program cache file only holds the literal automata of the rule sets
+ * made of plain strings, the only tables that take long to build: sregex
+ * offers no way to save its compiled programs, and the analysis of the
+ * regexes is cheap. Bump the version below whenever the layout of the file
+ * changes, and NGX_HTTP_REPLACE_LITERAL_VERSION whenever the meaning of the
+ * automata does.
+ */
+
+#define NGX_HTTP_REPLACE_PROGRAM_CACHE_MAGIC    "RFPROGS\n"
+#define NGX_HTTP_REPLACE_PROGRAM_CACHE_VERSION  2
+
+#define NGX_HTTP_REPLACE_PROGRAM_CACHE_LAYOUT                                \
+    (sizeof(ngx_http_replace_literal_state_t)                                \
+     | (uint32_t) NGX_HTTP_REPLACE_LITERAL_VERSION << 24)
+
+
+typedef struct {
+    u_char                      magic[8];
+    uint32_t                    version;
+    uint32_t                    layout;
+    uint32_t                    byte_order;  /* 0x01020304 */
+    uint32_t                    nentries;
+    uint64_t                    size;  /* of the entries */
+    uint32_t                    crc32;  /* of the entries */
+    uint32_t                    reserved;
+} ngx_http_replace_program_cache_header_t;
+
+
+/*
+ * Every entry is followed by its key and by the byte classes, the
+ * transitions and the states of its literal automaton, each aligned to 8
+ * bytes.
+ */
+
+typedef struct {
+    uint32_t                    size;  /* including this header */
+    uint32_t                    key_len;
+    uint32_t                    nclasses;
+    uint32_t                    nstates;
+} ngx_http_replace_program_cache_entry_t;
+
+
+static ngx_int_t ngx_http_replace_program_key(ngx_conf_t *cf,
+    ngx_http_replace_loc_conf_t *rlcf, ngx_str_t *key);
+static ngx_int_t ngx_http_replace_program_cache_load(ngx_conf_t *cf,
+    ngx_http_replace_main_conf_t *rmcf);
+static ngx_int_t ngx_http_replace_program_cache_check(u_char *p, size_t size);
+static ngx_int_t ngx_http_replace_program_cache_add(ngx_conf_t *cf,
+    ngx_http_replace_main_conf_t *rmcf, u_char *p);
+static size_t ngx_http_replace_program_cache_entry_size(uint64_t key_len,
+    uint64_t nclasses, uint64_t nstates);
+
+
+/*
+ * Looks up the rule set of the location in the program cache. When found,
+ * the compiled program and its derived tables are copied to rlcf and
+ * NGX_OK is returned. When only the literal automaton was loaded from the
+ * program cache file, it is copied and NGX_DONE is returned. Otherwise a
+ * new cache entry is created and NGX_DECLINED is returned. In both latter
+ * cases, the caller compiles what is missing and then stores the result
+ * with ngx_http_replace_program_save().
+ */
+
+ngx_int_t
+ngx_http_replace_program_get(ngx_conf_t *cf,
+    ngx_http_replace_loc_conf_t *rlcf)
+{
+    uint32_t                         hash;
+    ngx_str_t                        key;
+    ngx_str_node_t                  *sn;
+    ngx_http_replace_program_t      *prog;
+    ngx_http_replace_main_conf_t    *rmcf;
+
+    rmcf = ngx_http_conf_get_module_main_conf(cf,
+                                              ngx_http_replace_filter_module);
+
+    if (rmcf->program_cache.len && !rmcf->program_cache_loaded) {
+        rmcf->program_cache_loaded = 1;
+
+        if (ngx_http_replace_program_cache_load(cf, rmcf) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (ngx_http_replace_program_key(cf, rlcf, &key) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    hash = ngx_crc32_long(key.data, key.len);
+
+    sn = ngx_str_rbtree_lookup(&rmcf->programs, &key, hash);
+
+    if (sn) {
+        prog = (ngx_http_replace_program_t *) sn;
+
+        if (prog->program == NULL) {
+
+            /* loaded from the program cache file */
+
+            dd("using the cached automaton of \"%s\"",
+               ((u_char **) rlcf->regexes.elts)[0]);
+
+            rlcf->literal = prog->literal;
+            rlcf->shared = prog;
+
+            prog->next = rmcf->programs_used;
+            rmcf->programs_used = prog;
+
+            rmcf->programs_compiled++;
+
+            return NGX_DONE;
+        }
+
+        dd("reusing program %p", prog->program);
+
+        rlcf->program = prog->program;
+        rlcf->capture_program = prog->capture_program;
+        rlcf->ncaps = prog->ncaps;
+        rlcf->ovecsize = prog->ovecsize;
+        rlcf->vm_ovecsize = prog->vm_ovecsize;
+        rlcf->regex_info = prog->regex_info;
+        rlcf->scan = prog->scan;
+        rlcf->literal = prog->literal;
+        rlcf->max_len = prog->max_len;
+        rlcf->restartable = prog->restartable;
+        rlcf->shared = prog;
+
+        rmcf->programs_reused++;
+
+        return NGX_OK;
+    }
+
+    prog = ngx_pcalloc(cf->pool, sizeof(ngx_http_replace_program_t));
+    if (prog == NULL) {
+        return NGX_ERROR;
+    }
+
+    prog->sn.str.data = ngx_pstrdup(cf->pool, &key);
+    if (prog->sn.str.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    prog->sn.str.len = key.len;
+    prog->sn.node.key = hash;
+
+    ngx_rbtree_insert(&rmcf->programs, &prog->sn.node);
+
+    prog->next = rmcf->programs_used;
+    rmcf->programs_used = prog;
+
+    rmcf->programs_compiled++;
+
+    rlcf->shared = prog;
+
+    return NGX_DECLINED;
+}
+
+
+void
+ngx_http_replace_program_save(ngx_http_replace_loc_conf_t *rlcf)
+{
+    ngx_http_replace_program_t      *prog;
+
+    prog = rlcf->shared;
+
+    prog->nregexes = rlcf->regexes.nelts;
+    prog->program = rlcf->program;
+    prog->capture_program = rlcf->capture_program;
+    prog->ncaps = rlcf->ncaps;
+    prog->ovecsize = rlcf->ovecsize;
+    prog->vm_ovecsize = rlcf->vm_ovecsize;
+    prog->regex_info = rlcf->regex_info;
+    prog->scan = rlcf->scan;
+    prog->literal = rlcf->literal;
+    prog->max_len = rlcf->max_len;
+    prog->restartable = rlcf->restartable;
+}
+
+
+/*
+ * The key is made of the flags and the NUL-terminated source of every
+ * regex, in order, and of whether the capturing parser is used, which
+ * decides whether a capture-free program is compiled as well.
+ */
+
+static ngx_int_t
+ngx_http_replace_program_key(ngx_conf_t *cf,
+    ngx_http_replace_loc_conf_t *rlcf, ngx_str_t *key)
+{
+    int              *flags;
+    u_char           *p, **value;
+    size_t            len;
+    ngx_uint_t        i, n;
+
+    n = rlcf->regexes.nelts;
+    value = rlcf->regexes.elts;
+    flags = rlcf->multi_flags.elts;
+
+    len = 1;
+
+    for (i = 0; i < n; i++) {
+        len += sizeof(int) + ngx_strlen(value[i]) + 1;
+    }
+
+    p = ngx_pnalloc(cf->temp_pool, len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    key->data = p;
+    key->len = len;
+
+    *p++ = (rlcf->parse_buf == ngx_http_replace_capturing_parse);
+
+    for (i = 0; i < n; i++) {
+        p = ngx_cpymem(p, &flags[i], sizeof(int));
+        p = ngx_cpymem(p, value[i], ngx_strlen(value[i]) + 1);
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * Called once all the locations are merged: rewrites the program cache file
+ * with the literal automata of the new configuration when any of them had
+ * to be built from scratch. Failures are not fatal, the file is only a
+ * cache.
+ */
+
+ngx_int_t
+ngx_http_replace_program_cache_write(ngx_conf_t *cf)
+{
+    u_char                                    *buf, *p, *name;
+    size_t                                     len, n;
+    ssize_t                                    written;
+    ngx_fd_t                                   fd;
+    ngx_uint_t                                 nentries, dirty;
+    ngx_http_replace_literal_t                *lit;
+    ngx_http_replace_program_t                *prog;
+    ngx_http_replace_main_conf_t              *rmcf;
+    ngx_http_replace_program_cache_entry_t    *entry;
+    ngx_http_replace_program_cache_header_t   *header;
+
+    rmcf = ngx_http_conf_get_module_main_conf(cf,
+                                              ngx_http_replace_filter_module);
+
+    if (rmcf->program_cache.len == 0) {
+        return NGX_OK;
+    }
+
+    if (ngx_test_config) {
+        /* "nginx -t" leaves the file system alone */
+        return NGX_OK;
+    }
+
+    len = sizeof(ngx_http_replace_program_cache_header_t);
+    nentries = 0;
+    dirty = 0;
+
+    for (prog = rmcf->programs_used; prog; prog = prog->next) {
+        lit = prog->literal;
+
+        if (lit == NULL) {
+            continue;
+        }
+
+        if (!prog->cached) {
+            dirty = 1;
+        }
+
+        len += ngx_http_replace_program_cache_entry_size(prog->sn.str.len,
+                                                         lit->nclasses,
+                                                         lit->nstates);
+        nentries++;
+    }
+
+    if (!dirty) {
+        return NGX_OK;
+    }
+
+    /* zeroed, so that the padding is reproducible */
+
+    buf = ngx_pcalloc(cf->temp_pool, len);
+    if (buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    header = (ngx_http_replace_program_cache_header_t *) buf;
+
+    ngx_memcpy(header->magic, NGX_HTTP_REPLACE_PROGRAM_CACHE_MAGIC, 8);
+    header->version = NGX_HTTP_REPLACE_PROGRAM_CACHE_VERSION;
+    header->layout = NGX_HTTP_REPLACE_PROGRAM_CACHE_LAYOUT;
+    header->byte_order = 0x01020304;
+    header->nentries = (uint32_t) nentries;
+    header->size = len - sizeof(ngx_http_replace_program_cache_header_t);
+
+    p = buf + sizeof(ngx_http_replace_program_cache_header_t);
+
+    for (prog = rmcf->programs_used; prog; prog = prog->next) {
+        lit = prog->literal;
+
+        if (lit == NULL) {
+            continue;
+        }
+
+        entry = (ngx_http_replace_program_cache_entry_t *) p;
+
+        entry->key_len = (uint32_t) prog->sn.str.len;
+        entry->nclasses = (uint32_t) lit->nclasses;
+        entry->nstates = (uint32_t) lit->nstates;
+        entry->size = (uint32_t) ngx_http_replace_program_cache_entry_size(
+                                   entry->key_len, entry->nclasses,
+                                   entry->nstates);
+
+        p += sizeof(ngx_http_replace_program_cache_entry_t);
+
+        ngx_memcpy(p, prog->sn.str.data, prog->sn.str.len);
+        p += ngx_align(prog->sn.str.len, 8);
+
+        p = ngx_cpymem(p, lit->classes, 256);
+
+        n = lit->nstates * lit->nclasses * sizeof(uint32_t);
+        ngx_memcpy(p, lit->next, n);
+        p += ngx_align(n, 8);
+
+        n = lit->nstates * sizeof(ngx_http_replace_literal_state_t);
+        ngx_memcpy(p, lit->states, n);
+        p += ngx_align(n, 8);
+    }
+
+    header->crc32 = ngx_crc32_long(buf
+                           + sizeof(ngx_http_replace_program_cache_header_t),
+                           (size_t) header->size);
+
+    /* replace the file atomically, it may be read by another master */
+
+    name = ngx_pnalloc(cf->temp_pool, rmcf->program_cache.len
+                                      + 1 + NGX_INT64_LEN + 1);
+    if (name == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(name, "%V.%P%Z", &rmcf->program_cache, ngx_pid);
+
+    fd = ngx_open_file(name, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                       NGX_FILE_DEFAULT_ACCESS);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, ngx_errno,
+                           ngx_open_file_n " \"%s\" failed", name);
+        return NGX_OK;
+    }
+
+    written = ngx_write_fd(fd, buf, len);
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, ngx_errno,
+                           ngx_close_file_n " \"%s\" failed", name);
+        written = -1;
+    }
+
+    if (written != (ssize_t) len) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, ngx_errno,
+                           "failed to write the program cache \"%s\"", name);
+        goto failed;
+    }
+
+    if (ngx_rename_file(name, rmcf->program_cache.data) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, ngx_errno,
+                           ngx_rename_file_n " \"%s\" to \"%V\" failed",
+                           name, &rmcf->program_cache);
+        goto failed;
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, cf->log, 0,
+                  "replace_filter: saved %ui literal automata to \"%V\"",
+                  nentries, &rmcf->program_cache);
+
+    return NGX_OK;
+
+failed:
+
+    if (ngx_delete_file(name) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, ngx_errno,
+                           ngx_delete_file_n " \"%s\" failed", name);
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * Reads the program cache file into the configuration pool and adds its
+ * entries to the program cache. The automata are used in place. A missing,
+ * stale or corrupted file is ignored: the automata are then built from
+ * scratch and the file is rewritten.
+ */
+
+static ngx_int_t
+ngx_http_replace_program_cache_load(ngx_conf_t *cf,
+    ngx_http_replace_main_conf_t *rmcf)
+{
+    u_char                                    *p;
+    size_t                                     size;
+    ssize_t                                    n;
+    ngx_fd_t                                   fd;
+    ngx_err_t                                  err;
+    ngx_uint_t                                 i;
+    ngx_file_info_t                            fi;
+    ngx_http_replace_program_cache_entry_t    *entry;
+    ngx_http_replace_program_cache_header_t   *header;
+
+    fd = ngx_open_file(rmcf->program_cache.data, NGX_FILE_RDONLY,
+                       NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        if (err != NGX_ENOENT) {
+            ngx_conf_log_error(NGX_LOG_WARN, cf, err,
+                               ngx_open_file_n " \"%V\" failed",
+                               &rmcf->program_cache);
+        }
+
+        return NGX_OK;
+    }
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, ngx_errno,
+                           ngx_fd_info_n " \"%V\" failed",
+                           &rmcf->program_cache);
+        (void) ngx_close_file(fd);
+        return NGX_OK;
+    }
+
+    size = (size_t) ngx_file_size(&fi);
+
+    if (size < sizeof(ngx_http_replace_program_cache_header_t)) {
+        (void) ngx_close_file(fd);
+        goto stale;
+    }
+
+    /* aligned for the automata */
+
+    p = ngx_pmemalign(cf->pool, size, 8);
+    if (p == NULL) {
+        (void) ngx_close_file(fd);
+        return NGX_ERROR;
+    }
+
+    n = ngx_read_fd(fd, p, size);
+
+    if (n == -1) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, ngx_errno,
+                           ngx_read_fd_n " \"%V\" failed",
+                           &rmcf->program_cache);
+    }
+
+    (void) ngx_close_file(fd);
+
+    if (n != (ssize_t) size
+        || ngx_http_replace_program_cache_check(p, size) != NGX_OK)
+    {
+        goto stale;
+    }
+
+    header = (ngx_http_replace_program_cache_header_t *) p;
+
+    p += sizeof(ngx_http_replace_program_cache_header_t);
+
+    for (i = 0; i < header->nentries; i++) {
+        entry = (ngx_http_replace_program_cache_entry_t *) p;
+
+        if (ngx_http_replace_program_cache_add(cf, rmcf, p) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        p += entry->size;
+    }
+
+    dd("loaded %d literal automata", (int) header->nentries);
+
+    return NGX_OK;
+
+stale:
+
+    ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0,
+                       "ignoring stale or corrupted program cache \"%V\"",
+                       &rmcf->program_cache);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_replace_program_cache_check(u_char *p, size_t size)
+{
+    u_char                                    *last;
+    size_t                                     len;
+    ngx_uint_t                                 i;
+    ngx_http_replace_program_cache_entry_t    *entry;
+    ngx_http_replace_program_cache_header_t   *header;
+
+    header = (ngx_http_replace_program_cache_header_t *) p;
+
+    if (ngx_memcmp(header->magic, NGX_HTTP_REPLACE_PROGRAM_CACHE_MAGIC, 8)
+           != 0
+        || header->version != NGX_HTTP_REPLACE_PROGRAM_CACHE_VERSION
+        || header->layout != NGX_HTTP_REPLACE_PROGRAM_CACHE_LAYOUT
+        || header->byte_order != 0x01020304
+        || header->size
+           != size - sizeof(ngx_http_replace_program_cache_header_t))
+    {
+        return NGX_DECLINED;
+    }
+
+    last = p + size;
+    p += sizeof(ngx_http_replace_program_cache_header_t);
+
+    if (ngx_crc32_long(p, last - p) != header->crc32) {
+        return NGX_DECLINED;
+    }
+
+    for (i = 0; i < header->nentries; i++) {
+        if ((size_t) (last - p)
+            < sizeof(ngx_http_replace_program_cache_entry_t))
+        {
+            return NGX_DECLINED;
+        }
+
+        entry = (ngx_http_replace_program_cache_entry_t *) p;
+
+        if (entry->nclasses == 0 || entry->nclasses > 256) {
+            return NGX_DECLINED;
+        }
+
+        len = ngx_http_replace_program_cache_entry_size(entry->key_len,
+                                                        entry->nclasses,
+                                                        entry->nstates);
+
+        if (len != entry->size || len > (size_t) (last - p)) {
+            return NGX_DECLINED;
+        }
+
+        p += len;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_replace_program_cache_add(ngx_conf_t *cf,
+    ngx_http_replace_main_conf_t *rmcf, u_char *p)
+{
+    ngx_str_t                                  key;
+    ngx_http_replace_literal_t                *lit;
+    ngx_http_replace_program_t                *prog;
+    ngx_http_replace_program_cache_entry_t    *entry;
+
+    entry = (ngx_http_replace_program_cache_entry_t *) p;
+    p += sizeof(ngx_http_replace_program_cache_entry_t);
+
+    key.data = p;
+    key.len = entry->key_len;
+
+    p += ngx_align(key.len, 8);
+
+    prog = ngx_pcalloc(cf->pool, sizeof(ngx_http_replace_program_t));
+    if (prog == NULL) {
+        return NGX_ERROR;
+    }
+
+    prog->sn.str = key;
+    prog->sn.node.key = ngx_crc32_long(key.data, key.len);
+
+    if (ngx_str_rbtree_lookup(&rmcf->programs, &key, prog->sn.node.key)) {
+        return NGX_OK;
+    }
+
+    lit = ngx_palloc(cf->pool, sizeof(ngx_http_replace_literal_t));
+    if (lit == NULL) {
+        return NGX_ERROR;
+    }
+
+    lit->nclasses = entry->nclasses;
+    lit->nstates = entry->nstates;
+
+    ngx_memcpy(lit->classes, p, 256);
+    p += 256;
+
+    lit->next = (uint32_t *) p;
+    p += ngx_align(entry->nstates * entry->nclasses * sizeof(uint32_t), 8);
+
+    lit->states = (ngx_http_replace_literal_state_t *) p;
+
+    prog->literal = lit;
+    prog->cached = 1;
+
+    ngx_rbtree_insert(&rmcf->programs, &prog->sn.node);
+
+    return NGX_OK;
+}
+
+
+static size_t
+ngx_http_replace_program_cache_entry_size(uint64_t key_len,
+    uint64_t nclasses, uint64_t nstates)
+{
+    uint64_t  len;
+
+    /* computed on 64 bits, so that bogus sizes cannot wrap around */
+
+    len = sizeof(ngx_http_replace_program_cache_entry_t)
+          + ngx_align(key_len, 8)
+          + 256
+          + ngx_align(nstates * nclasses * sizeof(uint32_t), 8)
+          + ngx_align(nstates * sizeof(ngx_http_replace_literal_state_t), 8);
+
+    if (len > NGX_MAX_SIZE_T_VALUE) {
+        return NGX_MAX_SIZE_T_VALUE;
+    }
+
+    return (size_t) len;
+}
+
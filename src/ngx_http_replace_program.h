@@ -0,0 +1,59 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef _NGX_HTTP_REPLACE_PROGRAM_H_INCLUDED_
+#define _NGX_HTTP_REPLACE_PROGRAM_H_INCLUDED_
+
+
+#include "ngx_http_replace_filter_module.h"
+
+
+/*
+ * A compiled rule set shared by all the locations with the same ordered
+ * regexes and flags, along with everything derived from it.
+ */
+
+struct ngx_http_replace_program_s {
+    ngx_str_node_t                  sn;  /* keyed by the regexes and
+                                            their flags */
+
+    ngx_http_replace_program_t     *next;  /* used by this configuration */
+    ngx_uint_t                      nregexes;
+
+    sre_program_t                  *program;
+    sre_program_t                  *capture_program;
+    sre_uint_t                      ncaps;
+    size_t                          ovecsize;
+    size_t                          vm_ovecsize;
+
+    ngx_http_replace_regex_info_t  *regex_info;
+    ngx_http_replace_scan_t        *scan;
+    ngx_http_replace_literal_t     *literal;
+    ngx_int_t                       max_len;
+
+    /* built on demand, by the first location using the engine */
+
+    ngx_http_replace_variants_t    *variants;  /* by rules without "g" */
+    ngx_http_replace_dfa_t         *dfa;
+    sre_vm_thompson_code_t         *jit_code;
+    sre_vm_thompson_exec_pt         jit_handler;
+    void                           *backend_conf;
+
+    unsigned                        restartable:1;
+    unsigned                        cached:1;  /* literal from the file */
+    unsigned                        dfa_done:1;
+    unsigned                        jit_done:1;
+    unsigned                        backend_done:1;
+};
+
+
+ngx_int_t ngx_http_replace_program_get(ngx_conf_t *cf,
+    ngx_http_replace_loc_conf_t *rlcf);
+void ngx_http_replace_program_save(ngx_http_replace_loc_conf_t *rlcf);
+ngx_int_t ngx_http_replace_program_cache_write(ngx_conf_t *cf);
+
+
+#endif /* _NGX_HTTP_REPLACE_PROGRAM_H_INCLUDED_ */
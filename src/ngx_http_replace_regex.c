@@ -0,0 +1,1091 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef DDEBUG
+#define DDEBUG 0
+#endif
+#include "ddebug.h"
+
+
+#include "ngx_http_replace_regex.h"
+
+
+/*
+ * This is NOT a regex engine. It is a small, deliberately conservative
+ * parser for the Perl regex syntax accepted by sregex, used only to derive
+ * static properties of the rules (which bytes can start a match, whether
+ * a rule can match the empty string, how long a match can be, etc).
+ * sregex remains the authority on what the regexes mean: the sources have
+ * already been accepted by sre_regex_parse_multi() when we get here, and
+ * anything we do not fully understand makes the whole regex "opaque".
+ */
+
+
+#define NGX_HTTP_REPLACE_RE_MAX_REPEAT  65535
+
+
+typedef struct {
+    ngx_pool_t          *pool;
+    u_char              *p;
+    int                  flags;
+} ngx_http_replace_re_parser_t;
+
+
+static ngx_http_replace_re_t *ngx_http_replace_re_alt(
+    ngx_http_replace_re_parser_t *rp);
+static ngx_http_replace_re_t *ngx_http_replace_re_cat(
+    ngx_http_replace_re_parser_t *rp);
+static ngx_http_replace_re_t *ngx_http_replace_re_repeat(
+    ngx_http_replace_re_parser_t *rp);
+static ngx_http_replace_re_t *ngx_http_replace_re_atom(
+    ngx_http_replace_re_parser_t *rp);
+static ngx_http_replace_re_t *ngx_http_replace_re_class(
+    ngx_http_replace_re_parser_t *rp);
+static ngx_int_t ngx_http_replace_re_escape(ngx_http_replace_re_parser_t *rp,
+    uint8_t *set, unsigned in_class);
+static ngx_int_t ngx_http_replace_re_number(ngx_http_replace_re_parser_t *rp);
+static ngx_http_replace_re_t *ngx_http_replace_re_new(
+    ngx_http_replace_re_parser_t *rp, ngx_http_replace_re_type_e type);
+static ngx_http_replace_re_t *ngx_http_replace_re_bytes(
+    ngx_http_replace_re_parser_t *rp, uint8_t *set);
+static void ngx_http_replace_re_fold(uint8_t *set);
+static ngx_int_t ngx_http_replace_re_single(uint8_t *set);
+static void ngx_http_replace_re_add_range(uint8_t *set, ngx_uint_t from,
+    ngx_uint_t to);
+static void ngx_http_replace_re_add_class(uint8_t *set, u_char c);
+static void ngx_http_replace_re_walk(ngx_http_replace_re_t *re,
+    uint8_t *first, ngx_uint_t *nullable, ngx_int_t *max_len,
+    ngx_uint_t *assertions);
+static ngx_int_t ngx_http_replace_re_add_len(ngx_int_t a, ngx_int_t b);
+static u_char *ngx_http_replace_re_literal(ngx_http_replace_re_t *re,
+    int flags, u_char *p);
+
+
+ngx_http_replace_re_t *
+ngx_http_replace_regex_parse(ngx_pool_t *pool, u_char *src, int flags)
+{
+    ngx_http_replace_re_t           *re;
+    ngx_http_replace_re_parser_t     rp;
+
+    rp.pool = pool;
+    rp.p = src;
+    rp.flags = flags;
+
+    re = ngx_http_replace_re_alt(&rp);
+    if (re == NULL) {
+        return NULL;
+    }
+
+    if (*rp.p != '\0') {
+        dd("unexpected char at offset %d: %c", (int) (rp.p - src), *rp.p);
+        return NULL;
+    }
+
+    return re;
+}
+
+
+void
+ngx_http_replace_regex_analyze(ngx_http_replace_re_t *re,
+    ngx_http_replace_regex_info_t *info)
+{
+    ngx_int_t        max_len;
+    ngx_uint_t       nullable, assertions;
+
+    ngx_memzero(info, sizeof(ngx_http_replace_regex_info_t));
+
+    if (re == NULL) {
+        ngx_memset(info->first, 0xff, sizeof(info->first));
+        info->max_len = NGX_HTTP_REPLACE_UNBOUNDED;
+        info->nullable = 1;
+        info->assertions = 1;
+        info->opaque = 1;
+        return;
+    }
+
+    nullable = 0;
+    assertions = 0;
+    max_len = 0;
+
+    ngx_http_replace_re_walk(re, info->first, &nullable, &max_len,
+                             &assertions);
+
+    info->max_len = max_len;
+    info->nullable = nullable;
+    info->assertions = assertions;
+}
+
+
+/*
+ * Writes the string matched by a pure literal regex (lowercased when
+ * caseless) to "buf", which must be able to hold info->max_len bytes.
+ * Returns the length, or NGX_DECLINED when the regex is not a literal.
+ */
+
+ngx_int_t
+ngx_http_replace_regex_literal(ngx_http_replace_re_t *re,
+    ngx_http_replace_regex_info_t *info, int flags, u_char *buf)
+{
+    u_char          *p;
+
+    if (re == NULL || info->opaque || info->nullable || info->assertions
+        || info->max_len == NGX_HTTP_REPLACE_UNBOUNDED)
+    {
+        return NGX_DECLINED;
+    }
+
+    p = ngx_http_replace_re_literal(re, flags, buf);
+    if (p == NULL) {
+        return NGX_DECLINED;
+    }
+
+    return p - buf;
+}
+
+
+/*
+ * Copies a regex that is not opaque, turning every capturing group into a
+ * non-capturing one. This changes neither what the regex matches nor the
+ * priorities between the alternatives.
+ */
+
+u_char *
+ngx_http_replace_regex_strip_captures(ngx_pool_t *pool, u_char *src)
+{
+    u_char          c, *p, *dst;
+    ngx_uint_t      in_class;
+
+    /* "(" may become "(?:" */
+
+    dst = ngx_pnalloc(pool, 3 * ngx_strlen(src) + 1);
+    if (dst == NULL) {
+        return NULL;
+    }
+
+    p = dst;
+    in_class = 0;
+
+    while (*src) {
+        c = *src++;
+        *p++ = c;
+
+        if (c == '\\') {
+            if (*src == 'c' && src[1] != '\0') {
+                /* "\cX" */
+                *p++ = *src++;
+            }
+
+            if (*src != '\0') {
+                *p++ = *src++;
+            }
+
+            continue;
+        }
+
+        if (in_class) {
+            if (c == ']') {
+                in_class = 0;
+            }
+
+            continue;
+        }
+
+        switch (c) {
+
+        case '[':
+            in_class = 1;
+
+            if (*src == '^') {
+                *p++ = *src++;
+            }
+
+            /* a leading "]" is a literal */
+
+            if (*src == ']') {
+                *p++ = *src++;
+            }
+
+            break;
+
+        case '(':
+            if (*src != '?') {
+                *p++ = '?';
+                *p++ = ':';
+            }
+
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    *p = '\0';
+
+    return dst;
+}
+
+
+static ngx_http_replace_re_t *
+ngx_http_replace_re_alt(ngx_http_replace_re_parser_t *rp)
+{
+    ngx_http_replace_re_t       *re, *alt;
+
+    re = ngx_http_replace_re_cat(rp);
+    if (re == NULL) {
+        return NULL;
+    }
+
+    while (*rp->p == '|') {
+        rp->p++;
+
+        alt = ngx_http_replace_re_new(rp, NGX_HTTP_REPLACE_RE_ALT);
+        if (alt == NULL) {
+            return NULL;
+        }
+
+        alt->x = re;
+        alt->y = ngx_http_replace_re_cat(rp);
+        if (alt->y == NULL) {
+            return NULL;
+        }
+
+        re = alt;
+    }
+
+    return re;
+}
+
+
+static ngx_http_replace_re_t *
+ngx_http_replace_re_cat(ngx_http_replace_re_parser_t *rp)
+{
+    ngx_http_replace_re_t       *re, *cat, *next;
+
+    re = NULL;
+
+    while (*rp->p != '\0' && *rp->p != '|' && *rp->p != ')') {
+
+        next = ngx_http_replace_re_repeat(rp);
+        if (next == NULL) {
+            return NULL;
+        }
+
+        if (re == NULL) {
+            re = next;
+            continue;
+        }
+
+        cat = ngx_http_replace_re_new(rp, NGX_HTTP_REPLACE_RE_CAT);
+        if (cat == NULL) {
+            return NULL;
+        }
+
+        cat->x = re;
+        cat->y = next;
+        re = cat;
+    }
+
+    if (re == NULL) {
+        return ngx_http_replace_re_new(rp, NGX_HTTP_REPLACE_RE_EMPTY);
+    }
+
+    return re;
+}
+
+
+static ngx_http_replace_re_t *
+ngx_http_replace_re_repeat(ngx_http_replace_re_parser_t *rp)
+{
+    ngx_int_t                    min, max;
+    ngx_http_replace_re_t       *re, *rep;
+
+    re = ngx_http_replace_re_atom(rp);
+    if (re == NULL) {
+        return NULL;
+    }
+
+    for ( ;; ) {
+
+        switch (*rp->p) {
+
+        case '*':
+            min = 0;
+            max = NGX_HTTP_REPLACE_UNBOUNDED;
+            rp->p++;
+            break;
+
+        case '+':
+            min = 1;
+            max = NGX_HTTP_REPLACE_UNBOUNDED;
+            rp->p++;
+            break;
+
+        case '?':
+            min = 0;
+            max = 1;
+            rp->p++;
+            break;
+
+        case '{':
+            rp->p++;
+
+            min = ngx_http_replace_re_number(rp);
+            if (min == NGX_ERROR) {
+                return NULL;
+            }
+
+            if (*rp->p == '}') {
+                max = min;
+
+            } else if (*rp->p == ',') {
+                rp->p++;
+
+                if (*rp->p == '}') {
+                    max = NGX_HTTP_REPLACE_UNBOUNDED;
+
+                } else {
+                    max = ngx_http_replace_re_number(rp);
+                    if (max == NGX_ERROR || max < min || *rp->p != '}') {
+                        return NULL;
+                    }
+                }
+
+            } else {
+                return NULL;
+            }
+
+            rp->p++;
+            break;
+
+        default:
+            return re;
+        }
+
+        if (re->type == NGX_HTTP_REPLACE_RE_ASSERT
+            || re->type == NGX_HTTP_REPLACE_RE_EMPTY)
+        {
+            return NULL;
+        }
+
+        rep = ngx_http_replace_re_new(rp, NGX_HTTP_REPLACE_RE_REPEAT);
+        if (rep == NULL) {
+            return NULL;
+        }
+
+        rep->x = re;
+        rep->min = min;
+        rep->max = max;
+        rep->greedy = 1;
+
+        if (*rp->p == '?') {
+            rep->greedy = 0;
+            rp->p++;
+
+        } else if (*rp->p == '+') {
+            /* possessive quantifiers */
+            return NULL;
+        }
+
+        re = rep;
+    }
+}
+
+
+static ngx_http_replace_re_t *
+ngx_http_replace_re_atom(ngx_http_replace_re_parser_t *rp)
+{
+    u_char                       c;
+    uint8_t                      set[32];
+    ngx_int_t                    rc;
+    ngx_http_replace_re_t       *re;
+
+    c = *rp->p;
+
+    switch (c) {
+
+    case '(':
+        rp->p++;
+
+        re = ngx_http_replace_re_new(rp, NGX_HTTP_REPLACE_RE_GROUP);
+        if (re == NULL) {
+            return NULL;
+        }
+
+        if (*rp->p == '?') {
+            if (rp->p[1] != ':') {
+                /* look-arounds, inline flags, named groups, etc */
+                return NULL;
+            }
+
+            rp->p += 2;
+
+        } else {
+            re->capture = 1;
+        }
+
+        re->x = ngx_http_replace_re_alt(rp);
+        if (re->x == NULL) {
+            return NULL;
+        }
+
+        if (*rp->p != ')') {
+            return NULL;
+        }
+
+        rp->p++;
+        return re;
+
+    case '[':
+        rp->p++;
+        return ngx_http_replace_re_class(rp);
+
+    case '.':
+        rp->p++;
+
+        /* over-approximated: we do not care whether "." matches "\n" */
+        ngx_memset(set, 0xff, sizeof(set));
+        return ngx_http_replace_re_bytes(rp, set);
+
+    case '^':
+    case '$':
+        rp->p++;
+        return ngx_http_replace_re_new(rp, NGX_HTTP_REPLACE_RE_ASSERT);
+
+    case '\\':
+        rp->p++;
+
+        ngx_memzero(set, sizeof(set));
+
+        rc = ngx_http_replace_re_escape(rp, set, 0);
+
+        if (rc == NGX_DONE) {
+            return ngx_http_replace_re_new(rp, NGX_HTTP_REPLACE_RE_ASSERT);
+        }
+
+        if (rc != NGX_OK) {
+            return NULL;
+        }
+
+        return ngx_http_replace_re_bytes(rp, set);
+
+    case '*':
+    case '+':
+    case '?':
+    case '{':
+    case '\0':
+        return NULL;
+
+    default:
+        rp->p++;
+
+        ngx_memzero(set, sizeof(set));
+        ngx_http_replace_bitmap_set(set, c);
+
+        return ngx_http_replace_re_bytes(rp, set);
+    }
+}
+
+
+static ngx_http_replace_re_t *
+ngx_http_replace_re_class(ngx_http_replace_re_parser_t *rp)
+{
+    u_char               c;
+    uint8_t              set[32], item[32];
+    ngx_int_t            rc, from;
+    ngx_uint_t           i, negated, first;
+
+    ngx_memzero(set, sizeof(set));
+
+    negated = 0;
+
+    if (*rp->p == '^') {
+        negated = 1;
+        rp->p++;
+    }
+
+    /* from is the last single byte seen, for ranges like a-z */
+    from = -1;
+
+    for (first = 1; /* void */; first = 0) {
+
+        c = *rp->p;
+
+        if (c == '\0') {
+            return NULL;
+        }
+
+        if (c == ']' && !first) {
+            rp->p++;
+            break;
+        }
+
+        if (c == '[' && rp->p[1] == ':') {
+            /* POSIX classes */
+            return NULL;
+        }
+
+        if (c == '-' && from >= 0 && rp->p[1] != ']') {
+            rp->p++;
+
+            c = *rp->p;
+
+            if (c == '\\') {
+                rp->p++;
+
+                ngx_memzero(item, sizeof(item));
+
+                if (ngx_http_replace_re_escape(rp, item, 1) != NGX_OK) {
+                    return NULL;
+                }
+
+                /* the range end must be a single byte */
+
+                rc = ngx_http_replace_re_single(item);
+                if (rc < 0) {
+                    return NULL;
+                }
+
+                c = (u_char) rc;
+
+            } else {
+                rp->p++;
+            }
+
+            if (c < from) {
+                return NULL;
+            }
+
+            ngx_http_replace_re_add_range(set, from, c);
+
+            from = -1;
+            continue;
+        }
+
+        if (c == '\\') {
+            rp->p++;
+
+            ngx_memzero(item, sizeof(item));
+
+            if (ngx_http_replace_re_escape(rp, item, 1) != NGX_OK) {
+                return NULL;
+            }
+
+            /* multi-byte sets like \d cannot start a range */
+            from = ngx_http_replace_re_single(item);
+
+            for (i = 0; i < sizeof(set); i++) {
+                set[i] |= item[i];
+            }
+
+            continue;
+        }
+
+        rp->p++;
+
+        ngx_http_replace_bitmap_set(set, c);
+        from = c;
+    }
+
+    if (rp->flags & SRE_REGEX_CASELESS) {
+        /* fold before negating, like Perl does */
+        ngx_http_replace_re_fold(set);
+    }
+
+    if (negated) {
+        for (i = 0; i < sizeof(set); i++) {
+            set[i] = (uint8_t) ~set[i];
+        }
+    }
+
+    return ngx_http_replace_re_bytes(rp, set);
+}
+
+
+/*
+ * Returns NGX_OK when the escape sequence denotes a set of bytes (added to
+ * "set"), NGX_DONE when it is a zero-width assertion, and NGX_DECLINED when
+ * we do not understand it.
+ */
+
+static ngx_int_t
+ngx_http_replace_re_escape(ngx_http_replace_re_parser_t *rp, uint8_t *set,
+    unsigned in_class)
+{
+    u_char          c;
+    ngx_uint_t      i, n;
+
+    c = *rp->p;
+
+    if (c == '\0') {
+        return NGX_DECLINED;
+    }
+
+    rp->p++;
+
+    switch (c) {
+
+    case 'd':
+    case 'D':
+    case 'w':
+    case 'W':
+    case 's':
+    case 'S':
+        ngx_http_replace_re_add_class(set, c);
+        return NGX_OK;
+
+    case 't':
+        c = '\t';
+        break;
+
+    case 'n':
+        c = '\n';
+        break;
+
+    case 'r':
+        c = '\r';
+        break;
+
+    case 'f':
+        c = '\f';
+        break;
+
+    case 'e':
+        c = '\033';
+        break;
+
+    case 'a':
+        c = '\007';
+        break;
+
+    case 'b':
+        if (!in_class) {
+            return NGX_DONE;
+        }
+
+        c = '\b';
+        break;
+
+    case 'B':
+    case 'A':
+    case 'z':
+    case 'Z':
+    case 'G':
+        if (in_class) {
+            return NGX_DECLINED;
+        }
+
+        return NGX_DONE;
+
+    case 'c':
+        c = *rp->p;
+
+        if (c == '\0') {
+            return NGX_DECLINED;
+        }
+
+        rp->p++;
+        c = ngx_toupper(c) ^ 0x40;
+        break;
+
+    case 'x':
+        n = 0;
+
+        for (i = 0; i < 2; i++) {
+            c = *rp->p;
+
+            if (c >= '0' && c <= '9') {
+                n = n * 16 + c - '0';
+
+            } else {
+                c = (u_char) (c | 0x20);
+
+                if (c >= 'a' && c <= 'f') {
+                    n = n * 16 + c - 'a' + 10;
+
+                } else {
+                    break;
+                }
+            }
+
+            rp->p++;
+        }
+
+        if (i == 0) {
+            /* "\x{...}" and friends */
+            return NGX_DECLINED;
+        }
+
+        c = (u_char) n;
+        break;
+
+    case '0':
+        n = 0;
+
+        for (i = 0; i < 2; i++) {
+            c = *rp->p;
+
+            if (c < '0' || c > '7') {
+                break;
+            }
+
+            n = n * 8 + c - '0';
+            rp->p++;
+        }
+
+        c = (u_char) n;
+        break;
+
+    default:
+        if ((c >= 'a' && c <= 'z')
+            || (c >= 'A' && c <= 'Z')
+            || (c >= '1' && c <= '9'))
+        {
+            /* back-references, \h, \v, \N, \p, \Q, etc */
+            return NGX_DECLINED;
+        }
+
+        /* an escaped meta character */
+        break;
+    }
+
+    ngx_http_replace_bitmap_set(set, c);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_replace_re_number(ngx_http_replace_re_parser_t *rp)
+{
+    ngx_int_t       n;
+
+    if (*rp->p < '0' || *rp->p > '9') {
+        return NGX_ERROR;
+    }
+
+    n = 0;
+
+    while (*rp->p >= '0' && *rp->p <= '9') {
+        n = n * 10 + *rp->p - '0';
+
+        if (n > NGX_HTTP_REPLACE_RE_MAX_REPEAT) {
+            return NGX_ERROR;
+        }
+
+        rp->p++;
+    }
+
+    return n;
+}
+
+
+static ngx_http_replace_re_t *
+ngx_http_replace_re_new(ngx_http_replace_re_parser_t *rp,
+    ngx_http_replace_re_type_e type)
+{
+    ngx_http_replace_re_t       *re;
+
+    re = ngx_pcalloc(rp->pool, sizeof(ngx_http_replace_re_t));
+    if (re == NULL) {
+        return NULL;
+    }
+
+    re->type = type;
+
+    return re;
+}
+
+
+static ngx_http_replace_re_t *
+ngx_http_replace_re_bytes(ngx_http_replace_re_parser_t *rp, uint8_t *set)
+{
+    ngx_http_replace_re_t       *re;
+
+    re = ngx_http_replace_re_new(rp, NGX_HTTP_REPLACE_RE_BYTES);
+    if (re == NULL) {
+        return NULL;
+    }
+
+    re->set = ngx_palloc(rp->pool, 32);
+    if (re->set == NULL) {
+        return NULL;
+    }
+
+    ngx_memcpy(re->set, set, 32);
+
+    if (rp->flags & SRE_REGEX_CASELESS) {
+        ngx_http_replace_re_fold(re->set);
+    }
+
+    return re;
+}
+
+
+static void
+ngx_http_replace_re_fold(uint8_t *set)
+{
+    ngx_uint_t      c;
+
+    for (c = 'a'; c <= 'z'; c++) {
+        if (ngx_http_replace_bitmap_test(set, c)
+            || ngx_http_replace_bitmap_test(set, c - 0x20))
+        {
+            ngx_http_replace_bitmap_set(set, c);
+            ngx_http_replace_bitmap_set(set, c - 0x20);
+        }
+    }
+}
+
+
+/* returns the only byte in the set, or -1 */
+
+static ngx_int_t
+ngx_http_replace_re_single(uint8_t *set)
+{
+    ngx_int_t       c;
+    ngx_uint_t      i;
+
+    c = -1;
+
+    for (i = 0; i < 256; i++) {
+        if (ngx_http_replace_bitmap_test(set, i)) {
+            if (c != -1) {
+                return -1;
+            }
+
+            c = i;
+        }
+    }
+
+    return c;
+}
+
+
+static void
+ngx_http_replace_re_add_range(uint8_t *set, ngx_uint_t from, ngx_uint_t to)
+{
+    ngx_uint_t      c;
+
+    for (c = from; c <= to; c++) {
+        ngx_http_replace_bitmap_set(set, c);
+    }
+}
+
+
+static void
+ngx_http_replace_re_add_class(uint8_t *set, u_char c)
+{
+    uint8_t         class[32];
+    ngx_uint_t      i;
+
+    ngx_memzero(class, sizeof(class));
+
+    switch (c | 0x20) {
+
+    case 'd':
+        ngx_http_replace_re_add_range(class, '0', '9');
+        break;
+
+    case 'w':
+        ngx_http_replace_re_add_range(class, '0', '9');
+        ngx_http_replace_re_add_range(class, 'a', 'z');
+        ngx_http_replace_re_add_range(class, 'A', 'Z');
+        ngx_http_replace_bitmap_set(class, '_');
+        break;
+
+    default: /* 's' */
+        ngx_http_replace_bitmap_set(class, ' ');
+        ngx_http_replace_re_add_range(class, '\t', '\r');
+        break;
+    }
+
+    for (i = 0; i < sizeof(class); i++) {
+        set[i] |= (c >= 'a') ? class[i] : (uint8_t) ~class[i];
+    }
+}
+
+
+static void
+ngx_http_replace_re_walk(ngx_http_replace_re_t *re, uint8_t *first,
+    ngx_uint_t *nullable, ngx_int_t *max_len, ngx_uint_t *assertions)
+{
+    uint8_t          fy[32];
+    ngx_int_t        mx, my;
+    ngx_uint_t       i, nx, ny;
+
+    switch (re->type) {
+
+    case NGX_HTTP_REPLACE_RE_EMPTY:
+        *nullable = 1;
+        *max_len = 0;
+        return;
+
+    case NGX_HTTP_REPLACE_RE_ASSERT:
+        *nullable = 1;
+        *max_len = 0;
+        *assertions = 1;
+        return;
+
+    case NGX_HTTP_REPLACE_RE_BYTES:
+        for (i = 0; i < 32; i++) {
+            first[i] |= re->set[i];
+        }
+
+        *nullable = 0;
+        *max_len = 1;
+        return;
+
+    case NGX_HTTP_REPLACE_RE_GROUP:
+        ngx_http_replace_re_walk(re->x, first, nullable, max_len, assertions);
+        return;
+
+    case NGX_HTTP_REPLACE_RE_CAT:
+        nx = 0;
+        ny = 0;
+        mx = 0;
+        my = 0;
+
+        ngx_memzero(fy, sizeof(fy));
+
+        ngx_http_replace_re_walk(re->x, first, &nx, &mx, assertions);
+        ngx_http_replace_re_walk(re->y, fy, &ny, &my, assertions);
+
+        if (nx) {
+            for (i = 0; i < 32; i++) {
+                first[i] |= fy[i];
+            }
+        }
+
+        *nullable = nx && ny;
+        *max_len = ngx_http_replace_re_add_len(mx, my);
+        return;
+
+    case NGX_HTTP_REPLACE_RE_ALT:
+        nx = 0;
+        ny = 0;
+        mx = 0;
+        my = 0;
+
+        ngx_http_replace_re_walk(re->x, first, &nx, &mx, assertions);
+        ngx_http_replace_re_walk(re->y, first, &ny, &my, assertions);
+
+        *nullable = nx || ny;
+
+        if (mx == NGX_HTTP_REPLACE_UNBOUNDED
+            || my == NGX_HTTP_REPLACE_UNBOUNDED)
+        {
+            *max_len = NGX_HTTP_REPLACE_UNBOUNDED;
+
+        } else {
+            *max_len = ngx_max(mx, my);
+        }
+
+        return;
+
+    default: /* NGX_HTTP_REPLACE_RE_REPEAT */
+        nx = 0;
+        mx = 0;
+
+        if (re->max == 0) {
+            /* x{0} only matches the empty string */
+            ngx_memzero(fy, sizeof(fy));
+            ngx_http_replace_re_walk(re->x, fy, &nx, &mx, assertions);
+
+            *nullable = 1;
+            *max_len = 0;
+            return;
+        }
+
+        ngx_http_replace_re_walk(re->x, first, &nx, &mx, assertions);
+
+        *nullable = (re->min == 0 || nx);
+
+        if (mx == 0) {
+            *max_len = 0;
+
+        } else if (mx == NGX_HTTP_REPLACE_UNBOUNDED
+                   || re->max == NGX_HTTP_REPLACE_UNBOUNDED
+                   || mx > NGX_MAX_INT_T_VALUE / 2 / re->max)
+        {
+            *max_len = NGX_HTTP_REPLACE_UNBOUNDED;
+
+        } else {
+            *max_len = mx * re->max;
+        }
+
+        return;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_replace_re_add_len(ngx_int_t a, ngx_int_t b)
+{
+    if (a == NGX_HTTP_REPLACE_UNBOUNDED
+        || b == NGX_HTTP_REPLACE_UNBOUNDED
+        || a > NGX_MAX_INT_T_VALUE / 2 - b)
+    {
+        return NGX_HTTP_REPLACE_UNBOUNDED;
+    }
+
+    return a + b;
+}
+
+
+static u_char *
+ngx_http_replace_re_literal(ngx_http_replace_re_t *re, int flags, u_char *p)
+{
+    ngx_int_t        c;
+    uint8_t          set[32];
+
+    switch (re->type) {
+
+    case NGX_HTTP_REPLACE_RE_CAT:
+        p = ngx_http_replace_re_literal(re->x, flags, p);
+        if (p == NULL) {
+            return NULL;
+        }
+
+        return ngx_http_replace_re_literal(re->y, flags, p);
+
+    case NGX_HTTP_REPLACE_RE_GROUP:
+        if (re->capture) {
+            return NULL;
+        }
+
+        return ngx_http_replace_re_literal(re->x, flags, p);
+
+    case NGX_HTTP_REPLACE_RE_BYTES:
+        c = ngx_http_replace_re_single(re->set);
+
+        if (c == -1 && (flags & SRE_REGEX_CASELESS)) {
+            /* a letter folded into its two cases */
+
+            ngx_memcpy(set, re->set, sizeof(set));
+
+            for (c = 'A'; c <= 'Z'; c++) {
+                set[c >> 3] &= (uint8_t) ~(1 << (c & 7));
+            }
+
+            c = ngx_http_replace_re_single(set);
+
+            if (c < 'a' || c > 'z') {
+                return NULL;
+            }
+        }
+
+        if (c == -1) {
+            return NULL;
+        }
+
+        *p++ = (u_char) ((flags & SRE_REGEX_CASELESS) ? ngx_tolower(c) : c);
+        return p;
+
+    default:
+        return NULL;
+    }
+}
@@ -0,0 +1,83 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef _NGX_HTTP_REPLACE_REGEX_H_INCLUDED_
+#define _NGX_HTTP_REPLACE_REGEX_H_INCLUDED_
+
+
+#include <nginx.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <sregex/sregex.h>
+
+
+#define NGX_HTTP_REPLACE_UNBOUNDED  -1
+
+
+typedef enum {
+    NGX_HTTP_REPLACE_RE_EMPTY = 0,
+    NGX_HTTP_REPLACE_RE_BYTES,
+    NGX_HTTP_REPLACE_RE_CAT,
+    NGX_HTTP_REPLACE_RE_ALT,
+    NGX_HTTP_REPLACE_RE_REPEAT,
+    NGX_HTTP_REPLACE_RE_GROUP,
+    NGX_HTTP_REPLACE_RE_ASSERT
+} ngx_http_replace_re_type_e;
+
+
+typedef struct ngx_http_replace_re_s  ngx_http_replace_re_t;
+
+struct ngx_http_replace_re_s {
+    ngx_http_replace_re_type_e      type;
+
+    ngx_http_replace_re_t          *x;
+    ngx_http_replace_re_t          *y;
+
+    uint8_t                        *set;  /* 256-bit map for RE_BYTES */
+
+    ngx_int_t                       min;
+    ngx_int_t                       max;  /* NGX_HTTP_REPLACE_UNBOUNDED */
+
+    unsigned                        greedy:1;
+    unsigned                        capture:1;
+};
+
+
+/*
+ * A conservative summary of a single regex. Whenever the analyzer does not
+ * fully understand a construct the regex is marked "opaque" and every
+ * field takes its safest value, so callers may always trust the result.
+ */
+
+typedef struct {
+    uint8_t                         first[32];  /* bytes that can start
+                                                   a match */
+    ngx_int_t                       max_len;
+
+    unsigned                        nullable:1;
+    unsigned                        assertions:1;
+    unsigned                        opaque:1;
+} ngx_http_replace_regex_info_t;
+
+
+#define ngx_http_replace_bitmap_test(map, c)                                 \
+    ((map)[(c) >> 3] & (1 << ((c) & 7)))
+
+#define ngx_http_replace_bitmap_set(map, c)                                  \
+    (map)[(c) >> 3] |= (uint8_t) (1 << ((c) & 7))
+
+
+ngx_http_replace_re_t *ngx_http_replace_regex_parse(ngx_pool_t *pool,
+    u_char *src, int flags);
+void ngx_http_replace_regex_analyze(ngx_http_replace_re_t *re,
+    ngx_http_replace_regex_info_t *info);
+ngx_int_t ngx_http_replace_regex_literal(ngx_http_replace_re_t *re,
+    ngx_http_replace_regex_info_t *info, int flags, u_char *buf);
+u_char *ngx_http_replace_regex_strip_captures(ngx_pool_t *pool,
+    u_char *src);
+
+
+#endif /* _NGX_HTTP_REPLACE_REGEX_H_INCLUDED_ */
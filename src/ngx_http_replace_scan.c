@@ -0,0 +1,230 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef DDEBUG
+#define DDEBUG 0
+#endif
+#include "ddebug.h"
+
+
+#include "ngx_http_replace_scan.h"
+#include "ngx_http_replace_regex.h"
+
+
+#if (defined __SSE2__ && (defined __x86_64__ || defined __i386__)         \
+     && (defined __clang__                                                \
+         || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+
+#define NGX_HTTP_REPLACE_HAVE_SSE2  1
+#define NGX_HTTP_REPLACE_HAVE_AVX2  1
+
+#include <immintrin.h>
+
+#endif
+
+
+static u_char *ngx_http_replace_scan_none(ngx_http_replace_scan_t *scan,
+    u_char *p, u_char *last);
+static u_char *ngx_http_replace_scan_byte(ngx_http_replace_scan_t *scan,
+    u_char *p, u_char *last);
+static u_char *ngx_http_replace_scan_table(ngx_http_replace_scan_t *scan,
+    u_char *p, u_char *last);
+#if (NGX_HTTP_REPLACE_HAVE_SSE2)
+static u_char *ngx_http_replace_scan_sse2(ngx_http_replace_scan_t *scan,
+    u_char *p, u_char *last);
+#endif
+#if (NGX_HTTP_REPLACE_HAVE_AVX2)
+static u_char *ngx_http_replace_scan_avx2(ngx_http_replace_scan_t *scan,
+    u_char *p, u_char *last);
+#endif
+
+
+void
+ngx_http_replace_scan_init(ngx_http_replace_scan_t *scan, uint8_t *set)
+{
+    ngx_uint_t      c;
+
+    ngx_memzero(scan, sizeof(ngx_http_replace_scan_t));
+
+    for (c = 0; c < 256; c++) {
+        if (!ngx_http_replace_bitmap_test(set, c)) {
+            continue;
+        }
+
+        scan->map[c] = 1;
+
+        if (scan->nbytes < NGX_HTTP_REPLACE_SCAN_MAX_BYTES) {
+            scan->bytes[scan->nbytes] = (u_char) c;
+        }
+
+        scan->nbytes++;
+    }
+
+    if (scan->nbytes == 0) {
+        scan->handler = ngx_http_replace_scan_none;
+        return;
+    }
+
+    if (scan->nbytes == 1) {
+        scan->handler = ngx_http_replace_scan_byte;
+        return;
+    }
+
+    scan->handler = ngx_http_replace_scan_table;
+
+    if (scan->nbytes > NGX_HTTP_REPLACE_SCAN_MAX_BYTES) {
+        return;
+    }
+
+#if (NGX_HTTP_REPLACE_HAVE_SSE2)
+    scan->handler = ngx_http_replace_scan_sse2;
+#endif
+
+#if (NGX_HTTP_REPLACE_HAVE_AVX2)
+    if (__builtin_cpu_supports("avx2")) {
+        scan->handler = ngx_http_replace_scan_avx2;
+    }
+#endif
+
+    dd("scan handler for %d bytes: %p", (int) scan->nbytes, scan->handler);
+}
+
+
+static u_char *
+ngx_http_replace_scan_none(ngx_http_replace_scan_t *scan, u_char *p,
+    u_char *last)
+{
+    return last;
+}
+
+
+static u_char *
+ngx_http_replace_scan_byte(ngx_http_replace_scan_t *scan, u_char *p,
+    u_char *last)
+{
+    p = memchr(p, scan->bytes[0], last - p);
+
+    return p ? p : last;
+}
+
+
+static u_char *
+ngx_http_replace_scan_table(ngx_http_replace_scan_t *scan, u_char *p,
+    u_char *last)
+{
+    uint8_t     *map = scan->map;
+
+    while (last - p >= 4) {
+        if (map[p[0]]) {
+            return p;
+        }
+
+        if (map[p[1]]) {
+            return p + 1;
+        }
+
+        if (map[p[2]]) {
+            return p + 2;
+        }
+
+        if (map[p[3]]) {
+            return p + 3;
+        }
+
+        p += 4;
+    }
+
+    while (p < last) {
+        if (map[*p]) {
+            return p;
+        }
+
+        p++;
+    }
+
+    return last;
+}
+
+
+#if (NGX_HTTP_REPLACE_HAVE_SSE2)
+
+static u_char *
+ngx_http_replace_scan_sse2(ngx_http_replace_scan_t *scan, u_char *p,
+    u_char *last)
+{
+    unsigned        mask;
+    __m128i         v, m, needles[NGX_HTTP_REPLACE_SCAN_MAX_BYTES];
+    ngx_uint_t      i, n;
+
+    n = scan->nbytes;
+
+    for (i = 0; i < n; i++) {
+        needles[i] = _mm_set1_epi8((char) scan->bytes[i]);
+    }
+
+    while (last - p >= 16) {
+        v = _mm_loadu_si128((const __m128i *) p);
+
+        m = _mm_cmpeq_epi8(v, needles[0]);
+
+        for (i = 1; i < n; i++) {
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(v, needles[i]));
+        }
+
+        mask = (unsigned) _mm_movemask_epi8(m);
+
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+
+    return ngx_http_replace_scan_table(scan, p, last);
+}
+
+#endif
+
+
+#if (NGX_HTTP_REPLACE_HAVE_AVX2)
+
+__attribute__ ((target ("avx2")))
+static u_char *
+ngx_http_replace_scan_avx2(ngx_http_replace_scan_t *scan, u_char *p,
+    u_char *last)
+{
+    unsigned        mask;
+    __m256i         v, m, needles[NGX_HTTP_REPLACE_SCAN_MAX_BYTES];
+    ngx_uint_t      i, n;
+
+    n = scan->nbytes;
+
+    for (i = 0; i < n; i++) {
+        needles[i] = _mm256_set1_epi8((char) scan->bytes[i]);
+    }
+
+    while (last - p >= 32) {
+        v = _mm256_loadu_si256((const __m256i *) p);
+
+        m = _mm256_cmpeq_epi8(v, needles[0]);
+
+        for (i = 1; i < n; i++) {
+            m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, needles[i]));
+        }
+
+        mask = (unsigned) _mm256_movemask_epi8(m);
+
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 32;
+    }
+
+    return ngx_http_replace_scan_sse2(scan, p, last);
+}
+
+#endif
@@ -0,0 +1,44 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef _NGX_HTTP_REPLACE_SCAN_H_INCLUDED_
+#define _NGX_HTTP_REPLACE_SCAN_H_INCLUDED_
+
+
+#include <nginx.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+#define NGX_HTTP_REPLACE_SCAN_MAX_BYTES  8
+
+
+typedef struct ngx_http_replace_scan_s  ngx_http_replace_scan_t;
+
+typedef u_char *(*ngx_http_replace_scan_pt)(ngx_http_replace_scan_t *scan,
+    u_char *p, u_char *last);
+
+
+struct ngx_http_replace_scan_s {
+    ngx_http_replace_scan_pt    handler;
+
+    ngx_uint_t                  nbytes;
+    u_char                      bytes[NGX_HTTP_REPLACE_SCAN_MAX_BYTES];
+
+    uint8_t                     map[256];
+};
+
+
+void ngx_http_replace_scan_init(ngx_http_replace_scan_t *scan,
+    uint8_t *set);
+
+
+/* returns the first byte in [p, last) that is in the set, or last */
+#define ngx_http_replace_scan(scan, p, last)                                 \
+    (scan)->handler(scan, p, last)
+
+
+#endif /* _NGX_HTTP_REPLACE_SCAN_H_INCLUDED_ */
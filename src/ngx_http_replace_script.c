@@ -61,6 +61,7 @@ ngx_http_replace_compile_complex_value(
     ccv->complex_value->value = *v;
     ccv->complex_value->lengths = NULL;
     ccv->complex_value->values = NULL;
+    ccv->complex_value->nginx_variables = ngxvars;
 
     if (capvars == 0 && ngxvars == 0) {
         return NGX_OK;
@@ -105,6 +106,13 @@ ngx_http_replace_compile_complex_value(
     ccv->complex_value->lengths = lengths.elts;
     ccv->complex_value->values = values.elts;
     ccv->complex_value->capture_variables = sc.capture_variables;
+    ccv->complex_value->group_variables = sc.group_variables;
+
+    if ((v->len == 2 && ngx_strncmp(v->data, "$&", 2) == 0)
+        || (v->len == 4 && ngx_strncmp(v->data, "${&}", 4) == 0))
+    {
+        ccv->complex_value->verbatim = 1;
+    }
 
     return NGX_OK;
 }
@@ -281,6 +289,10 @@ ngx_http_replace_script_compile(ngx_http_replace_script_compile_t *sc)
 
                 sc->capture_variables++;
 
+                if (n > 0) {
+                    sc->group_variables++;
+                }
+
                 if (ngx_http_replace_script_add_capture_code(sc, n) != NGX_OK) {
                     return NGX_ERROR;
                 }
@@ -23,6 +23,8 @@ typedef struct {
     ngx_array_t               **values;
 
     ngx_uint_t                  capture_variables;  /* captures $1, $2, etc */
+    ngx_uint_t                  group_variables;  /* the captures other
+                                                     than $& */
     ngx_uint_t                  nginx_variables;  /* nginx variables */
     ngx_uint_t                  size;
 } ngx_http_replace_script_compile_t;
@@ -33,6 +35,10 @@ typedef struct {
     void                       *lengths;
     void                       *values;
     ngx_uint_t                  capture_variables;
+    ngx_uint_t                  group_variables;
+    ngx_uint_t                  nginx_variables;
+
+    unsigned                    verbatim:1;  /* just "$&" */
 } ngx_http_replace_complex_value_t;
 
 
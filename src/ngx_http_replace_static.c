@@ -0,0 +1,311 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef DDEBUG
+#define DDEBUG 0
+#endif
+#include "ddebug.h"
+
+
+#include "ngx_http_replace_static.h"
+
+
+static ngx_int_t ngx_http_replace_static_commit(ngx_http_request_t *r,
+    ngx_http_replace_static_t *st);
+
+
+/*
+ * A content phase handler in the spirit of gzip_static: sends the sidecar
+ * file of the requested static file when it exists, and declines
+ * otherwise, so that the static module sends the file and the filter
+ * writes the sidecar along the way.
+ */
+
+ngx_int_t
+ngx_http_replace_static_handler(ngx_http_request_t *r)
+{
+    u_char                       *p, *last;
+    size_t                        root;
+    ngx_int_t                     rc;
+    ngx_str_t                     path, skip;
+    ngx_buf_t                    *b;
+    ngx_path_t                   *sp;
+    ngx_chain_t                   out;
+    ngx_open_file_info_t          of, sof;
+    ngx_http_core_loc_conf_t     *clcf;
+    ngx_http_replace_ctx_t       *ctx;
+    ngx_http_replace_static_t    *st;
+    ngx_http_replace_loc_conf_t  *rlcf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_DECLINED;
+    }
+
+    if (r->uri.data[r->uri.len - 1] == '/') {
+        return NGX_DECLINED;
+    }
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_replace_filter_module);
+
+    if (!rlcf->static_files || rlcf->regexes.nelts == 0) {
+        return NGX_DECLINED;
+    }
+
+    if (rlcf->skip != NULL) {
+        if (ngx_http_complex_value(r, rlcf->skip, &skip) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        if (skip.len && (skip.len != 1 || skip.data[0] != '0')) {
+            return NGX_DECLINED;
+        }
+    }
+
+    last = ngx_http_map_uri_to_path(r, &path, &root, 0);
+    if (last == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    path.len = last - path.data;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+
+    of.read_ahead = clcf->read_ahead;
+    of.directio = clcf->directio;
+    of.valid = clcf->open_file_cache_valid;
+    of.min_uses = clcf->open_file_cache_min_uses;
+    of.errors = clcf->open_file_cache_errors;
+    of.events = clcf->open_file_cache_events;
+
+    if (ngx_http_set_disable_symlinks(r, clcf, &path, &of) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    sof = of;
+
+    of.test_only = 1;
+
+    if (ngx_open_cached_file(clcf->open_file_cache, &path, &of, r->pool)
+        != NGX_OK
+        || !of.is_file)
+    {
+        /* the errors are left to the static module */
+        return NGX_DECLINED;
+    }
+
+    if (ngx_http_set_content_type(r) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (ngx_http_test_content_type(r, &rlcf->types) == NULL) {
+        return NGX_DECLINED;
+    }
+
+    st = ngx_pcalloc(r->pool, sizeof(ngx_http_replace_static_t));
+    if (st == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    sp = rlcf->static_path;
+
+    st->name.len = sp->name.len + 1 + sp->len
+                   + NGX_HTTP_REPLACE_STATIC_KEY_LEN;
+
+    st->name.data = ngx_pnalloc(r->pool, st->name.len + 1);
+    if (st->name.data == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    p = ngx_cpymem(st->name.data, sp->name.data, sp->name.len);
+    *p++ = '/';
+    p += sp->len;
+
+    p = ngx_sprintf(p, "%08xD%016xL%016xL%016xL%016xL%Z",
+                    ngx_crc32_long(path.data, path.len),
+                    (int64_t) of.uniq, (int64_t) of.mtime,
+                    (int64_t) of.size, rlcf->rules_hash);
+
+    ngx_create_hashed_filename(sp, st->name.data, st->name.len);
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_replace_ctx_t));
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* picked up by the header filter */
+
+    ctx->sidecar = st;
+
+    ngx_http_set_ctx(r, ctx, ngx_http_replace_filter_module);
+
+    if (ngx_open_cached_file(clcf->open_file_cache, &st->name, &sof, r->pool)
+        != NGX_OK
+        || !sof.is_file)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "replace filter static miss: \"%V\"", &st->name);
+
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "replace filter static hit: \"%V\"", &st->name);
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    st->sent = 1;
+
+    r->root_tested = !r->error_page;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = sof.size;
+
+    if (rlcf->last_modified == NGX_HTTP_REPLACE_KEEP_LAST_MODIFIED) {
+        r->headers_out.last_modified_time = of.mtime;
+
+        if (ngx_http_set_etag(r) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    r->allow_ranges = 1;
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+    if (b->file == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    b->file_pos = 0;
+    b->file_last = sof.size;
+
+    b->in_file = b->file_last ? 1 : 0;
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    b->file->fd = sof.fd;
+    b->file->name = st->name;
+    b->file->log = r->connection->log;
+    b->file->directio = sof.is_directio;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+/*
+ * Appends the output chain to a temporary file, renamed to the sidecar
+ * file at the end of the response. Since every request writes its own
+ * temporary file and the rename is atomic, the workers racing on the same
+ * sidecar all leave a complete one.
+ */
+
+ngx_int_t
+ngx_http_replace_static_write(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, ngx_chain_t *in)
+{
+    ngx_uint_t                     last;
+    ngx_buf_t                     *b;
+    ngx_chain_t                   *cl;
+    ngx_temp_file_t               *tf;
+    ngx_http_replace_static_t     *st;
+    ngx_http_replace_loc_conf_t   *rlcf;
+
+    st = ctx->sidecar;
+    last = 0;
+
+    for (cl = in; cl; cl = cl->next) {
+        b = cl->buf;
+
+        if (!ngx_buf_in_memory(b) && ngx_buf_size(b)) {
+            dd("not writing data in files");
+            ctx->sidecar = NULL;
+            return NGX_OK;
+        }
+
+        if (b->last_buf || b->last_in_chain) {
+            last = 1;
+        }
+    }
+
+    if (st->temp == NULL) {
+        rlcf = ngx_http_get_module_loc_conf(r, ngx_http_replace_filter_module);
+
+        tf = ngx_pcalloc(r->pool, sizeof(ngx_temp_file_t));
+        if (tf == NULL) {
+            return NGX_ERROR;
+        }
+
+        tf->file.fd = NGX_INVALID_FILE;
+        tf->file.log = r->connection->log;
+        tf->path = rlcf->static_path;
+        tf->pool = r->pool;
+        tf->persistent = 1;
+        tf->clean = 1;  /* unless renamed */
+        tf->access = NGX_FILE_OWNER_ACCESS;
+
+        st->temp = tf;
+    }
+
+    if (ngx_write_chain_to_temp_file(st->temp, in) == NGX_ERROR) {
+        /* the response itself is fine */
+        ctx->sidecar = NULL;
+        return NGX_OK;
+    }
+
+    if (last) {
+        ctx->sidecar = NULL;
+        return ngx_http_replace_static_commit(r, st);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_replace_static_commit(ngx_http_request_t *r,
+    ngx_http_replace_static_t *st)
+{
+    ngx_ext_rename_file_t   ext;
+
+    ext.access = NGX_FILE_OWNER_ACCESS;
+    ext.path_access = NGX_FILE_OWNER_ACCESS;
+    ext.time = -1;
+    ext.create_path = 1;
+    ext.delete_file = 1;
+    ext.fd = st->temp->file.fd;
+    ext.log = r->connection->log;
+
+    if (ngx_ext_rename_file(&st->temp->file.name, &st->name, &ext)
+        == NGX_OK)
+    {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "replace filter static: wrote %O bytes to \"%V\"",
+                       st->temp->offset, &st->name);
+    }
+
+    /* a failure only costs filtering the file again */
+
+    return NGX_OK;
+}
@@ -0,0 +1,37 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef _NGX_HTTP_REPLACE_STATIC_H_INCLUDED_
+#define _NGX_HTTP_REPLACE_STATIC_H_INCLUDED_
+
+
+#include "ngx_http_replace_filter_module.h"
+
+
+/* the hex digits of the file crc, inode, mtime, size and the rules hash */
+#define NGX_HTTP_REPLACE_STATIC_KEY_LEN  (8 + 4 * 16)
+
+
+/*
+ * The sidecar file of replace_filter_static holding the filtered output of
+ * a static file: sent in place of the file when it exists, or written from
+ * the output of the filter otherwise.
+ */
+
+struct ngx_http_replace_static_s {
+    ngx_str_t                   name;
+    ngx_temp_file_t            *temp;
+
+    unsigned                    sent:1;  /* the sidecar is the response */
+};
+
+
+ngx_int_t ngx_http_replace_static_handler(ngx_http_request_t *r);
+ngx_int_t ngx_http_replace_static_write(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, ngx_chain_t *in);
+
+
+#endif /* _NGX_HTTP_REPLACE_STATIC_H_INCLUDED_ */
@@ -0,0 +1,249 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef DDEBUG
+#define DDEBUG 0
+#endif
+#include "ddebug.h"
+
+
+#include "ngx_http_replace_thread.h"
+#include "ngx_http_replace_engine.h"
+
+
+#if (NGX_THREADS)
+static void ngx_http_replace_thread_handler(void *data, ngx_log_t *log);
+static void ngx_http_replace_thread_event_handler(ngx_event_t *ev);
+#endif
+
+
+char *
+ngx_http_replace_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+#if (NGX_THREADS)
+    ngx_http_replace_loc_conf_t  *rlcf = conf;
+
+    ssize_t       threshold;
+    ngx_str_t    *value, s;
+    ngx_uint_t    i;
+
+    if (rlcf->thread_pool != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts != 2) {
+            return "takes no other parameters with \"off\"";
+        }
+
+        rlcf->thread_pool = NULL;
+        return NGX_CONF_OK;
+    }
+
+    threshold = NGX_HTTP_REPLACE_THREAD_THRESHOLD;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "threshold=", 10) == 0) {
+
+            s.data = value[i].data + 10;
+            s.len = value[i].len - 10;
+
+            threshold = ngx_parse_size(&s);
+
+            if (threshold == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid threshold \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    rlcf->thread_pool = ngx_thread_pool_add(cf, &value[1]);
+    if (rlcf->thread_pool == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    rlcf->thread_threshold = (size_t) threshold;
+
+    return NGX_CONF_OK;
+
+#else
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"%V\" is unsupported on this platform", &cmd->name);
+
+    return NGX_CONF_ERROR;
+
+#endif
+}
+
+
+/*
+ * Returns the result of the run of the regexes completed in the thread
+ * pool, or posts the run there and returns NGX_HTTP_REPLACE_EXEC_POSTED, or
+ * returns NGX_HTTP_REPLACE_EXEC_INLINE when the run is better done right
+ * away.
+ */
+
+sre_int_t
+ngx_http_replace_thread_exec(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, u_char *input, size_t size, unsigned eof,
+    sre_int_t **pending_matched)
+{
+#if (NGX_THREADS)
+    ngx_thread_task_t              *task;
+    ngx_http_replace_thread_t      *t;
+    ngx_http_replace_loc_conf_t    *rlcf;
+
+    t = ctx->thread;
+
+    if (t && t->done) {
+        t->done = 0;
+
+        if (t->input != input || t->size != size || t->eof != eof) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                          "replace filter thread: the parse step was not "
+                          "retried with the same arguments");
+            return SRE_ERROR;
+        }
+
+        if (pending_matched) {
+            *pending_matched = t->pending_matched;
+        }
+
+        return t->rc;
+    }
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_replace_filter_module);
+
+    /*
+     * the lazily built DFA states are shared by all the requests of the
+     * worker, and so are the PCRE2 JIT stacks. sre_vm_pike_exec() writes to
+     * the program it runs: the VM of the request has to run its private
+     * copy, see ngx_http_replace_vm_get(), and not a variant, which is
+     * shared by the location.
+     */
+
+    if (rlcf->thread_pool == NULL
+        || rlcf->backend != &ngx_http_replace_sregex_backend
+        || rlcf->dfa
+        || (rlcf->literal == NULL
+            && (ctx->vm_program == NULL || ctx->program))
+        || size < NGX_HTTP_REPLACE_THREAD_MIN_SIZE
+        || ctx->stream_pos + (input - ctx->buf->pos) + (sre_int_t) size
+           < (sre_int_t) rlcf->thread_threshold)
+    {
+        return NGX_HTTP_REPLACE_EXEC_INLINE;
+    }
+
+    if (t == NULL) {
+        task = ngx_thread_task_alloc(r->pool,
+                                     sizeof(ngx_http_replace_thread_t));
+        if (task == NULL) {
+            return SRE_ERROR;
+        }
+
+        t = task->ctx;
+
+        t->task = task;
+        t->request = r;
+        t->ctx = ctx;
+
+        task->handler = ngx_http_replace_thread_handler;
+        task->event.handler = ngx_http_replace_thread_event_handler;
+        task->event.data = r;
+
+        ctx->thread = t;
+    }
+
+    t->input = input;
+    t->size = size;
+    t->eof = eof;
+    t->want_pending = (pending_matched != NULL);
+    t->pending_matched = NULL;
+
+    if (ngx_thread_task_post(rlcf->thread_pool, t->task) != NGX_OK) {
+        /* the queue is full */
+        return NGX_HTTP_REPLACE_EXEC_INLINE;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "replace filter thread: posted %uz bytes", size);
+
+    t->busy = 1;
+
+    r->main->blocked++;
+    r->aio = 1;
+
+    return NGX_HTTP_REPLACE_EXEC_POSTED;
+
+#else
+
+    return NGX_HTTP_REPLACE_EXEC_INLINE;
+
+#endif
+}
+
+
+#if (NGX_THREADS)
+
+static void
+ngx_http_replace_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_replace_thread_t  *t = data;
+
+    ngx_http_replace_loc_conf_t    *rlcf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "replace filter thread");
+
+    rlcf = ngx_http_get_module_loc_conf(t->request,
+                                        ngx_http_replace_filter_module);
+
+    t->rc = rlcf->backend->exec(t->request, t->ctx, t->input, t->size,
+                                t->eof,
+                                t->want_pending ? &t->pending_matched : NULL);
+}
+
+
+static void
+ngx_http_replace_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_connection_t            *c;
+    ngx_http_request_t          *r;
+    ngx_http_replace_ctx_t      *ctx;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_replace_filter_module);
+
+    ctx->thread->busy = 0;
+    ctx->thread->done = 1;
+
+    if (r->done || c->error) {
+        /* the request was finalized or terminated meanwhile */
+        c->write->handler(c->write);
+        return;
+    }
+
+    ngx_http_replace_resume_handler(ev);
+}
+
+#endif
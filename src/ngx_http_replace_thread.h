@@ -0,0 +1,58 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef _NGX_HTTP_REPLACE_THREAD_H_INCLUDED_
+#define _NGX_HTTP_REPLACE_THREAD_H_INCLUDED_
+
+
+#include "ngx_http_replace_filter_module.h"
+
+
+#define NGX_HTTP_REPLACE_THREAD_THRESHOLD  (512 * 1024)
+
+/* smaller runs, like the ones right after a match, are not worth a task */
+#define NGX_HTTP_REPLACE_THREAD_MIN_SIZE   4096
+
+
+#if (NGX_THREADS)
+
+/*
+ * A run of the regexes in a thread pool, for replace_filter_thread_pool.
+ * The parse step giving up on the run is retried with the same arguments
+ * once the task completes, and gets its result then. ctx is left alone in
+ * the meantime, except for ctx->in.
+ */
+
+struct ngx_http_replace_thread_s {
+    ngx_thread_task_t          *task;
+    ngx_http_request_t         *request;
+    ngx_http_replace_ctx_t     *ctx;
+
+    u_char                     *input;
+    size_t                      size;
+    sre_int_t                  *pending_matched;
+    sre_int_t                   rc;
+
+    ngx_chain_t                *cur;  /* of the suspended parse loop */
+    ngx_chain_t                *rematch;
+
+    unsigned                    eof:1;
+    unsigned                    want_pending:1;
+    unsigned                    busy:1;
+    unsigned                    done:1;
+};
+
+#endif
+
+
+char *ngx_http_replace_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+sre_int_t ngx_http_replace_thread_exec(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, u_char *input, size_t size, unsigned eof,
+    sre_int_t **pending_matched);
+
+
+#endif /* _NGX_HTTP_REPLACE_THREAD_H_INCLUDED_ */
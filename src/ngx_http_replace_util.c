@@ -13,6 +13,28 @@
 #include "ngx_http_replace_util.h"
 
 
+enum {
+    NGX_HTTP_REPLACE_SEGMENT_SIZE = 4096
+};
+
+
+#define ngx_http_replace_part_flags(part, buf, final)                       \
+    (part)->flush = (final) ? (buf)->flush : 0;                              \
+    (part)->last_buf = (final) ? (buf)->last_buf : 0;                        \
+    (part)->last_in_chain = (final) ? (buf)->last_in_chain : 0
+
+
+#define ngx_http_replace_buf_in_segment(b, seg)                              \
+    (ngx_buf_in_memory(b) && (b)->pos < (b)->last                            \
+     && (b)->pos >= (seg)->start && (b)->pos < (seg)->end)
+
+
+static u_char *ngx_http_replace_alloc_pending(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, size_t len);
+static ngx_uint_t ngx_http_replace_segment_busy(ngx_http_replace_ctx_t *ctx,
+    ngx_http_replace_segment_t *seg);
+
+
 ngx_chain_t *
 ngx_http_replace_get_free_buf(ngx_pool_t *p, ngx_chain_t **free)
 {
@@ -152,7 +174,10 @@ ngx_http_replace_new_pending_buf(ngx_http_request_t *r,
 
     if (ctx->total_buffered > rlcf->max_buffered_size) {
 #if 1
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+        /* restarting after an overflow is an expected outcome */
+
+        ngx_log_error(rlcf->overflow == NGX_HTTP_REPLACE_OVERFLOW_RESTART
+                      ? NGX_LOG_WARN : NGX_LOG_ALERT, r->connection->log, 0,
                       "replace filter: exceeding "
                       "replace_filter_max_buffered_size (%uz): %uz",
                       rlcf->max_buffered_size, ctx->total_buffered);
@@ -172,7 +197,7 @@ ngx_http_replace_new_pending_buf(ngx_http_request_t *r,
     b->file_pos = from;
     b->file_last = to;
 
-    b->start = ngx_palloc(r->pool, len);
+    b->start = ngx_http_replace_alloc_pending(r, ctx, len);
     if (b->start == NULL) {
         return NGX_ERROR;
     }
@@ -190,6 +215,331 @@ ngx_http_replace_new_pending_buf(ngx_http_request_t *r,
 }
 
 
+/*
+ * Pending data is stored in segments owned by the request, which are
+ * reused once no buffer still to be matched or sent refers to them, so that
+ * the memory used stays bounded however long the response is.
+ */
+
+static u_char *
+ngx_http_replace_alloc_pending(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, size_t len)
+{
+    u_char                          *p;
+    size_t                           size;
+    ngx_http_replace_segment_t      *seg, **pseg;
+    ngx_http_replace_loc_conf_t     *rlcf;
+
+    seg = ctx->segments;
+
+    if (seg && (size_t) (seg->end - seg->last) >= len) {
+        goto found;
+    }
+
+    for (pseg = &ctx->segments; *pseg; pseg = &seg->next) {
+        seg = *pseg;
+
+        if ((size_t) (seg->end - seg->start) < len
+            || ngx_http_replace_segment_busy(ctx, seg))
+        {
+            continue;
+        }
+
+        dd("reusing pending segment %p", seg);
+
+        *pseg = seg->next;
+        seg->next = ctx->segments;
+        ctx->segments = seg;
+
+        seg->last = seg->start;
+
+        goto found;
+    }
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_replace_filter_module);
+
+    size = ngx_min(rlcf->max_buffered_size, NGX_HTTP_REPLACE_SEGMENT_SIZE);
+    size = ngx_max(size, len);
+
+    seg = ngx_palloc(r->pool, sizeof(ngx_http_replace_segment_t) + size);
+    if (seg == NULL) {
+        return NULL;
+    }
+
+    dd("new pending segment %p of %d bytes", seg, (int) size);
+
+    seg->start = (u_char *) seg + sizeof(ngx_http_replace_segment_t);
+    seg->last = seg->start;
+    seg->end = seg->start + size;
+
+    seg->next = ctx->segments;
+    ctx->segments = seg;
+
+found:
+
+    p = seg->last;
+    seg->last += len;
+
+    return p;
+}
+
+
+/*
+ * Whether any buffer of the request still refers to data in the segment.
+ * The buffers on ctx->free are not, those are recycled.
+ */
+
+static ngx_uint_t
+ngx_http_replace_segment_busy(ngx_http_replace_ctx_t *ctx,
+    ngx_http_replace_segment_t *seg)
+{
+    ngx_uint_t        i;
+    ngx_chain_t      *cl, *chains[6];
+
+    if (ctx->buf && ngx_http_replace_buf_in_segment(ctx->buf, seg)) {
+        return 1;
+    }
+
+    chains[0] = ctx->pending;
+    chains[1] = ctx->pending2;
+    chains[2] = ctx->captured;
+    chains[3] = ctx->rematch;
+    chains[4] = ctx->out;
+    chains[5] = ctx->busy;
+
+    for (i = 0; i < sizeof(chains) / sizeof(chains[0]); i++) {
+        for (cl = chains[i]; cl; cl = cl->next) {
+            if (ngx_http_replace_buf_in_segment(cl->buf, seg)) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+ngx_int_t
+ngx_http_replace_read_window(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, ngx_buf_t *buf)
+{
+    off_t                 size;
+    ssize_t               n;
+    ngx_buf_t            *w;
+
+    ngx_http_replace_loc_conf_t  *rlcf;
+
+    w = ctx->window;
+
+    if (w == NULL) {
+        rlcf = ngx_http_get_module_loc_conf(r, ngx_http_replace_filter_module);
+
+        w = ngx_create_temp_buf(r->pool, rlcf->sendfile_window);
+        if (w == NULL) {
+            return NGX_ERROR;
+        }
+
+        w->tag = (ngx_buf_tag_t) &ngx_http_replace_filter_module;
+        ctx->window = w;
+    }
+
+    ctx->part = w;
+
+    if (ctx->part_buf != buf) {
+        ctx->part_buf = buf;
+        ctx->part_offset = buf->file_pos;
+
+        w->last = w->start;
+    }
+
+    if (w->last > w->start && w->file_pos == ctx->part_offset) {
+        /* rematching from the start of the current window */
+        return NGX_OK;
+    }
+
+    size = ngx_min((off_t) (w->end - w->start),
+                   buf->file_last - ctx->part_offset);
+
+    n = ngx_read_file(buf->file, w->start, (size_t) size, ctx->part_offset);
+
+    if (n == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (n != size) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "replace filter: read only %z of %O from \"%V\"",
+                      n, size, &buf->file->name);
+        return NGX_ERROR;
+    }
+
+    w->pos = w->start;
+    w->last = w->start + n;
+
+    w->file_pos = ctx->part_offset;
+    w->file_last = ctx->part_offset + n;
+
+    ngx_http_replace_part_flags(w, buf, w->file_last == buf->file_last);
+
+    dd("read window (%ld, %ld) of %p", (long) w->file_pos,
+       (long) w->file_last, buf);
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_replace_slice_buf(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, ngx_buf_t *buf, size_t size)
+{
+    ngx_buf_t            *s;
+
+    s = ctx->slice;
+
+    if (s == NULL) {
+        s = ngx_calloc_buf(r->pool);
+        if (s == NULL) {
+            return NGX_ERROR;
+        }
+
+        s->tag = (ngx_buf_tag_t) &ngx_http_replace_filter_module;
+        ctx->slice = s;
+    }
+
+    ctx->part = s;
+
+    if (ctx->part_buf != buf) {
+        ctx->part_buf = buf;
+        ctx->part_offset = 0;
+    }
+
+    s->temporary = buf->temporary;
+    s->memory = buf->memory;
+    s->mmap = buf->mmap;
+
+    s->pos = buf->pos + ctx->part_offset;
+    s->last = s->pos + ngx_min(size, (size_t) (buf->last - s->pos));
+
+    ngx_http_replace_part_flags(s, buf, s->last == buf->last);
+
+    dd("slice (%ld, %ld) of %p", (long) ctx->part_offset,
+       (long) (s->last - buf->pos), buf);
+
+    return NGX_OK;
+}
+
+
+/*
+ * Moves on to the part of ctx->part_buf after the one just matched, or
+ * returns 0 when it was the last one.
+ */
+
+ngx_uint_t
+ngx_http_replace_next_part(ngx_http_replace_ctx_t *ctx)
+{
+    ngx_buf_t            *b, *buf;
+
+    b = ctx->part;
+    buf = ctx->part_buf;
+
+    if (b == ctx->window) {
+        if (b->file_last < buf->file_last) {
+            ctx->part_offset = b->file_last;
+            return 1;
+        }
+
+    } else {
+        if (b->last < buf->last) {
+            ctx->part_offset = b->last - buf->pos;
+            return 1;
+        }
+    }
+
+    ctx->part_buf = NULL;
+
+    return 0;
+}
+
+
+/*
+ * Turns an output buffer pointing into the window into one referring to
+ * the same bytes in the file, so that it can still be sent with sendfile()
+ * and the window can be read over.
+ */
+
+void
+ngx_http_replace_window_span(ngx_http_replace_ctx_t *ctx, ngx_buf_t *b)
+{
+    ngx_buf_t            *w;
+
+    w = ctx->window;
+
+    if (ctx->part_buf == NULL
+        || ctx->part != w
+        || b->pos < w->start
+        || b->last > w->last)
+    {
+        return;
+    }
+
+    b->file = ctx->part_buf->file;
+    b->file_pos = w->file_pos + (b->pos - w->start);
+    b->file_last = b->file_pos + (b->last - b->pos);
+
+    b->in_file = 1;
+    b->memory = 0;
+    b->pos = NULL;
+    b->last = NULL;
+}
+
+
+ngx_int_t
+ngx_http_replace_output_file(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, ngx_buf_t *buf)
+{
+    ngx_buf_t            *b;
+    ngx_chain_t          *cl;
+
+    cl = ngx_http_replace_get_free_buf(r->pool, &ctx->free);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    b = cl->buf;
+
+    b->in_file = 1;
+    b->file = buf->file;
+    b->file_pos = (ctx->part_buf == buf) ? ctx->part_offset : buf->file_pos;
+    b->file_last = buf->file_last;
+
+    b->flush = buf->flush;
+    b->last_buf = buf->last_buf;
+    b->last_in_chain = buf->last_in_chain;
+    b->shadow = buf;
+    b->recycled = buf->recycled;
+
+    ctx->part_buf = NULL;
+    ctx->stream_pos += b->file_last - b->file_pos;
+
+    *ctx->last_out = cl;
+    ctx->last_out = &cl->next;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_replace_cleanup_pool(void *data)
+{
+    sre_pool_t          *pool = data;
+
+    if (pool) {
+        dd("destroy sre pool %p", pool);
+        sre_destroy_pool(pool);
+    }
+}
+
+
 #if (DDEBUG)
 void
 ngx_http_replace_dump_chain(const char *prefix, ngx_chain_t **pcl,
@@ -5,6 +5,11 @@
 #include "ngx_http_replace_filter_module.h"
 
 
+/* a buf that would have to be read into memory to be matched */
+#define ngx_http_replace_file_buf(b)                                         \
+    (!ngx_buf_in_memory(b) && (b)->in_file && (b)->file_last > (b)->file_pos)
+
+
 ngx_chain_t *ngx_http_replace_get_free_buf(ngx_pool_t *p,
     ngx_chain_t **free);
 ngx_int_t ngx_http_replace_split_chain(ngx_http_request_t *r,
@@ -13,6 +18,15 @@ ngx_int_t ngx_http_replace_split_chain(ngx_http_request_t *r,
 ngx_int_t ngx_http_replace_new_pending_buf(ngx_http_request_t *r,
     ngx_http_replace_ctx_t *ctx, sre_int_t from, sre_int_t to,
     ngx_chain_t **out);
+ngx_int_t ngx_http_replace_read_window(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, ngx_buf_t *buf);
+ngx_int_t ngx_http_replace_slice_buf(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, ngx_buf_t *buf, size_t size);
+ngx_uint_t ngx_http_replace_next_part(ngx_http_replace_ctx_t *ctx);
+void ngx_http_replace_window_span(ngx_http_replace_ctx_t *ctx, ngx_buf_t *b);
+ngx_int_t ngx_http_replace_output_file(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx, ngx_buf_t *buf);
+void ngx_http_replace_cleanup_pool(void *data);
 #if (DDEBUG)
 void ngx_http_replace_dump_chain(const char *prefix, ngx_chain_t **pcl,
     ngx_chain_t **last);
@@ -0,0 +1,325 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef DDEBUG
+#define DDEBUG 0
+#endif
+#include "ddebug.h"
+
+
+#include "ngx_http_replace_vm.h"
+#include "ngx_http_replace_engine.h"
+
+
+struct ngx_http_replace_vm_s {
+    ngx_http_replace_vm_t          *next;
+    ngx_http_replace_vm_cache_t    *cache;
+
+    sre_pool_t                     *vm_pool;
+    sre_pool_t                     *jit_pool;
+    sre_pool_t                     *capture_pool;
+
+    sre_pool_t                     *program_pool;
+    sre_program_t                  *program;  /* for the thread pools */
+
+    /* followed by the ovector, the replacements and the rule counters */
+};
+
+
+static ngx_http_replace_vm_t *ngx_http_replace_vm_create(
+    ngx_http_request_t *r, ngx_http_replace_loc_conf_t *rlcf,
+    ngx_http_replace_vm_cache_t *cache, size_t size);
+static void ngx_http_replace_vm_free(ngx_http_replace_vm_t *vm);
+static void ngx_http_replace_vm_release(void *data);
+static void ngx_http_replace_vm_cache_cleanup(void *data);
+
+
+ngx_http_replace_vm_cache_t *
+ngx_http_replace_vm_cache_create(ngx_conf_t *cf, ngx_uint_t max)
+{
+    ngx_pool_cleanup_t             *cln;
+    ngx_http_core_loc_conf_t       *clcf;
+    ngx_http_replace_vm_cache_t    *cache;
+    ngx_http_replace_main_conf_t   *rmcf;
+
+    cln = ngx_pool_cleanup_add(cf->pool, sizeof(ngx_http_replace_vm_cache_t));
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    cache = cln->data;
+
+    ngx_memzero(cache, sizeof(ngx_http_replace_vm_cache_t));
+
+    cache->max = max;
+
+    cln->handler = ngx_http_replace_vm_cache_cleanup;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    cache->name = clcf->name;
+
+    rmcf = ngx_http_conf_get_module_main_conf(cf,
+                                              ngx_http_replace_filter_module);
+
+    cache->next = rmcf->vm_caches;
+    rmcf->vm_caches = cache;
+
+    return cache;
+}
+
+
+/*
+ * Reports the use of the caches of the worker, for tuning
+ * replace_filter_vm_cache: the misses beyond the first requests mean that
+ * more requests ran at once in a location than its cache holds.
+ */
+
+void
+ngx_http_replace_vm_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_http_replace_vm_cache_t    *cache;
+    ngx_http_replace_main_conf_t   *rmcf;
+
+    rmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_replace_filter_module);
+    if (rmcf == NULL) {
+        return;
+    }
+
+    for (cache = rmcf->vm_caches; cache; cache = cache->next) {
+
+        if (cache->hits == 0 && cache->misses == 0) {
+            continue;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+                      "replace filter vm cache of \"%V\": %ui hits, "
+                      "%ui misses", &cache->name, cache->hits,
+                      cache->misses);
+    }
+}
+
+
+/*
+ * Sets up ctx->ovector, ctx->sub, ctx->counts and the sregex pools of
+ * ctx for the request, preferably with the memory left by a previous
+ * request to the same location. With replace_filter_thread_pool, the
+ * memory also holds a copy of the program that the request runs alone,
+ * see ngx_http_replace_thread_exec().
+ */
+
+ngx_int_t
+ngx_http_replace_vm_get(ngx_http_request_t *r, ngx_http_replace_ctx_t *ctx)
+{
+    u_char                         *p;
+    size_t                          size, sub_size, counts_size;
+    ngx_pool_cleanup_t             *cln;
+    ngx_http_replace_vm_t          *vm;
+    ngx_http_replace_vm_cache_t    *cache;
+    ngx_http_replace_loc_conf_t    *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_replace_filter_module);
+
+    cache = rlcf->vm_cache;
+
+    sub_size = rlcf->multi_replace.nelts * sizeof(ngx_str_t);
+    counts_size = rlcf->regexes.nelts * sizeof(ngx_uint_t);
+
+    size = ngx_align(sizeof(ngx_http_replace_vm_t), sizeof(sre_int_t))
+           + ngx_align(rlcf->ovecsize, sizeof(ngx_str_t))
+           + sub_size + counts_size;
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (cache->free) {
+        vm = cache->free;
+        cache->free = vm->next;
+        cache->nfree--;
+        cache->hits++;
+
+    } else {
+        vm = ngx_http_replace_vm_create(r, rlcf, cache, size);
+        if (vm == NULL) {
+            return NGX_ERROR;
+        }
+
+        cache->misses++;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "replace filter vm cache: %ui hits, %ui misses, %ui free",
+                   cache->hits, cache->misses, cache->nfree);
+
+    cln->handler = ngx_http_replace_vm_release;
+    cln->data = vm;
+
+    p = (u_char *) vm + ngx_align(sizeof(ngx_http_replace_vm_t),
+                                  sizeof(sre_int_t));
+
+    ctx->ovector = (sre_int_t *) p;
+    p += ngx_align(rlcf->ovecsize, sizeof(ngx_str_t));
+
+    ctx->sub = (ngx_str_t *) p;
+    p += sub_size;
+
+    ctx->counts = (ngx_uint_t *) p;
+
+    ngx_memzero(ctx->sub, sub_size + counts_size);
+
+    ctx->vm_pool = vm->vm_pool;
+    ctx->jit_pool = vm->jit_pool;
+    ctx->capture_pool = vm->capture_pool;
+
+#if (NGX_THREADS)
+    if (rlcf->thread_pool
+        && rlcf->backend == &ngx_http_replace_sregex_backend
+        && rlcf->literal == NULL
+        && vm->program == NULL)
+    {
+        if (vm->program_pool == NULL) {
+            vm->program_pool = sre_create_pool(1024);
+            if (vm->program_pool == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        /* the runs stay in the event loop when it fails */
+        vm->program = ngx_http_replace_sregex_copy(r, rlcf,
+                                                   vm->program_pool);
+    }
+#endif
+
+    ctx->vm_program = vm->program;
+
+    return NGX_OK;
+}
+
+
+static ngx_http_replace_vm_t *
+ngx_http_replace_vm_create(ngx_http_request_t *r,
+    ngx_http_replace_loc_conf_t *rlcf, ngx_http_replace_vm_cache_t *cache,
+    size_t size)
+{
+    ngx_http_replace_vm_t          *vm;
+
+    vm = ngx_alloc(size, r->connection->log);
+    if (vm == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(vm, sizeof(ngx_http_replace_vm_t));
+
+    vm->cache = cache;
+
+    /* the sizes and the pools needed are the same for every request */
+
+    if (rlcf->backend == &ngx_http_replace_sregex_backend) {
+        vm->vm_pool = sre_create_pool(1024);
+        if (vm->vm_pool == NULL) {
+            goto failed;
+        }
+
+        if (rlcf->jit_code) {
+            vm->jit_pool = sre_create_pool(1024);
+            if (vm->jit_pool == NULL) {
+                goto failed;
+            }
+        }
+
+        if (rlcf->capture_program) {
+            vm->capture_pool = sre_create_pool(1024);
+            if (vm->capture_pool == NULL) {
+                goto failed;
+            }
+        }
+    }
+
+    dd("created vm %p", vm);
+
+    return vm;
+
+failed:
+
+    ngx_http_replace_vm_free(vm);
+
+    return NULL;
+}
+
+
+static void
+ngx_http_replace_vm_free(ngx_http_replace_vm_t *vm)
+{
+    if (vm->vm_pool) {
+        sre_destroy_pool(vm->vm_pool);
+    }
+
+    if (vm->jit_pool) {
+        sre_destroy_pool(vm->jit_pool);
+    }
+
+    if (vm->capture_pool) {
+        sre_destroy_pool(vm->capture_pool);
+    }
+
+    if (vm->program_pool) {
+        sre_destroy_pool(vm->program_pool);
+    }
+
+    ngx_free(vm);
+}
+
+
+static void
+ngx_http_replace_vm_release(void *data)
+{
+    ngx_http_replace_vm_t  *vm = data;
+
+    ngx_http_replace_vm_cache_t    *cache;
+
+    cache = vm->cache;
+
+    if (cache->nfree >= cache->max) {
+        dd("destroy vm %p", vm);
+        ngx_http_replace_vm_free(vm);
+        return;
+    }
+
+    if (vm->vm_pool) {
+        sre_reset_pool(vm->vm_pool);
+    }
+
+    if (vm->jit_pool) {
+        sre_reset_pool(vm->jit_pool);
+    }
+
+    if (vm->capture_pool) {
+        sre_reset_pool(vm->capture_pool);
+    }
+
+    vm->next = cache->free;
+    cache->free = vm;
+    cache->nfree++;
+}
+
+
+static void
+ngx_http_replace_vm_cache_cleanup(void *data)
+{
+    ngx_http_replace_vm_cache_t  *cache = data;
+
+    ngx_http_replace_vm_t          *vm;
+
+    while (cache->free) {
+        vm = cache->free;
+        cache->free = vm->next;
+        ngx_http_replace_vm_free(vm);
+    }
+
+    cache->nfree = 0;
+}
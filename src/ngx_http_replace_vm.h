@@ -0,0 +1,43 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef _NGX_HTTP_REPLACE_VM_H_INCLUDED_
+#define _NGX_HTTP_REPLACE_VM_H_INCLUDED_
+
+
+#include "ngx_http_replace_filter_module.h"
+
+
+typedef struct ngx_http_replace_vm_s  ngx_http_replace_vm_t;
+
+
+/*
+ * The per-request matching memory of a location: the sregex pools and the
+ * submatch, replacement and rule counter arrays. Released by the requests
+ * to a per-worker free list of the location, of up to "max" entries.
+ */
+
+struct ngx_http_replace_vm_cache_s {
+    ngx_http_replace_vm_t      *free;
+    ngx_uint_t                  nfree;
+    ngx_uint_t                  max;  /* replace_filter_vm_cache */
+
+    ngx_uint_t                  hits;
+    ngx_uint_t                  misses;
+
+    ngx_http_replace_vm_cache_t    *next;  /* of the configuration */
+    ngx_str_t                       name;  /* of the location */
+};
+
+
+ngx_http_replace_vm_cache_t *ngx_http_replace_vm_cache_create(
+    ngx_conf_t *cf, ngx_uint_t max);
+ngx_int_t ngx_http_replace_vm_get(ngx_http_request_t *r,
+    ngx_http_replace_ctx_t *ctx);
+void ngx_http_replace_vm_exit_process(ngx_cycle_t *cycle);
+
+
+#endif /* _NGX_HTTP_REPLACE_VM_H_INCLUDED_ */
@@ -275,3 +275,43 @@ replace filter: exceeding replace_filter_max_buffered_size (1): 2
 --- no_error_log
 [error]
 
+
+
+
+=== TEST 7: bounded matches across buffers
+--- config
+    replace_filter_max_buffered_size 2;
+    default_type text/html;
+    location = /t {
+        echo -n xa;
+        echo -n b;
+        echo -n yab;
+        echo -n c;
+        echo d;
+        replace_filter 'a.c|b' 'X' g;
+    }
+--- request
+GET /t
+--- response_body
+xaXyXd
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 8: assertions keep the data before them pending
+--- config
+    default_type text/html;
+    location = /t {
+        echo -n xab;
+        echo " y";
+        replace_filter 'ab\b' 'X' g;
+    }
+--- request
+GET /t
+--- response_body
+xX y
+--- no_error_log
+[alert]
+[error]
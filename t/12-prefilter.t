@@ -0,0 +1,196 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_on();
+#workers(2);
+#log_level('warn');
+
+repeat_each(2);
+
+#no_shuffle();
+
+plan tests => repeat_each() * (blocks() * 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: long runs of bytes that cannot start a match
+--- config
+    default_type text/html;
+    location /t {
+        content_by_lua '
+            local pad = string.rep("0123456789", 10)
+            ngx.say(pad, "abc", pad, "abc", pad)
+        ';
+        replace_filter abc X g;
+    }
+--- request
+GET /t
+--- response_body eval
+my $pad = "0123456789" x 10;
+"${pad}X${pad}X${pad}\n"
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 2: match spanning buffers after a skip
+--- config
+    default_type text/html;
+    location /t {
+        content_by_lua '
+            local pad = string.rep("-", 200)
+            ngx.print(pad, "ab")
+            ngx.flush(true)
+            ngx.print("c", pad)
+            ngx.flush(true)
+            ngx.say(pad, "a")
+        ';
+        replace_filter abc X g;
+    }
+--- request
+GET /t
+--- response_body eval
+my $pad = "-" x 200;
+"${pad}X${pad}${pad}a\n"
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 3: failed partial match followed by a skip
+--- config
+    default_type text/html;
+    location /t {
+        content_by_lua '
+            local pad = string.rep("y", 100)
+            ngx.print(pad, "abc")
+            ngx.flush(true)
+            ngx.print(pad, "abcd")
+            ngx.flush(true)
+            ngx.say(pad)
+        ';
+        replace_filter abcd X g;
+    }
+--- request
+GET /t
+--- response_body eval
+my $pad = "y" x 100;
+"${pad}abc${pad}X${pad}\n"
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 4: multiple regexes and character classes
+--- config
+    default_type text/html;
+    location /t {
+        content_by_lua '
+            local pad = string.rep("-", 64)
+            ngx.say(pad, "a12", pad, "zz", pad, "a", pad, "z")
+        ';
+        replace_filter 'a[0-9]+' A g;
+        replace_filter 'zz' Z g;
+    }
+--- request
+GET /t
+--- response_body eval
+my $pad = "-" x 64;
+"${pad}A${pad}Z${pad}a${pad}z\n"
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 5: caseless
+--- config
+    default_type text/html;
+    location /t {
+        content_by_lua '
+            local pad = string.rep("-", 64)
+            ngx.say(pad, "FoO", pad, "foo", pad)
+        ';
+        replace_filter foo X ig;
+    }
+--- request
+GET /t
+--- response_body eval
+my $pad = "-" x 64;
+"${pad}X${pad}X${pad}\n"
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 6: captures after a skip
+--- config
+    default_type text/html;
+    location /t {
+        content_by_lua '
+            local pad = string.rep("-", 64)
+            ngx.print(pad, "bb")
+            ngx.flush(true)
+            ngx.say("bc", pad, "bc")
+        ';
+        replace_filter '(b+)c' '[$1]' g;
+    }
+--- request
+GET /t
+--- response_body eval
+my $pad = "-" x 64;
+"${pad}[bbb]${pad}[b]\n"
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 7: word boundary assertions disable the prefilter
+--- config
+    default_type text/html;
+    location /t {
+        content_by_lua '
+            local pad = string.rep("-", 64)
+            ngx.say(pad, "xfoo", pad, "foo", pad)
+        ';
+        replace_filter '\bfoo' X g;
+    }
+--- request
+GET /t
+--- response_body eval
+my $pad = "-" x 64;
+"${pad}xfoo${pad}X${pad}\n"
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 8: once
+--- config
+    default_type text/html;
+    location /t {
+        content_by_lua '
+            local pad = string.rep("-", 64)
+            ngx.say(pad, "abc", pad, "abc")
+        ';
+        replace_filter abc X;
+    }
+--- request
+GET /t
+--- response_body eval
+my $pad = "-" x 64;
+"${pad}X${pad}abc\n"
+--- no_error_log
+[alert]
+[error]
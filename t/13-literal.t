@@ -0,0 +1,201 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_on();
+#workers(2);
+#log_level('warn');
+
+repeat_each(2);
+
+#no_shuffle();
+
+plan tests => repeat_each() * (blocks() * 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: plain strings, the first declared rule wins
+--- config
+    default_type text/html;
+    location /t {
+        echo "abcd abc ab";
+        replace_filter ab X g;
+        replace_filter abc Y g;
+    }
+--- request
+GET /t
+--- response_body
+Xcd Xc X
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 2: plain strings, the longer rule declared first
+--- config
+    default_type text/html;
+    location /t {
+        echo "abcd abc ab";
+        replace_filter abcd X g;
+        replace_filter ab Y g;
+    }
+--- request
+GET /t
+--- response_body
+X Yc Y
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 3: the leftmost match wins
+--- config
+    default_type text/html;
+    location /t {
+        echo "xbcde";
+        replace_filter cde X g;
+        replace_filter bc Y g;
+    }
+--- request
+GET /t
+--- response_body
+xYde
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 4: pending matches across buffers
+--- config
+    default_type text/html;
+    location /t {
+        echo -n "hello ab";
+        echo -n "c";
+        echo -n "d ab";
+        echo -n "c";
+        echo " world";
+        replace_filter abcd X g;
+        replace_filter ab Y g;
+    }
+--- request
+GET /t
+--- response_body
+hello X Yc world
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 5: caseless strings
+--- config
+    default_type text/html;
+    location /t {
+        echo "Example.COM example.com EXAMPLE.org";
+        replace_filter 'example\.com' X ig;
+        replace_filter 'example\.org' Y ig;
+    }
+--- request
+GET /t
+--- response_body
+X X Y
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 6: each rule only once
+--- config
+    default_type text/html;
+    location /t {
+        echo "foo bar foo bar";
+        replace_filter foo X;
+        replace_filter bar Y;
+    }
+--- request
+GET /t
+--- response_body
+X Y foo bar
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 7: mixing once and global rules
+--- config
+    default_type text/html;
+    location /t {
+        echo "foo bar foo bar";
+        replace_filter foo X;
+        replace_filter bar Y g;
+    }
+--- request
+GET /t
+--- response_body
+X Y foo Y
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 8: $& in the replacement
+--- config
+    default_type text/html;
+    location /t {
+        echo "cdn.example.com/a cdn.example.com/b";
+        replace_filter 'cdn\.example\.com' '[$&]' g;
+    }
+--- request
+GET /t
+--- response_body
+[cdn.example.com]/a [cdn.example.com]/b
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 9: failed overlapping prefixes across buffers
+--- config
+    default_type text/html;
+    location /t {
+        echo -n "aaa";
+        echo -n "aab";
+        echo "aaab";
+        replace_filter aaab X g;
+    }
+--- request
+GET /t
+--- response_body
+aaXX
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 10: mixed case flags fall back to the regex engine
+--- config
+    default_type text/html;
+    location /t {
+        echo "Foo foo BAR bar";
+        replace_filter foo X ig;
+        replace_filter bar Y g;
+    }
+--- request
+GET /t
+--- response_body
+X X BAR Y
+--- no_error_log
+[alert]
+[error]
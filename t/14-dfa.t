@@ -0,0 +1,188 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_on();
+#workers(2);
+#log_level('warn');
+
+repeat_each(2);
+
+#no_shuffle();
+
+plan tests => repeat_each() * (blocks() * 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: dfa engine, global
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_engine dfa;
+        content_by_lua '
+            local pad = string.rep("-", 100)
+            ngx.say(pad, "width: 12px", pad, "height: 3px;", pad)
+        ';
+        replace_filter '[0-9]+px' N g;
+    }
+--- request
+GET /t
+--- response_body eval
+my $pad = "-" x 100;
+"${pad}width: N${pad}height: N;${pad}\n"
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 2: threads that never reach a match
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_engine dfa;
+        content_by_lua '
+            local pad = string.rep("ab", 100)
+            ngx.say(pad, "abc", pad)
+        ';
+        replace_filter 'ab(?:ab)*c' X g;
+    }
+--- request
+GET /t
+--- response_body eval
+my $pad = "ab" x 100;
+"X${pad}\n"
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 3: matches spanning buffers
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_engine dfa;
+        content_by_lua '
+            local pad = string.rep(".", 100)
+            ngx.print(pad, "<scr")
+            ngx.flush(true)
+            ngx.print("ipt>x</scr")
+            ngx.flush(true)
+            ngx.say("ipt>", pad)
+        ';
+        replace_filter '<script>[^<]*</script>' '' g;
+    }
+--- request
+GET /t
+--- response_body eval
+my $pad = "." x 100;
+"${pad}${pad}\n"
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 4: captures
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_engine dfa;
+        content_by_lua '
+            local pad = string.rep(" ", 64)
+            ngx.say(pad, "http://a.com/x", pad, "http://b.org/y")
+        ';
+        replace_filter 'http://([a-z.]+)/' 'https://$1/' g;
+    }
+--- request
+GET /t
+--- response_body eval
+my $pad = " " x 64;
+"${pad}https://a.com/x${pad}https://b.org/y\n"
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 5: multiple regexes, once
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_engine dfa;
+        content_by_lua '
+            ngx.say("foo1 bar22 foo3 bar4")
+        ';
+        replace_filter 'foo[0-9]' F;
+        replace_filter 'bar[0-9]+' B;
+    }
+--- request
+GET /t
+--- response_body
+F B foo3 bar4
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 6: inherited from the server level
+--- config
+    default_type text/html;
+    replace_filter_engine dfa;
+    replace_filter 'b+c' X g;
+    location /t {
+        echo "abbbc abc ac";
+    }
+--- request
+GET /t
+--- response_body
+aX aX ac
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 7: regexes the dfa does not support
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_engine dfa;
+        echo "foo xfoo foo";
+        replace_filter '\bfoo' X g;
+    }
+--- request
+GET /t
+--- response_body
+X xfoo X
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 8: caseless
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_engine dfa;
+        content_by_lua '
+            local pad = string.rep("-", 64)
+            ngx.say(pad, "<IMG src=x>", pad, "<img SRC=y>")
+        ';
+        replace_filter '<img [^>]*>' I ig;
+    }
+--- request
+GET /t
+--- response_body eval
+my $pad = "-" x 64;
+"${pad}I${pad}I\n"
+--- no_error_log
+[alert]
+[error]
@@ -0,0 +1,168 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_on();
+#workers(2);
+#log_level('warn');
+
+repeat_each(2);
+
+#no_shuffle();
+
+plan tests => repeat_each() * (blocks() * 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: jit engine, global
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_engine jit;
+        content_by_lua '
+            local pad = string.rep("-", 5000)
+            ngx.say(pad, "width: 12px", pad, "height: 3px;", pad)
+        ';
+        replace_filter '[0-9]{1,4}px' N g;
+    }
+--- request
+GET /t
+--- response_body eval
+my $pad = "-" x 5000;
+"${pad}width: N${pad}height: N;${pad}\n"
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 2: no match at all
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_engine jit;
+        content_by_lua '
+            ngx.say(string.rep("abcd", 3000))
+        ';
+        replace_filter 'abce|dx' X g;
+    }
+--- request
+GET /t
+--- response_body eval
+("abcd" x 3000) . "\n"
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 3: matches spanning buffers
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_engine jit;
+        content_by_lua '
+            local pad = string.rep(".", 6000)
+            ngx.print(pad, "<scr")
+            ngx.flush(true)
+            ngx.print("ipt>x</scr")
+            ngx.flush(true)
+            ngx.say("ipt>", pad)
+        ';
+        replace_filter '<script>[^<]{0,20}</script>' '' g;
+    }
+--- request
+GET /t
+--- response_body eval
+my $pad = "." x 6000;
+"${pad}${pad}\n"
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 4: captures
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_engine jit;
+        content_by_lua '
+            local pad = string.rep("=", 5000)
+            ngx.say(pad, "key: value", pad, "foo: bar")
+        ';
+        replace_filter '([a-z]{1,8}): ([a-z]{1,8})' '$2=$1' g;
+    }
+--- request
+GET /t
+--- response_body eval
+my $pad = "=" x 5000;
+"${pad}value=key${pad}bar=foo\n"
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 5: once
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_engine jit;
+        content_by_lua '
+            local pad = string.rep("-", 5000)
+            ngx.say(pad, "ab", pad, "ab", pad)
+        ';
+        replace_filter 'a[a-z]' X;
+    }
+--- request
+GET /t
+--- response_body eval
+my $pad = "-" x 5000;
+"${pad}X${pad}ab${pad}\n"
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 6: unbounded regexes fall back to pike
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_engine jit;
+        echo "hello, world";
+        replace_filter 'l+' L g;
+    }
+--- request
+GET /t
+--- response_body
+heLo, worLd
+--- error_log
+replace_filter_engine jit requires regexes of bounded length
+--- no_error_log
+[alert]
+
+
+
+=== TEST 7: inherited by nested locations
+--- config
+    default_type text/html;
+    replace_filter_engine jit;
+    replace_filter 'b{1,3}' X g;
+    location /t {
+        content_by_lua '
+            ngx.say(string.rep("a", 5000), "bbbbb", string.rep("a", 5000))
+        ';
+    }
+--- request
+GET /t
+--- response_body eval
+("a" x 5000) . "XX" . ("a" x 5000) . "\n"
+--- no_error_log
+[alert]
+[error]
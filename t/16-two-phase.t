@@ -0,0 +1,145 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_on();
+#workers(2);
+#log_level('warn');
+
+repeat_each(2);
+
+#no_shuffle();
+
+plan tests => repeat_each() * (blocks() * 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: submatches spanning buffers
+--- config
+    default_type text/html;
+    location /t {
+        content_by_lua '
+            ngx.print("say: he")
+            ngx.flush(true)
+            ngx.print("llo, wo")
+            ngx.flush(true)
+            ngx.say("rld!")
+        ';
+        replace_filter '(h\w+), (w\w+)' '$2, $1' g;
+    }
+--- request
+GET /t
+--- response_body
+say: world, hello!
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 2: nested and optional groups
+--- config
+    default_type text/html;
+    location /t {
+        echo "ab abc ac";
+        replace_filter 'a((b)?(c)?)' '[$1|$2|$3]' g;
+    }
+--- request
+GET /t
+--- response_body
+[b|b|] [bc|b|c] [c||c]
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 3: parentheses that are not groups
+--- config
+    default_type text/html;
+    location /t {
+        echo "f(x) [y] g(z)";
+        replace_filter '([a-z])\(([^)])\)|[\[(]([a-z])[\])]' '$1<$2$3>' g;
+    }
+--- request
+GET /t
+--- response_body
+f<x> <y> g<z>
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 4: only some rules use submatches
+--- config
+    default_type text/html;
+    location /t {
+        echo "key=value; foo bar";
+        replace_filter '(\w+)=(\w+)' '$2=$1' g;
+        replace_filter 'f(o+)' '[$&]' g;
+        replace_filter 'b(a)r' 'BAR' g;
+    }
+--- request
+GET /t
+--- response_body
+value=key; [foo] BAR
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 5: the same rule set with once rules
+--- config
+    default_type text/html;
+    location /t {
+        echo "a1 b2 a3 b4";
+        replace_filter 'a(\d)' 'A$1';
+        replace_filter 'b(\d)' 'B$1' g;
+    }
+--- request
+GET /t
+--- response_body
+A1 B2 a3 B4
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 6: caseless alternatives with priorities
+--- config
+    default_type text/html;
+    location /t {
+        echo "ABCD abcd";
+        replace_filter '(ab)(c)?|(abcd)' '<$1,$2,$3>' ig;
+    }
+--- request
+GET /t
+--- response_body
+<AB,C,>D <ab,c,>d
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 7: assertions keep tracking captures everywhere
+--- config
+    default_type text/html;
+    location /t {
+        echo "hello world";
+        replace_filter '\b(w)(\w+)' '$2$1' g;
+    }
+--- request
+GET /t
+--- response_body
+hello orldw
+--- no_error_log
+[alert]
+[error]
@@ -0,0 +1,138 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_on();
+#workers(2);
+#log_level('warn');
+
+repeat_each(2);
+
+#no_shuffle();
+
+plan tests => repeat_each() * (blocks() * 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: pcre2 engine, global
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_engine pcre2;
+        echo "width: 12px; height: 3px;";
+        replace_filter '[0-9]+px' N g;
+    }
+--- request
+GET /t
+--- response_body
+width: N; height: N;
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 2: partial matches spanning buffers
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_engine pcre2;
+        content_by_lua '
+            ngx.print("a <scr")
+            ngx.flush(true)
+            ngx.print("ipt>x</scr")
+            ngx.flush(true)
+            ngx.say("ipt> b")
+        ';
+        replace_filter '<script>[^<]*</script>' '' g;
+    }
+--- request
+GET /t
+--- response_body
+a  b
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 3: a shorter alternative after a partial match
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_engine pcre2;
+        content_by_lua '
+            ngx.print("xabc")
+            ngx.flush(true)
+            ngx.say("xyz")
+        ';
+        replace_filter 'abcd|ab' '[$&]' g;
+    }
+--- request
+GET /t
+--- response_body
+x[ab]cxyz
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 4: captures of several regexes
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_engine pcre2;
+        echo "key=value; Foo-Bar";
+        replace_filter '(\w+)=(\w+)' '$2=$1' g;
+        replace_filter '(f\w+)-(b\w+)' '$2-$1' ig;
+    }
+--- request
+GET /t
+--- response_body
+value=key; Bar-Foo
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 5: once rules
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_engine pcre2;
+        echo "a1 b2 a3 b4";
+        replace_filter 'a(\d)' 'A$1';
+        replace_filter 'b(\d)' 'B$1' g;
+    }
+--- request
+GET /t
+--- response_body
+A1 B2 a3 B4
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 6: assertions fall back to sregex
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_engine pcre2;
+        echo "hello world";
+        replace_filter '^h' H;
+    }
+--- request
+GET /t
+--- response_body
+Hello world
+--- error_log
+replace_filter_engine pcre2 does not support regex "^h"
+--- no_error_log
+[alert]
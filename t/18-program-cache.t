@@ -0,0 +1,126 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_on();
+#workers(2);
+#log_level('warn');
+
+repeat_each(2);
+
+#no_shuffle();
+
+plan tests => repeat_each() * (blocks() * 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: same rules in two locations
+--- config
+    default_type text/html;
+    location /a {
+        echo "abcabd";
+        replace_filter 'ab[cd]' X g;
+    }
+    location /t {
+        echo "abdab";
+        replace_filter 'ab[cd]' Y g;
+    }
+--- request
+GET /t
+--- response_body
+Yab
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 2: same regex, different flags
+--- config
+    default_type text/html;
+    location /a {
+        echo "ABC abc";
+        replace_filter 'abc' X g;
+    }
+    location /t {
+        echo "ABC abc";
+        replace_filter 'abc' Y gi;
+    }
+--- request
+GET /t
+--- response_body
+Y Y
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 3: same regexes in a different order
+--- config
+    default_type text/html;
+    location /a {
+        echo "abc";
+        replace_filter 'ab' X;
+        replace_filter 'abc' Y;
+    }
+    location /t {
+        echo "abc";
+        replace_filter 'abc' Y;
+        replace_filter 'ab' X;
+    }
+--- request
+GET /t
+--- response_body
+Y
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 4: shared program, capturing and non-capturing replacements
+--- config
+    default_type text/html;
+    location /a {
+        echo "ab";
+        replace_filter '(a)(b)' X g;
+    }
+    location /t {
+        echo "ab";
+        replace_filter '(a)(b)' '$2$1' g;
+    }
+--- request
+GET /t
+--- response_body
+ba
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 5: shared program, different engines
+--- config
+    default_type text/html;
+    location /a {
+        replace_filter_engine dfa;
+        echo "a1b22c";
+        replace_filter '[0-9]{1,3}' N g;
+    }
+    location /t {
+        replace_filter_engine jit;
+        echo "a1b22c";
+        replace_filter '[0-9]{1,3}' N g;
+    }
+--- request
+GET /t
+--- response_body
+aNbNc
+--- no_error_log
+[alert]
+[error]
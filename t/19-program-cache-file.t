@@ -0,0 +1,80 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_on();
+#workers(2);
+#log_level('warn');
+
+repeat_each(2);
+
+#no_shuffle();
+
+plan tests => repeat_each() * (blocks() * 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: program cache file
+--- http_config
+    replace_filter_program_cache html/replace_filter.cache;
+--- config
+    default_type text/html;
+    location /t {
+        echo "abc, abd and b";
+        replace_filter 'ab[cd]' X g;
+        replace_filter 'b' Y g;
+    }
+--- request
+GET /t
+--- response_body
+X, X and Y
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 2: literal rule set
+--- http_config
+    replace_filter_program_cache html/replace_filter.cache;
+--- config
+    default_type text/html;
+    location /t {
+        echo "hello world, Hello";
+        replace_filter 'hello' hi gi;
+        replace_filter 'world' earth gi;
+    }
+--- request
+GET /t
+--- response_body
+hi earth, hi
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 3: corrupted program cache file
+--- http_config
+    replace_filter_program_cache html/bad.cache;
+--- config
+    default_type text/html;
+    location /t {
+        echo "abc";
+        replace_filter 'b' X g;
+    }
+--- user_files
+>>> bad.cache
+RFPROGS
+garbage
+--- request
+GET /t
+--- response_body
+aXc
+--- no_error_log
+[alert]
+[error]
@@ -0,0 +1,96 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_on();
+#workers(2);
+#log_level('warn');
+
+repeat_each(2);
+
+#no_shuffle();
+
+plan tests => repeat_each() * (blocks() * 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: lazy compilation
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_lazy_compile on;
+        echo "abc, abd and b";
+        replace_filter 'ab[cd]' X g;
+    }
+--- request
+GET /t
+--- response_body
+X, X and b
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 2: lazy compilation with captures
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_lazy_compile on;
+        echo "hello world";
+        replace_filter '(\w+) (\w+)' '$2 $1';
+    }
+--- request
+GET /t
+--- response_body
+world hello
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 3: rules inherited from a lazy server
+--- config
+    default_type text/html;
+    replace_filter_lazy_compile on;
+    replace_filter_engine dfa;
+    replace_filter '[0-9]+' N g;
+
+    location /a {
+        echo "a1b22c";
+    }
+
+    location /t {
+        echo "a1b22c";
+    }
+--- request
+GET /t
+--- response_body
+aNbNc
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 4: lazy location inheriting compiled rules
+--- config
+    default_type text/html;
+    replace_filter 'b+' X g;
+
+    location /t {
+        replace_filter_lazy_compile on;
+        echo "abbc";
+    }
+--- request
+GET /t
+--- response_body
+aXc
+--- no_error_log
+[alert]
+[error]
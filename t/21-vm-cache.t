@@ -0,0 +1,92 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_on();
+#workers(2);
+#log_level('warn');
+
+repeat_each(3);
+
+#no_shuffle();
+
+plan tests => repeat_each() * (blocks() * 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: reused matching state
+--- config
+    default_type text/html;
+    location /t {
+        echo "abc abd";
+        replace_filter 'ab([cd])' '<$1>' g;
+    }
+--- request
+GET /t
+--- response_body
+<c> <d>
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 2: once rules disabled in a previous request
+--- config
+    default_type text/html;
+    location /t {
+        echo "aaa bbb";
+        replace_filter 'a' X;
+        replace_filter 'b' Y g;
+    }
+--- request
+GET /t
+--- response_body
+Xaa YYY
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 3: cache disabled
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_vm_cache 0;
+        echo "abc abd";
+        replace_filter 'ab[cd]' X g;
+    }
+--- request
+GET /t
+--- response_body
+X X
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 4: subrequests
+--- config
+    default_type text/html;
+    location /t {
+        echo_location /sub;
+        echo_location /sub;
+    }
+    location /sub {
+        echo "abc";
+        replace_filter 'b' X g;
+    }
+--- request
+GET /t
+--- response_body
+aXc
+aXc
+--- no_error_log
+[alert]
+[error]
@@ -0,0 +1,92 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_on();
+#workers(2);
+#log_level('warn');
+
+repeat_each(2);
+
+#no_shuffle();
+
+plan tests => repeat_each() * (blocks() * 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: HEAD request
+--- config
+    default_type text/html;
+    location /t {
+        echo "abc";
+        replace_filter 'b' X g;
+    }
+--- request
+HEAD /t
+--- response_body
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 2: empty body
+--- config
+    default_type text/html;
+    location /t {
+        content_by_lua '
+            ngx.send_headers()
+            ngx.flush(true)
+        ';
+        replace_filter 'b' X g;
+    }
+--- request
+GET /t
+--- response_body
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 3: data after an empty flush
+--- config
+    default_type text/html;
+    location /t {
+        content_by_lua '
+            ngx.send_headers()
+            ngx.flush(true)
+            ngx.print("ab")
+            ngx.flush(true)
+            ngx.say("c")
+        ';
+        replace_filter 'abc' X g;
+    }
+--- request
+GET /t
+--- response_body
+X
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 4: 304 Not Modified
+--- config
+    default_type text/html;
+    location /t {
+        return 304;
+        replace_filter 'b' X g;
+    }
+--- request
+GET /t
+--- error_code: 304
+--- response_body
+--- no_error_log
+[alert]
+[error]
@@ -0,0 +1,69 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_on();
+#workers(2);
+#log_level('warn');
+
+repeat_each(2);
+
+#no_shuffle();
+
+plan tests => repeat_each() * (blocks() * 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: many partial matches spanning buffers
+--- config
+    default_type text/html;
+    location /t {
+        content_by_lua '
+            for i = 1, 2000 do
+                ngx.print("x ab")
+                ngx.flush(true)
+                ngx.print(i % 2 == 0 and "c " or "d ")
+                ngx.flush(true)
+            end
+            ngx.say("")
+        ';
+        replace_filter 'abc' X g;
+    }
+--- request
+GET /t
+--- response_body eval
+("x X x abd " x 1000) . "\n"
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 2: captures on pending data reused across matches
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_max_buffered_size 64;
+        content_by_lua '
+            for i = 1, 500 do
+                ngx.print("<a")
+                ngx.flush(true)
+                ngx.print("b" .. (i % 10))
+                ngx.flush(true)
+                ngx.print("> ")
+            end
+            ngx.say("")
+        ';
+        replace_filter '<(a)b(\d)>' '[$2$1]' g;
+    }
+--- request
+GET /t
+--- response_body eval
+join("", map { "[" . ($_ % 10) . "a] " } 1 .. 500) . "\n"
+--- no_error_log
+[alert]
+[error]
@@ -0,0 +1,137 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_on();
+#workers(2);
+#log_level('warn');
+
+repeat_each(2);
+
+#no_shuffle();
+
+plan tests => repeat_each() * (blocks() * 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: $& in a single buffer
+--- config
+    default_type text/html;
+    location /t {
+        echo abcabcabx;
+        replace_filter 'ab' '$&' g;
+    }
+--- request
+GET /t
+--- response_body
+abcabcabx
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 2: ${&} spanning buffers
+--- config
+    default_type text/html;
+    location /t {
+        echo -n a;
+        echo -n b;
+        echo -n c;
+        echo d;
+        replace_filter 'abc' '${&}' g;
+    }
+--- request
+GET /t
+--- response_body
+abcd
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 3: disabled once rules emit the matched data
+--- config
+    default_type text/html;
+    location /t {
+        echo -n "ab";
+        echo -n "cab";
+        echo "cdede";
+        replace_filter 'abc' X;
+        replace_filter 'de' Y g;
+    }
+--- request
+GET /t
+--- response_body
+XabcYY
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 4: empty matches
+--- config
+    default_type text/html;
+    location /t {
+        echo -n "ab";
+        echo "cd";
+        replace_filter 'x*' '$&' g;
+    }
+--- request
+GET /t
+--- response_body
+abcd
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 5: disabled once rules spanning buffers, non-capturing
+--- config
+    default_type text/html;
+    location /t {
+        echo -n "xa";
+        echo -n "bcx";
+        echo -n "ab";
+        echo "cx abd";
+        replace_filter 'abc' X;
+        replace_filter 'x|abd' Y g;
+    }
+--- request
+GET /t
+--- response_body
+YXYabcY Y
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 6: disabled once rules with many once rules
+--- config
+    default_type text/html;
+    location /t {
+        echo -n "a1b2";
+        echo -n "c3d";
+        echo "4e5 a1b2c3d4e5";
+        replace_filter 'a' A;
+        replace_filter 'b' B;
+        replace_filter 'c' C;
+        replace_filter 'd' D;
+        replace_filter 'e' E;
+        replace_filter '[0-9]' _ g;
+    }
+--- request
+GET /t
+--- response_body
+A_B_C_D_E_ a_b_c_d_e_
+--- no_error_log
+[alert]
+[error]
@@ -0,0 +1,105 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_on();
+#workers(2);
+#log_level('warn');
+
+repeat_each(2);
+
+#no_shuffle();
+
+plan tests => repeat_each() * (blocks() * 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: static file
+--- config
+    default_type text/html;
+    sendfile on;
+    location /a.html {
+        replace_filter_sendfile on;
+        replace_filter 'abc' X g;
+    }
+--- user_files
+>>> a.html
+hello abc world, abc!
+--- request
+GET /a.html
+--- response_body
+hello X world, X!
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 2: matches spanning windows
+--- config
+    default_type text/html;
+    sendfile on;
+    location /a.html {
+        replace_filter_sendfile on;
+        replace_filter_sendfile_window 4;
+        replace_filter 'abc' X g;
+    }
+--- user_files
+>>> a.html
+xxabcxxxabcabcxxxxab abc
+--- request
+GET /a.html
+--- response_body
+xxXxxxXXxxxxab X
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 3: captures and $& on windows
+--- config
+    default_type text/html;
+    sendfile on;
+    location /a.html {
+        replace_filter_sendfile on;
+        replace_filter_sendfile_window 3;
+        replace_filter '[a-c]+' '[$&]' g;
+        replace_filter 'd+' '$&';
+    }
+--- user_files
+>>> a.html
+xabcbx ddd dd cc
+--- request
+GET /a.html
+--- response_body
+x[abcb]x ddd dd [cc]
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 4: the rest of the file is passed through after a once rule
+--- config
+    default_type text/html;
+    sendfile on;
+    location /a.html {
+        replace_filter_sendfile on;
+        replace_filter_sendfile_window 5;
+        replace_filter 'abc' X;
+    }
+--- user_files
+>>> a.html
+1abc2abc3abc4abc5abc
+--- request
+GET /a.html
+--- response_body
+1X2abc3abc4abc5abc
+--- no_error_log
+[alert]
+[error]
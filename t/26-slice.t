@@ -0,0 +1,94 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_on();
+#workers(2);
+#log_level('warn');
+
+repeat_each(2);
+
+#no_shuffle();
+
+plan tests => repeat_each() * (blocks() * 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: matches spanning slices of one buffer
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_slice 4;
+        echo "xxabcxxxabcabcxxxxab abc";
+        replace_filter 'abc' X g;
+    }
+--- request
+GET /t
+--- response_body
+xxXxxxXXxxxxab X
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 2: a large body resumed by posted events
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_slice 1k;
+        content_by_lua '
+            ngx.print(string.rep("hello, world! ", 10000))
+            ngx.say("")
+        ';
+        replace_filter 'wor(ld)' '[$1]' g;
+    }
+--- request
+GET /t
+--- response_body eval
+("hello, [ld]! " x 10000) . "\n"
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 3: slices of a static file
+--- config
+    default_type text/html;
+    location /a.html {
+        replace_filter_slice 3;
+        replace_filter '[a-c]+' '[$&]' g;
+    }
+--- user_files
+>>> a.html
+xabcbx ddd dd cc
+--- request
+GET /a.html
+--- response_body
+x[abcb]x ddd dd [cc]
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 4: a whole slice left pending
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_slice 4;
+        echo "abcdefghz xz";
+        replace_filter 'a[^z]*z' X g;
+    }
+--- request
+GET /t
+--- response_body
+X xz
+--- no_error_log
+[alert]
+[error]
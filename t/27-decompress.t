@@ -0,0 +1,126 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_on();
+#workers(2);
+#log_level('warn');
+
+repeat_each(2);
+
+#no_shuffle();
+
+plan tests => repeat_each() * (blocks() * 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: gzip
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_decompress on;
+        content_by_lua '
+            ngx.header.content_encoding = "gzip"
+            ngx.print(ngx.decode_base64("H4sIAAAAAAACA8tIzcnJVyjPL8pJ4QIALTsIrwwAAAA="))
+        ';
+        replace_filter world X;
+    }
+--- request
+GET /t
+--- response_body
+hello X
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 2: deflate
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_decompress on;
+        content_by_lua '
+            ngx.header.content_encoding = "deflate"
+            ngx.print(ngx.decode_base64("eJxLTEpWSElNU0hMSuYCABotA8Y="))
+        ';
+        replace_filter abc "[$&]" g;
+    }
+--- request
+GET /t
+--- response_body
+[abc] def [abc]
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 3: compressed data in several bufs, inflated into small windows
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_decompress on;
+        replace_filter_decompress_buffers 2 16;
+        content_by_lua '
+            local s = ngx.decode_base64("H4sIAAAAAAACA8tIzcnJ11Eozy/KSVFUyBjljfJGeaO8Ud4ob5Q3yhvljfKGFY8LAFakrmvxCgAA")
+            ngx.header.content_encoding = "gzip"
+            ngx.print(string.sub(s, 1, 20))
+            ngx.flush(true)
+            ngx.print(string.sub(s, 21))
+        ';
+        replace_filter 'w(or)ld' '$1' g;
+    }
+--- request
+GET /t
+--- response_body eval
+("hello, or! " x 200) . "\n"
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 4: other encodings are left alone
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_decompress on;
+        content_by_lua '
+            ngx.header.content_encoding = "br"
+            ngx.say("hello world")
+        ';
+        replace_filter world X;
+    }
+--- request
+GET /t
+--- response_body
+hello world
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 5: multi-member gzip
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_decompress on;
+        content_by_lua '
+            ngx.header.content_encoding = "gzip"
+            ngx.print(ngx.decode_base64("H4sIAAAAAAACA8tIzcnJVwAA9vmB7QYAAAAfiwgAAAAAAAIDK88vyknhAgCoYTjdBgAAAA=="))
+        ';
+        replace_filter 'o w' X;
+    }
+--- request
+GET /t
+--- response_body
+hellXorld
+--- no_error_log
+[alert]
+[error]
@@ -0,0 +1,203 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_on();
+#workers(2);
+#log_level('warn');
+
+repeat_each(2);
+
+#no_shuffle();
+
+plan tests => repeat_each() * (blocks() * 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: the output is served from the cache for the same key
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_cache zone=replaced:1m key=k;
+        replace_filter foo X g;
+        content_by_lua 'ngx.say(ngx.var.arg_v)';
+    }
+
+    location = /main {
+        content_by_lua '
+            local res = ngx.location.capture("/t?v=foo")
+            ngx.print(res.body)
+            res = ngx.location.capture("/t?v=bar")
+            ngx.print(res.body)
+        ';
+    }
+--- request
+GET /main
+--- response_body
+X
+X
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 2: empty keys are not cached
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_cache zone=replaced:1m key=$arg_k;
+        replace_filter foo X g;
+        content_by_lua 'ngx.say(ngx.var.arg_v)';
+    }
+
+    location = /main {
+        content_by_lua '
+            local res = ngx.location.capture("/t?v=foo")
+            ngx.print(res.body)
+            res = ngx.location.capture("/t?v=bar")
+            ngx.print(res.body)
+        ';
+    }
+--- request
+GET /main
+--- response_body
+X
+bar
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 3: replacements with nginx variables are not cached
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_cache zone=replaced:1m key=k;
+        replace_filter foo $arg_r g;
+        echo foo;
+    }
+
+    location = /main {
+        content_by_lua '
+            local res = ngx.location.capture("/t?r=1")
+            ngx.print(res.body)
+            res = ngx.location.capture("/t?r=2")
+            ngx.print(res.body)
+        ';
+    }
+--- request
+GET /main
+--- response_body
+1
+2
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 4: outputs larger than max_size are not cached
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_cache zone=replaced:1m key=k max_size=2;
+        replace_filter foo X g;
+        content_by_lua 'ngx.say(ngx.var.arg_v)';
+    }
+
+    location = /main {
+        content_by_lua '
+            local res = ngx.location.capture("/t?v=foo")
+            ngx.print(res.body)
+            res = ngx.location.capture("/t?v=bar")
+            ngx.print(res.body)
+        ';
+    }
+--- request
+GET /main
+--- response_body
+X
+bar
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 5: the rules are part of the key
+--- config
+    default_type text/html;
+    location /a {
+        replace_filter_cache zone=replaced:1m key=k;
+        replace_filter foo X g;
+        echo foo;
+    }
+
+    location /b {
+        replace_filter_cache zone=replaced key=k;
+        replace_filter foo Y g;
+        echo foo;
+    }
+
+    location = /main {
+        content_by_lua '
+            local res = ngx.location.capture("/a")
+            ngx.print(res.body)
+            res = ngx.location.capture("/b")
+            ngx.print(res.body)
+        ';
+    }
+--- request
+GET /main
+--- response_body
+X
+Y
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 6: the buffering limits are part of the key
+--- config
+    default_type text/html;
+    location /a {
+        replace_filter_cache zone=replaced:1m key=k;
+        replace_filter_max_buffered_size 2;
+        replace_filter abcd X g;
+        echo -n ab;
+        echo -n c;
+        echo d;
+    }
+
+    location /b {
+        replace_filter_cache zone=replaced key=k;
+        replace_filter abcd X g;
+        echo -n ab;
+        echo -n c;
+        echo d;
+    }
+
+    location = /main {
+        content_by_lua '
+            local res = ngx.location.capture("/a")
+            ngx.print(res.body)
+            res = ngx.location.capture("/b")
+            ngx.print(res.body)
+        ';
+    }
+--- request
+GET /main
+--- response_body
+abcd
+X
+--- error_log
+replace filter: exceeding replace_filter_max_buffered_size (2): 3
+--- no_error_log
+[error]
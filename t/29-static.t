@@ -0,0 +1,77 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_on();
+#workers(2);
+#log_level('warn');
+
+repeat_each(2);
+
+#no_shuffle();
+
+plan tests => repeat_each() * (blocks() * 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: the sidecar file is written, then sent
+--- config
+    default_type text/html;
+    location /a.html {
+        replace_filter_static on;
+        replace_filter abc X g;
+    }
+--- user_files
+>>> a.html
+abc def abc
+--- request
+GET /a.html
+--- response_body
+X def X
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 2: replacements with nginx variables are filtered every time
+--- config
+    default_type text/html;
+    location /a.html {
+        replace_filter_static on;
+        replace_filter abc $arg_r g;
+    }
+--- user_files
+>>> a.html
+abc def abc
+--- request
+GET /a.html?r=Y
+--- response_body
+Y def Y
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 3: other rules get their own sidecar file
+--- config
+    default_type text/html;
+    location /a.html {
+        replace_filter_static on;
+        replace_filter def Z;
+    }
+--- user_files
+>>> a.html
+abc def abc
+--- request
+GET /a.html
+--- response_body
+abc Z abc
+--- no_error_log
+[alert]
+[error]
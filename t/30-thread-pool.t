@@ -0,0 +1,80 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_on();
+#workers(2);
+#log_level('warn');
+
+repeat_each(2);
+
+#no_shuffle();
+
+plan tests => repeat_each() * (blocks() * 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: large body in the thread pool
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_thread_pool default threshold=0;
+        content_by_lua '
+            ngx.print(string.rep("-", 8000) .. "abc" .. string.rep("-", 8000)
+                      .. "abc\\n")
+        ';
+        replace_filter abc X g;
+    }
+--- request
+GET /t
+--- response_body eval
+("-" x 8000) . "X" . ("-" x 8000) . "X\n"
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 2: below the threshold
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_thread_pool default threshold=1m;
+        content_by_lua '
+            ngx.print(string.rep("-", 8000) .. "abc\\n")
+        ';
+        replace_filter abc X g;
+    }
+--- request
+GET /t
+--- response_body eval
+("-" x 8000) . "X\n"
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 3: captures across flushed bufs
+--- config
+    default_type text/html;
+    location /t {
+        replace_filter_thread_pool default threshold=0;
+        content_by_lua '
+            ngx.print(string.rep("-", 5000) .. "ab")
+            ngx.flush(true)
+            ngx.print("c" .. string.rep("-", 5000) .. "\\n")
+        ';
+        replace_filter (a)(b)(c) $3$2$1 g;
+    }
+--- request
+GET /t
+--- response_body eval
+("-" x 5000) . "cba" . ("-" x 5000) . "\n"
+--- no_error_log
+[alert]
+[error]
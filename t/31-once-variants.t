@@ -0,0 +1,137 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_on();
+#workers(2);
+#log_level('warn');
+
+repeat_each(2);
+
+#no_shuffle();
+
+plan tests => repeat_each() * (blocks() * 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: a fired once rule no longer matches
+--- config
+    default_type text/html;
+    location /t {
+        echo abcabcabc;
+        replace_filter 'a[b]c' X;
+        replace_filter 'b[c]' Y g;
+    }
+--- request
+GET /t
+--- response_body
+XaYaY
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 2: once rules firing one after the other
+--- config
+    default_type text/html;
+    location /t {
+        echo -n "fo";
+        echo -n "o ba";
+        echo "r foo bar baz baz";
+        replace_filter 'fo+' X;
+        replace_filter 'ba[rz]' Y;
+        replace_filter '[ ]' _ g;
+    }
+--- request
+GET /t
+--- response_body
+X_Y_foo_bar_baz_baz
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 3: captures after the once rules fired
+--- config
+    default_type text/html;
+    location /t {
+        echo "abc abc 12 34";
+        replace_filter 'a(b)c' '[$1]';
+        replace_filter '(\d)(\d)' '$2$1' g;
+    }
+--- request
+GET /t
+--- response_body
+[b] abc 21 43
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 4: inherited by a nested location
+--- config
+    default_type text/html;
+    replace_filter 'a[b]c' X;
+    replace_filter 'b[c]' Y g;
+    location /t {
+        echo abcabcabc;
+    }
+--- request
+GET /t
+--- response_body
+XaYaY
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 5: more once rules than variants
+--- config
+    default_type text/html;
+    location /t {
+        echo abcdefabcdef;
+        replace_filter 'a' A;
+        replace_filter 'b' B;
+        replace_filter 'c' C;
+        replace_filter 'd' D;
+        replace_filter 'e' E;
+        replace_filter '[f]' F g;
+    }
+--- request
+GET /t
+--- response_body
+ABCDEFabcdeF
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 6: locations sharing the rule set with other limits
+--- config
+    default_type text/html;
+    location /a {
+        echo abcabcabc;
+        replace_filter 'a[b]c' X;
+        replace_filter 'b[c]' Y g;
+    }
+    location /b {
+        echo abcabcabc;
+        replace_filter 'a[b]c' X n=2;
+        replace_filter 'b[c]' Y g;
+    }
+--- request
+GET /b
+--- response_body
+XXaY
+--- no_error_log
+[alert]
+[error]
@@ -0,0 +1,72 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_on();
+#workers(2);
+#log_level('warn');
+
+repeat_each(2);
+
+#no_shuffle();
+
+plan tests => repeat_each() * (blocks() * 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: n=K on a single rule
+--- config
+    default_type text/html;
+    location /t {
+        echo -n "abab";
+        echo "ababab";
+        replace_filter 'ab' X n=3;
+    }
+--- request
+GET /t
+--- response_body
+XXXabab
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 2: n=K with regex options and a global rule
+--- config
+    default_type text/html;
+    location /t {
+        echo "a1 A2 a3 a4 a5";
+        replace_filter 'a' X i n=2;
+        replace_filter '[0-9]' _ g;
+    }
+--- request
+GET /t
+--- response_body
+X_ X_ a_ a_ a_
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 3: replace_filter_max_replacements
+--- config
+    default_type text/html;
+    location /t {
+        echo -n "foo foo ";
+        echo "foo foo foo";
+        replace_filter 'fo+' bar g;
+        replace_filter_max_replacements 3;
+    }
+--- request
+GET /t
+--- response_body
+bar bar bar foo foo
+--- no_error_log
+[alert]
+[error]
@@ -0,0 +1,93 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_on();
+#workers(2);
+#log_level('warn');
+
+repeat_each(2);
+
+#no_shuffle();
+
+plan tests => repeat_each() * (blocks() * 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: scan limit
+--- config
+    default_type text/html;
+    location /t {
+        echo -n "abc abc ";
+        echo "abc abc";
+        replace_filter 'abc' X g;
+        replace_filter_scan_limit 6;
+    }
+--- request
+GET /t
+--- response_body
+X abc abc abc
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 2: no match across the scan limit
+--- config
+    default_type text/html;
+    location /t {
+        echo "abcdabcd";
+        replace_filter 'ab|bcd' X g;
+        replace_filter_scan_limit 3;
+    }
+--- request
+GET /t
+--- response_body
+Xcdabcd
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 3: stop at a string spanning buffers
+--- config
+    default_type text/html;
+    location /t {
+        echo -n "<p>a</h";
+        echo -n "ea";
+        echo "d><p>a</p>";
+        replace_filter 'a' X g;
+        replace_filter_stop_at '</head>';
+    }
+--- request
+GET /t
+--- response_body
+<p>X</hXd><p>a</p>
+--- no_error_log
+[alert]
+[error]
+
+
+
+=== TEST 4: stop at with a partial occurrence first
+--- config
+    default_type text/html;
+    location /t {
+        echo -n "a<<";
+        echo "<!a<!-a";
+        replace_filter 'a' X g;
+        replace_filter_stop_at '<!-';
+    }
+--- request
+GET /t
+--- response_body
+X<<<!X<!-a
+--- no_error_log
+[alert]
+[error]
@@ -0,0 +1,134 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_on();
+#workers(2);
+#log_level('warn');
+
+repeat_each(2);
+
+#no_shuffle();
+
+plan tests => repeat_each() * (blocks() * 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: stop replacing after an overflow by default
+--- config
+    replace_filter_max_buffered_size 2;
+    default_type text/html;
+    location = /t {
+        echo -n ab;
+        echo -n c;
+        echo -n "d ";
+        echo "e e";
+        replace_filter 'abcd|e' 'X' g;
+    }
+--- request
+GET /t
+--- response_body
+abcd e e
+--- error_log
+replace filter: exceeding replace_filter_max_buffered_size (2): 3
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: restart after an overflow (literal strings)
+--- config
+    replace_filter_max_buffered_size 2;
+    default_type text/html;
+    location = /t {
+        echo -n ab;
+        echo -n c;
+        echo -n "d ";
+        echo "e e";
+        replace_filter 'abcd|e' 'X' g;
+        replace_filter_overflow restart;
+    }
+--- request
+GET /t
+--- response_body
+abcd X X
+--- error_log
+replace filter: exceeding replace_filter_max_buffered_size (2): 3
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: restart after an overflow (regexes)
+--- config
+    replace_filter_max_buffered_size 2;
+    default_type text/html;
+    location = /t {
+        echo -n ab;
+        echo -n c;
+        echo -n "d ";
+        echo "e abbcd";
+        replace_filter 'ab+cd|e' 'X' g;
+        replace_filter_overflow restart;
+    }
+--- request
+GET /t
+--- response_body
+abcd X X
+--- error_log
+replace filter: exceeding replace_filter_max_buffered_size (2): 3
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: restart right after a pending match
+--- config
+    replace_filter_max_buffered_size 2;
+    default_type text/html;
+    location = /t {
+        echo -n zabxxxx;
+        echo "w ab";
+        replace_filter 'abx*y|ab' 'X' g;
+        replace_filter_overflow restart;
+    }
+--- request
+GET /t
+--- response_body
+zXxxxxw X
+--- error_log
+replace filter: exceeding replace_filter_max_buffered_size (2): 4
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: count the overflows
+--- http_config
+    log_format overflows "overflows: $replace_filter_overflows";
+--- config
+    replace_filter_max_buffered_size 2;
+    default_type text/html;
+    location = /t {
+        echo -n ab;
+        echo -n c;
+        echo -n "d ";
+        echo -n "e ab";
+        echo -n c;
+        echo "d e";
+        replace_filter 'abcd|e' 'X' g;
+        replace_filter_overflow restart;
+        access_log logs/error.log overflows;
+    }
+--- request
+GET /t
+--- response_body
+abcd X abcd X
+--- error_log
+overflows: 2
+--- no_error_log
+[alert]